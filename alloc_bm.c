@@ -0,0 +1,157 @@
+// Benchmark BLT and CBT with different allocators. For example:
+//
+//   $ alloc_bm < /usr/share/dict/words
+//
+// For each allocator we insert the keys, look them up, delete them, and
+// throw the tree away. The allocators are:
+//
+//   malloc  The default: malloc() and free(), whichever library provides them.
+//   arena   Bump allocation from large chunks. Frees are ignored, and the
+//           chunks are released together when the tree is gone.
+//   pool    Free lists for each multiple of 16 bytes, carved from large
+//           chunks. Freed blocks are reused for later blocks of the same size.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+#include "cbt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+enum { CHUNK = 1 << 20, ALIGN = 16 };
+
+// Chunks are chained through their first word.
+struct arena_s {
+  char *chunk, *p, *end;
+};
+
+static void *arena_alloc(void *ctx, size_t n) {
+  struct arena_s *a = ctx;
+  n = (n + ALIGN - 1) & -ALIGN;
+  if (a->p + n > a->end) {
+    size_t size = n + ALIGN > CHUNK ? n + ALIGN : CHUNK;
+    char *c = malloc(size);
+    *(char **) c = a->chunk;
+    a->chunk = c;
+    a->p = c + ALIGN;
+    a->end = c + size;
+  }
+  void *res = a->p;
+  a->p += n;
+  return res;
+}
+
+static void arena_free(void *ctx, void *p, size_t n) {}
+
+static void arena_release(struct arena_s *a) {
+  while (a->chunk) {
+    char *next = *(char **) a->chunk;
+    free(a->chunk);
+    a->chunk = next;
+  }
+  a->p = a->end = 0;
+}
+
+// Larger blocks, such as long keys, go to malloc().
+enum { POOL_CLASSES = 16 };
+
+struct pool_s {
+  struct arena_s arena;
+  void *free[POOL_CLASSES];
+};
+
+static void *pool_alloc(void *ctx, size_t n) {
+  struct pool_s *pool = ctx;
+  size_t c = (n + ALIGN - 1) / ALIGN;
+  if (c >= POOL_CLASSES) return malloc(n);
+  void *p = pool->free[c];
+  if (!p) return arena_alloc(&pool->arena, c * ALIGN);
+  pool->free[c] = *(void **) p;
+  return p;
+}
+
+static void pool_free(void *ctx, void *p, size_t n) {
+  struct pool_s *pool = ctx;
+  size_t c = (n + ALIGN - 1) / ALIGN;
+  if (c >= POOL_CLASSES) {
+    free(p);
+    return;
+  }
+  *(void **) p = pool->free[c];
+  pool->free[c] = p;
+}
+
+static void pool_release(struct pool_s *pool) {
+  arena_release(&pool->arena);
+  REP(i, POOL_CLASSES) pool->free[i] = 0;
+}
+
+void f(char **key, int m) {
+  // Drop duplicate keys, so every delete finds its key.
+  cbt_t seen = cbt_new();
+  int n = 0;
+  REP(i, m) if (!cbt_has(seen, key[i])) {
+    cbt_put_at(seen, 0, key[i]);
+    key[n++] = key[i];
+  }
+  cbt_delete(seen);
+  m = n;
+
+  struct arena_s arena = { 0 };
+  struct pool_s pool = { { 0 } };
+  struct {
+    char *name;
+    void *(*alloc)(void *, size_t);
+    void (*dealloc)(void *, void *, size_t);
+    void *ctx;
+  } mem[] = {
+    { "malloc", 0, 0, 0 },
+    { "arena", arena_alloc, arena_free, &arena },
+    { "pool", pool_alloc, pool_free, &pool },
+  };
+  char msg[64];
+  REP(k, sizeof(mem) / sizeof(*mem)) {
+    bm_init();
+    BLT *blt = blt_new_with_allocator(mem[k].alloc, mem[k].dealloc, mem[k].ctx);
+    REP(i, m) blt_put(blt, key[i], (void *) (intptr_t) i);
+    sprintf(msg, "BLT %s insert", mem[k].name);
+    bm_report(msg);
+    REP(i, m) if (blt_get(blt, key[i])->data != (void *) (intptr_t) i) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    sprintf(msg, "BLT %s get", mem[k].name);
+    bm_report(msg);
+    REP(i, m) blt_delete(blt, key[i]);
+    blt_clear(blt);
+    arena_release(&arena);
+    pool_release(&pool);
+    sprintf(msg, "BLT %s delete", mem[k].name);
+    bm_report(msg);
+
+    cbt_t cbt = cbt_new_with_allocator(mem[k].alloc, mem[k].dealloc,
+        mem[k].ctx);
+    REP(i, m) cbt_put_at(cbt, (void *) (intptr_t) i, key[i]);
+    sprintf(msg, "CBT %s insert", mem[k].name);
+    bm_report(msg);
+    REP(i, m) if (cbt_get_at(cbt, key[i]) != (void *) (intptr_t) i) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    sprintf(msg, "CBT %s get", mem[k].name);
+    bm_report(msg);
+    REP(i, m) cbt_remove(cbt, key[i]);
+    cbt_delete(cbt);
+    arena_release(&arena);
+    pool_release(&pool);
+    sprintf(msg, "CBT %s delete", mem[k].name);
+    bm_report(msg);
+  }
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
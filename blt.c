@@ -29,37 +29,55 @@
 //     it's fine if it simply returns 0 or nonzero. This means we can store
 //     the plain bitmask instead of its inversion, and check the bit with
 //     a single AND.
+//   - Snapshots: an internal node records the generation in which its pair of
+//     children was allocated. A pair is shared with a snapshot if it was born
+//     no later than the snapshot, in which case a writer copies it before
+//     modifying anything inside it. Only pairs along the modified path are
+//     copied, and no reference counts are needed: a pair or key replaced while
+//     snapshots are alive is kept on a list, tagged with the range of
+//     generations that can see it, until the last such snapshot is released.
+//   - The root lives in a block of its own, so the whole tree hangs off a
+//     single pointer. In RCU mode, nodes reachable by readers are never
+//     modified in place. Instead, the writer copies the block containing the
+//     node it would have changed, edits the copy, and publishes it with a
+//     single pointer store to the parent's kid or to the root. Readers thus
+//     see either the old or the new version of a block, and need no locks or
+//     atomic instructions. Replaced blocks and keys are freed once every
+//     reader has passed through a quiescent state (QSBR).
+//   - Concurrent writers: leaves are never modified, and an internal node
+//     changes only by a 16-byte compare-and-swap of the whole node that swaps
+//     in a new kid. To replace a block, a writer first freezes its internal
+//     nodes, which stops anyone else from changing their kids, copies it,
+//     then swaps the copy into the parent, which fails if the parent is
+//     frozen or has moved on. On failure the writer thaws what it froze and
+//     starts over from the root. Readers ignore the frozen bit entirely.
+//   - Optimistic lock coupling (OLC) is the alternative for RCU trees: nodes
+//     are modified in place, and an internal node's generation and frozen bit
+//     become a version and lock bit guarding its pair of kids. Readers take
+//     no locks; they check that the version guarding each node they read is
+//     unchanged afterwards, and restart otherwise. Writers lock the one or
+//     two versions guarding the nodes they change, and bump them on release.
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "blt.h"
+#include "first_diff.h"
 
-// Returns the byte where each bit is 1 except for the bit corresponding to
-// the leading bit of x.
-static inline uint8_t to_mask(uint8_t x) {
-  // SWAR trick that sets every bit after the leading bit to 1.
-  x |= x >> 1;
-  x |= x >> 2;
-  x |= x >> 4;
-  // Zero all the bits after the leading bit then invert.
-  return x & ~(x >> 1);
-  if (0) {
-    // Alternative that performs better when there are few set bits.
-    // Zero all bits except leading bit with a bit-twiddling trick.
-    while (x&(x-1)) x &= x-1;
-    // Invert.
-    return 255 - x;
-  }
-}
+// Returns the byte where each bit is 0 except for the leading bit of x,
+// or 0 if x is 0.
+static inline uint8_t to_mask(uint8_t x) { return x ? leading_bit(x) : 0; }
 
 // An internal node. Leaf nodes are described by BLT_IT.
 struct blt_node_s {
   unsigned int byte:32;     // Byte # of difference.
   unsigned int mask:8;      // ~mask = the crit bit within the byte.
-  unsigned int padding:23;
+  unsigned int gen:22;      // Generation in which kid was allocated.
+  unsigned int frozen:1;    // Kid may no longer change (concurrent writers).
   // The following bit corresponds to the last bit of the pointer to the key
   // in the external node, which is always zero due to malloc alignment.
   unsigned int is_internal:1;
@@ -71,35 +89,477 @@ static inline blt_node_ptr follow(blt_node_ptr p, char *key) {
   return key[p->byte] & p->mask ? p->kid + 1 : p->kid;
 }
 
+// Snapshot bookkeeping, allocated when the first snapshot is taken.
+struct blt_cow_s {
+  int n, max;               // Generations of live snapshots.
+  int *live;
+  int nretired, maxretired;
+  struct blt_retired_s {
+    void *p;
+    int n;                  // Size of p, for the allocator.
+    int birth, death;       // Visible to snapshots in [birth, death).
+  } *retired;
+};
+
+enum { RCU_READERS = 128 };
+
+// Memory waiting for readers to move on. If fun is set, p is a copy of a
+// deleted leaf to pass to it first. Items are freed in the order they were
+// retired, so the key of such a leaf must be retired after the copy.
+struct blt_limbo_s {
+  int n, max;
+  struct {
+    void *p;
+    void (*fun)(BLT_IT *);
+    uint64_t epoch;         // Writer's epoch when p was unlinked.
+  } *item;
+};
+
+// RCU bookkeeping. Each reader records the epoch at its last quiescent
+// state, or 0 if it is offline. Concurrent writers are also readers, and keep
+// their own limbo lists.
+struct blt_rcu_s {
+  uint64_t epoch;
+  struct blt_limbo_s limbo;
+  struct {
+    uint64_t epoch;
+    int used;
+    struct blt_limbo_s limbo;
+  } __attribute__((aligned(64))) reader[RCU_READERS];
+  struct blt_node_s head;   // Its version guards the root in OLC trees.
+};
+
+// Hooks from blt_new_with_allocator(), or both NULL.
+struct blt_alloc_s {
+  void *(*alloc)(void *ctx, size_t n);
+  void (*dealloc)(void *ctx, void *p, size_t n);
+  void *ctx;
+};
+
 struct BLT {
-  struct blt_node_s root[1];
-  int empty;
+  blt_node_ptr root;        // A block holding the root node, or NULL.
+  int gen;                  // Current generation.
+  int snapgen;              // Generation of newest live snapshot, or -1.
+  BLT *origin;              // For snapshots, the tree they were taken from.
+  struct blt_cow_s *cow;
+  struct blt_rcu_s *rcu;    // Non-NULL for trees with concurrent readers.
+  struct blt_alloc_s mem;
 };
 
+static inline void *mem_alloc(struct blt_alloc_s *mem, size_t n) {
+  return mem->alloc ? mem->alloc(mem->ctx, n) : malloc(n);
+}
+
+static inline void mem_free(struct blt_alloc_s *mem, void *p, size_t n) {
+  if (mem->dealloc) mem->dealloc(mem->ctx, p, n); else free(p);
+}
+
+static inline char *mem_strdup(struct blt_alloc_s *mem, char *key) {
+  if (!mem->alloc) return strdup(key);
+  size_t n = strlen(key) + 1;
+  return memcpy(mem->alloc(mem->ctx, n), key, n);
+}
+
+// free() ignores sizes, so we skip measuring keys for it.
+static inline size_t key_size(struct blt_alloc_s *mem, char *key) {
+  return mem->dealloc ? strlen(key) + 1 : 0;
+}
+
+// Readers load the root exactly once per operation, as an RCU writer may
+// replace it at any time.
+static inline blt_node_ptr get_root(BLT *blt) {
+  return __atomic_load_n(&blt->root, __ATOMIC_ACQUIRE);
+}
+
+static inline void publish(blt_node_ptr *slot, blt_node_ptr p) {
+  __atomic_store_n(slot, p, __ATOMIC_RELEASE);
+}
+
 BLT *blt_new() {
   BLT *blt = malloc(sizeof(*blt));
-  blt->empty = 1;
+  blt->root = 0;
+  blt->gen = 0;
+  blt->snapgen = -1;
+  blt->origin = 0;
+  blt->cow = 0;
+  blt->rcu = 0;
+  blt->mem = (struct blt_alloc_s) { 0 };
   return blt;
 }
 
-void blt_clear(BLT *blt) {
-  void free_node(blt_node_ptr p) {
-    if (!p->is_internal) {
-      free(((BLT_IT *) p)->key);
-      return;
+BLT *blt_new_with_allocator(void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx) {
+  if (!alloc != !dealloc) return 0;
+  BLT *blt = blt_new();
+  blt->mem = (struct blt_alloc_s) { alloc, dealloc, ctx };
+  return blt;
+}
+
+BLT *blt_new_rcu() {
+  struct blt_rcu_s *rcu;
+  if (posix_memalign((void **) &rcu, 64, sizeof(*rcu))) return 0;
+  memset(rcu, 0, sizeof(*rcu));
+  rcu->epoch = 1;
+  BLT *blt = blt_new();
+  blt->rcu = rcu;
+  return blt;
+}
+
+int blt_rcu_register(BLT *blt) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  for (int i = 0; i < RCU_READERS; i++) {
+    if (__atomic_exchange_n(&rcu->reader[i].used, 1, __ATOMIC_SEQ_CST)) {
+      continue;
+    }
+    blt_rcu_quiescent(blt, i);
+    // Pairs with the fence in rcu_reclaim(): either the writer sees we are
+    // online, or we see everything it unlinked before freeing it.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return i;
+  }
+  return -1;
+}
+
+void blt_rcu_quiescent(BLT *blt, int reader) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  __atomic_store_n(&rcu->reader[reader].epoch,
+      __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// Frees everything in a limbo list unlinked before the oldest quiescent
+// state of any reader.
+static void rcu_reclaim(struct blt_rcu_s *rcu, struct blt_limbo_s *limbo) {
+  uint64_t min = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < RCU_READERS; i++) {
+    uint64_t e = __atomic_load_n(&rcu->reader[i].epoch, __ATOMIC_ACQUIRE);
+    if (e && e < min) min = e;
+  }
+  int k = 0;
+  for (int i = 0; i < limbo->n; i++) {
+    if (limbo->item[i].epoch < min) {
+      if (limbo->item[i].fun) limbo->item[i].fun(limbo->item[i].p);
+      free(limbo->item[i].p);
+    } else {
+      limbo->item[k++] = limbo->item[i];
+    }
+  }
+  limbo->n = k;
+}
+
+static void rcu_retire(struct blt_rcu_s *rcu, struct blt_limbo_s *limbo,
+    void *p) {
+  if (limbo->n == limbo->max) {
+    rcu_reclaim(rcu, limbo);
+    // Only grow the list if slow readers are holding on to most of it.
+    if (limbo->n >= limbo->max / 2) {
+      limbo->max = limbo->max ? 2 * limbo->max : 1024;
+      limbo->item = realloc(limbo->item, limbo->max * sizeof(*limbo->item));
+    }
+  }
+  limbo->item[limbo->n].p = p;
+  limbo->item[limbo->n].fun = 0;
+  limbo->item[limbo->n].epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+  limbo->n++;
+}
+
+static void limbo_free(struct blt_limbo_s *limbo) {
+  for (int i = 0; i < limbo->n; i++) {
+    if (limbo->item[i].fun) limbo->item[i].fun(limbo->item[i].p);
+    free(limbo->item[i].p);
+  }
+  free(limbo->item);
+  limbo->n = limbo->max = 0;
+  limbo->item = 0;
+}
+
+void blt_rcu_unregister(BLT *blt, int reader) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  __atomic_store_n(&rcu->reader[reader].epoch, 0, __ATOMIC_RELEASE);
+  // Anything a concurrent writer leaves behind stays with the slot.
+  struct blt_limbo_s *limbo = &rcu->reader[reader].limbo;
+  if (limbo->n) {
+    rcu_reclaim(rcu, limbo);
+  }
+  __atomic_store_n(&rcu->reader[reader].used, 0, __ATOMIC_RELEASE);
+}
+
+static void cow_retire(BLT *blt, void *p, int n, int birth) {
+  struct blt_cow_s *cow = blt->cow;
+  if (cow->nretired == cow->maxretired) {
+    cow->maxretired = cow->maxretired ? 2 * cow->maxretired : 64;
+    cow->retired = realloc(cow->retired,
+        cow->maxretired * sizeof(*cow->retired));
+  }
+  struct blt_retired_s *r = cow->retired + cow->nretired++;
+  r->p = p;
+  r->n = n;
+  r->birth = birth;
+  r->death = blt->gen;
+}
+
+// Frees n bytes at p that were unlinked from the tree and allocated in the
+// given generation, unless a reader or snapshot might still refer to them.
+// We don't track when keys are born, so we assume they are old.
+static void discard(BLT *blt, void *p, int n, int birth) {
+  if (blt->rcu) {
+    rcu_retire(blt->rcu, &blt->rcu->limbo, p);
+  } else if (birth <= blt->snapgen) {
+    cow_retire(blt, p, n, birth);
+  } else {
+    mem_free(&blt->mem, p, n);
+  }
+}
+
+// In RCU mode, replaces the node p in the block hanging from *slot with a
+// copy of the node t, by publishing an edited copy of the block.
+// Otherwise overwrites p with t.
+static void replace(BLT *blt, blt_node_ptr *slot, blt_node_ptr p,
+    blt_node_ptr t) {
+  if (!blt->rcu) {
+    *p = *t;
+    return;
+  }
+  blt_node_ptr b = *slot;
+  int n = slot == &blt->root ? 1 : 2;
+  blt_node_ptr c = malloc(n * sizeof(*c));
+  memcpy(c, b, n * sizeof(*c));
+  c[p - b] = *t;
+  publish(slot, c);
+  rcu_retire(blt->rcu, &blt->rcu->limbo, b);
+}
+
+// Gives an internal node its own copy of its pair of children if a snapshot
+// shares them.
+static inline void cow_node(BLT *blt, blt_node_ptr p) {
+  if ((int) p->gen > blt->snapgen) return;
+  blt_node_ptr q = mem_alloc(&blt->mem, 2 * sizeof(*q));
+  q[0] = p->kid[0];
+  q[1] = p->kid[1];
+  cow_retire(blt, p->kid, 2 * sizeof(*q), p->gen);
+  p->kid = q;
+  p->gen = blt->gen;
+}
+
+// Copies every pair shared with a snapshot along the path to the given key,
+// so the path can be modified in place. Returns the leaf it ends at.
+static BLT_IT *cow_path(BLT *blt, char *key) {
+  if (!blt->root) return 0;
+  blt_node_ptr p = blt->root;
+  int keylen = strlen(key);
+  while (p->is_internal) {
+    cow_node(blt, p);
+    p = p->byte < keylen && (key[p->byte] & p->mask) ? p->kid + 1 : p->kid;
+  }
+  return (BLT_IT *) p;
+}
+
+BLT *blt_snapshot(BLT *blt) {
+  assert(!blt->origin && !blt->rcu);
+  assert(blt->gen < (1 << 22) - 1);
+  struct blt_cow_s *cow = blt->cow;
+  if (!cow) {
+    cow = blt->cow = calloc(1, sizeof(*cow));
+  }
+  if (cow->n == cow->max) {
+    cow->max = cow->max ? 2 * cow->max : 8;
+    cow->live = realloc(cow->live, cow->max * sizeof(*cow->live));
+  }
+  BLT *snap = blt_new();
+  snap->mem = blt->mem;
+  if (blt->root) {
+    snap->root = mem_alloc(&snap->mem, sizeof(*snap->root));
+    *snap->root = *blt->root;
+  }
+  snap->gen = snap->snapgen = blt->gen;
+  snap->origin = blt;
+  cow->live[cow->n++] = blt->snapgen = blt->gen++;
+  return snap;
+}
+
+static void snapshot_release(BLT *snap) {
+  BLT *blt = snap->origin;
+  struct blt_cow_s *cow = blt->cow;
+  int i;
+  for (i = 0; cow->live[i] != snap->gen; i++);
+  cow->live[i] = cow->live[--cow->n];
+  blt->snapgen = -1;
+  for (i = 0; i < cow->n; i++) {
+    if (cow->live[i] > blt->snapgen) blt->snapgen = cow->live[i];
+  }
+  // Free everything that no remaining snapshot can see.
+  int k = 0;
+  for (i = 0; i < cow->nretired; i++) {
+    struct blt_retired_s *r = cow->retired + i;
+    int seen = 0;
+    for (int j = 0; j < cow->n && !seen; j++) {
+      seen = r->birth <= cow->live[j] && cow->live[j] < r->death;
+    }
+    if (seen) cow->retired[k++] = *r; else mem_free(&blt->mem, r->p, r->n);
+  }
+  cow->nretired = k;
+  if (snap->root) mem_free(&snap->mem, snap->root, sizeof(*snap->root));
+  free(snap);
+}
+
+// Freeing a tree. Pending pairs sit on a stack of cells, each holding up to
+// two pairs. When we free a pair, its memory becomes the cell holding the
+// kid pairs of its internal nodes, so we need neither recursion nor any
+// memory beyond the tree itself.
+struct gc_cell_s {
+  int n;
+  blt_node_ptr pair[2];
+  struct gc_cell_s *next;
+};
+
+_Static_assert(sizeof(struct gc_cell_s) <= 2 * sizeof(struct blt_node_s),
+    "a cell must fit in a pair");
+
+struct BLT_GARBAGE {
+  struct gc_cell_s *top;
+  void (*fun)(BLT_IT *);    // Called on each leaf before it is freed.
+  int count;                // Number of leaves freed.
+  struct blt_alloc_s mem;   // Outlives the tree in blt_clear_detach().
+};
+
+enum { PAIR = 2 * sizeof(struct blt_node_s) };
+
+static BLT_GARBAGE *gc_new(BLT *blt, void (*fun)(BLT_IT *)) {
+  BLT_GARBAGE *g = malloc(sizeof(*g));
+  g->top = 0;
+  g->fun = fun;
+  g->count = 0;
+  g->mem = blt->mem;
+  return g;
+}
+
+// Frees the key of a leaf, or otherwise records the kid pair in the cell.
+static inline void gc_node(BLT_GARBAGE *g, struct blt_node_s n,
+    struct gc_cell_s *c) {
+  if (n.is_internal) {
+    c->pair[c->n++] = n.kid;
+  } else {
+    BLT_IT leaf;
+    memcpy(&leaf, &n, sizeof(leaf));
+    if (g->fun) g->fun(&leaf);
+    mem_free(&g->mem, leaf.key, key_size(&g->mem, leaf.key));
+    g->count++;
+  }
+}
+
+// Adds a node that has been unlinked from a tree to the garbage, using the
+// given memory, which must hold at least a pair, as its cell.
+static void gc_push(BLT_GARBAGE *g, struct blt_node_s n, void *mem) {
+  struct gc_cell_s *c = mem;
+  c->n = 0;
+  gc_node(g, n, c);
+  if (c->n) {
+    c->next = g->top;
+    g->top = c;
+  } else {
+    mem_free(&g->mem, c, PAIR);
+  }
+}
+
+// Unlinks the subtree at p, whose parent is p0, or the whole tree if p0 is
+// NULL. The parent takes the place of the sibling of p, as in blt_delete().
+static void gc_detach(BLT *blt, BLT_GARBAGE *g, blt_node_ptr p0,
+    blt_node_ptr p) {
+  struct blt_node_s n = *p;
+  if (!p0) {
+    mem_free(&blt->mem, blt->root, sizeof(*blt->root));
+    blt->root = 0;
+    gc_push(g, n, mem_alloc(&blt->mem, PAIR));
+    return;
+  }
+  blt_node_ptr q = p0->kid;
+  *p0 = q[p == q];
+  gc_push(g, n, q);
+}
+
+BLT_GARBAGE *blt_clear_detach(BLT *blt) {
+  assert(!blt->origin);
+  BLT_GARBAGE *g = gc_new(blt, 0);
+  if (blt->root) gc_detach(blt, g, 0, blt->root);
+  blt_clear(blt);
+  return g;
+}
+
+// As blt_clear_step(), but leaves g to the caller.
+static int gc_step(BLT_GARBAGE *g, int budget) {
+  for (; budget > 0 && g->top; budget--) {
+    struct gc_cell_s *c = g->top;
+    blt_node_ptr q = c->pair[--c->n];
+    if (!c->n) {
+      g->top = c->next;
+      mem_free(&g->mem, c, PAIR);
+    }
+    struct blt_node_s n0 = q[0], n1 = q[1];
+    c = (struct gc_cell_s *) q;
+    c->n = 0;
+    gc_node(g, n0, c);
+    gc_node(g, n1, c);
+    if (c->n) {
+      c->next = g->top;
+      g->top = c;
+    } else {
+      mem_free(&g->mem, q, PAIR);
     }
-    blt_node_ptr q = p->kid;
-    free_node(q);
-    free_node(q + 1);
-    free(q);
   }
-  if (!blt->empty) free_node(blt->root);
+  return !!g->top;
+}
+
+int blt_clear_step(BLT_GARBAGE *g, int budget) {
+  if (gc_step(g, budget)) return 1;
+  free(g);
+  return 0;
+}
+
+static void *gc_thread(void *g) {
+  while (blt_clear_step(g, 1 << 16));
+  return 0;
+}
+
+void blt_garbage_async(BLT_GARBAGE *g) {
+  pthread_t th;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&th, &attr, gc_thread, g)) gc_thread(g);
+  pthread_attr_destroy(&attr);
+}
+
+void blt_clear_async(BLT *blt) {
+  blt_garbage_async(blt_clear_detach(blt));
+}
+
+void blt_clear(BLT *blt) {
+  if (blt->origin) {
+    snapshot_release(blt);
+    return;
+  }
+  assert(blt->snapgen < 0);
+  if (blt->root) {
+    BLT_GARBAGE *g = blt_clear_detach(blt);
+    while (blt_clear_step(g, 1 << 30));
+    return;
+  }
+  if (blt->cow) {
+    free(blt->cow->live);
+    free(blt->cow->retired);
+    free(blt->cow);
+  }
+  if (blt->rcu) {
+    limbo_free(&blt->rcu->limbo);
+    for (int i = 0; i < RCU_READERS; i++) limbo_free(&blt->rcu->reader[i].limbo);
+    free(blt->rcu);
+  }
   free(blt);
 }
 
 size_t blt_overhead(BLT *blt) {
   size_t n = sizeof(BLT);
-  if (blt->empty) return n;
+  if (!blt->root) return n;
   void add(blt_node_ptr p) {
     if (p->is_internal) {
       n += 2 * sizeof(struct blt_node_s);
@@ -107,12 +567,13 @@ size_t blt_overhead(BLT *blt) {
       add(p->kid + 1);
     }
   }
+  n += sizeof(struct blt_node_s);
   add(blt->root);
   return n;
 }
 
 void blt_dump(BLT* blt, blt_node_ptr p) {
-  if (blt->empty) return;
+  if (!blt->root) return;
   if (p->is_internal) {
     blt_dump(blt, p->kid);
     blt_dump(blt, p->kid + 1);
@@ -127,16 +588,12 @@ static BLT_IT *blt_firstlast(blt_node_ptr p, int dir) {
   return (BLT_IT *)p;
 }
 
-BLT_IT *blt_first(BLT *blt) {
-  return blt->empty ? 0 : blt_firstlast(blt->root, 0);
-}
+BLT_IT *blt_first(BLT *blt) { return blt_firstlast(get_root(blt), 0); }
 
-BLT_IT *blt_last (BLT *blt) {
-  return blt->empty ? 0 : blt_firstlast(blt->root, 1);
-}
+BLT_IT *blt_last (BLT *blt) { return blt_firstlast(get_root(blt), 1); }
 
 BLT_IT *blt_next(BLT *blt, BLT_IT *it) {
-  blt_node_ptr p = blt->root, other = 0;
+  blt_node_ptr p = get_root(blt), other = 0;
   while (p->is_internal) {
     if (!(it->key[p->byte] & p->mask)) {
       other = p->kid + 1;
@@ -150,7 +607,7 @@ BLT_IT *blt_next(BLT *blt, BLT_IT *it) {
 }
 
 BLT_IT *blt_prev(BLT *blt, BLT_IT *it) {
-  blt_node_ptr p = blt->root, other = 0;
+  blt_node_ptr p = get_root(blt), other = 0;
   while (p->is_internal) {
     if (it->key[p->byte] & p->mask) {
       other = p->kid;
@@ -163,141 +620,913 @@ BLT_IT *blt_prev(BLT *blt, BLT_IT *it) {
   return blt_firstlast(other, 1);
 }
 
-// Walk down the tree as if the key is there.
-static inline BLT_IT *confident_get(BLT *blt, char *key) {
-  if (blt->empty) return 0;
-  blt_node_ptr p = blt->root;
-  int keylen = strlen(key);
+// The first nodes on a path from the root, recorded by walk() so that
+// insertions need not walk down from the root a second time.
+enum { BLT_PATH = 64 };
+struct blt_path_s {
+  int n;  // Number of internal nodes on the path.
+  blt_node_ptr node[BLT_PATH + 1];
+};
+
+// Walk down the tree from the given root as if the key is there, recording
+// up to BLT_PATH + 1 nodes of the path.
+static inline BLT_IT *walk(blt_node_ptr p, char *key,
+    struct blt_path_s *path) {
+  int keylen = strlen(key), n = 0;
+  path->node[0] = p;
   while (p->is_internal) {
     // When p->byte >= keylen, key is absent, but we must return something.
     // Either kid works; we pick 0 each time.
     p = p->byte < keylen && (key[p->byte] & p->mask) ? p->kid + 1 : p->kid;
+    if (++n <= BLT_PATH) path->node[n] = p;
   }
+  path->n = n;
   return (void *)p;
 }
 
+// Returns the index of the first recorded node whose crit bit is higher than
+// the given one, or of the last recorded node if there is none. Crit bits
+// only get lower going down a path, so we scan up from the bottom.
+static inline int path_find(struct blt_path_s *path, int byte, uint8_t x) {
+  int i = path->n < BLT_PATH ? path->n : BLT_PATH;
+  while (i > 0) {
+    blt_node_ptr p = path->node[i - 1];
+    if ((byte << 8) + p->mask >= (p->byte << 8) + x) break;
+    i--;
+  }
+  return i;
+}
+
 BLT_IT *blt_ceilfloor(BLT *blt, char *key, int way) {
-  BLT_IT *p = confident_get(blt, key);
-  if (!p) return 0;
-  // Compare keys.
-  for(char *c = key, *pc = p->key;; c++, pc++) {
-    // XOR the current bytes being compared.
-    uint8_t x = *c ^ *pc;
-    if (x) {
-      int byte = c - key;
-      x = to_mask(x);
-      // Walk down the tree until we hit an external node or a node
-      // whose crit bit is higher.
-      blt_node_ptr p = blt->root, other = 0;
-      while (p->is_internal) {
-        if ((byte << 8) + p->mask < (p->byte << 8) + x) break;
-        int dir = !!(p->mask & key[p->byte]);
-        blt_node_ptr q = p->kid;
-        if (dir == way) other = q + 1 - way;
-        p = q + dir;
-      }
-      int ndir = !!(x & key[byte]);
-      if (ndir == way) other = p;
-      return blt_firstlast(other, way);
+  blt_node_ptr root = get_root(blt);
+  if (!root) return 0;
+  struct blt_path_s path;
+  BLT_IT *it = walk(root, key, &path);
+  // Find the first byte where the keys differ.
+  char *c = key + first_diff(key, it->key);
+  uint8_t x = *c ^ it->key[c - key];
+  if (!x) return it;
+  int byte = c - key;
+  x = to_mask(x);
+  // Find the first node on the path whose crit bit is higher, or the
+  // external node, and the last subtree we passed on the way side.
+  int i = path_find(&path, byte, x);
+  blt_node_ptr p = path.node[i], other = 0;
+  for (int j = i - 1; j >= 0; j--) {
+    blt_node_ptr q = path.node[j]->kid;
+    if (path.node[j + 1] == q + way) {
+      other = q + 1 - way;
+      break;
     }
-    if (!*c) return (BLT_IT *)p;
   }
+  // The path may be longer than we recorded.
+  while (p->is_internal) {
+    if ((byte << 8) + p->mask < (p->byte << 8) + x) break;
+    int dir = !!(p->mask & key[p->byte]);
+    blt_node_ptr q = p->kid;
+    if (dir == way) other = q + 1 - way;
+    p = q + dir;
+  }
+  int ndir = !!(x & key[byte]);
+  if (ndir == way) other = p;
+  return blt_firstlast(other, way);
 }
 
 BLT_IT *blt_ceil (BLT *blt, char *key) { return blt_ceilfloor(blt, key, 0); }
 BLT_IT *blt_floor(BLT *blt, char *key) { return blt_ceilfloor(blt, key, 1); }
 
-BLT_IT *blt_setp(BLT *blt, char *key, int *is_new) {
-  BLT_IT *p = confident_get(blt, key);
-  if (!p) {  // Empty tree case.
-    blt->empty = 0;
-    BLT_IT *leaf = (BLT_IT *) blt->root;
-    leaf->key = strdup(key);
-    leaf->data = 0;
+// Creates or retrieves the leaf node at a given key. New leaves start with
+// fn(NULL, ctx), or ctx if fn is NULL, so they are complete before readers
+// can see them.
+static BLT_IT *setp_with(BLT *blt, char *key, int *is_new,
+    void *(*fn)(void *, void *), void *ctx) {
+  assert(!blt->origin);
+  if (blt->snapgen >= 0) cow_path(blt, key);
+  void *data = ctx;
+  if (!blt->root) {  // Empty tree case.
+    BLT_IT *leaf = mem_alloc(&blt->mem, sizeof(struct blt_node_s));
+    leaf->key = mem_strdup(&blt->mem, key);
+    leaf->data = fn ? fn(0, ctx) : data;
+    publish(&blt->root, (blt_node_ptr) leaf);
     if (is_new) *is_new = 1;
     return leaf;
   }
-  // Compare keys.
-  for(char *c = key, *pc = p->key;; c++, pc++) {
-    // XOR the current bytes being compared.
-    uint8_t x = *c ^ *pc;
-    if (x) {
-      // Allocate 2 adjacent nodes and copy the leaf into the appropriate side.
-      blt_node_ptr n = malloc(2 * sizeof(*n));
-      x = to_mask(x);
-      BLT_IT *leaf = (BLT_IT *)n;
-      blt_node_ptr other = n;
-      if (*c & x) leaf++; else other++;
+  struct blt_path_s path;
+  BLT_IT *it = walk(blt->root, key, &path);
+  // Find the first byte where the keys differ.
+  char *c = key + first_diff(key, it->key);
+  uint8_t x = *c ^ it->key[c - key];
+  if (!x) {
+    if (is_new) *is_new = 0;
+    return it;
+  }
+  // Allocate 2 adjacent nodes and copy the leaf into the appropriate side.
+  blt_node_ptr n = mem_alloc(&blt->mem, PAIR);
+  x = to_mask(x);
+  BLT_IT *leaf = (BLT_IT *)n;
+  blt_node_ptr other = n;
+  if (*c & x) leaf++; else other++;
 
-      leaf->key = strdup(key);
-      leaf->data = 0;
+  leaf->key = mem_strdup(&blt->mem, key);
+  leaf->data = fn ? fn(0, ctx) : data;
 
-      // Find the first node in the path whose critbit is higher than ours,
-      // or the external node.
-      int byte = c - key;
-      blt_node_ptr p = (blt_node_ptr) blt->root;
-      while(p->is_internal) {
-        if ((byte << 8) + p->mask < (p->byte << 8) + x) break;
-        p = follow(p, key);
-      }
-
-      // Copy the node's contents to the other side of our 2 new adjacent nodes,
-      // then replace it with our critbit and pointer to the new nodes.
-      *other = *p;
-      p->byte = byte;
-      p->mask = x;
-      p->kid = n;
-      p->is_internal = 1;
-      if (is_new) *is_new = 1;
-      return leaf;
-    }
-    if (!*c) {
-      if (is_new) *is_new = 0;
-      return p;
-    }
+  // Find the first node in the path whose critbit is higher than ours,
+  // or the external node.
+  int byte = c - key;
+  int i = path_find(&path, byte, x);
+  blt_node_ptr *slot = i ? &path.node[i - 1]->kid : &blt->root;
+  blt_node_ptr p = path.node[i];
+  while(p->is_internal) {
+    if ((byte << 8) + p->mask < (p->byte << 8) + x) break;
+    slot = &p->kid;
+    p = follow(p, key);
   }
+
+  // Copy the node's contents to the other side of our 2 new adjacent nodes,
+  // then replace it with our critbit and pointer to the new nodes.
+  *other = *p;
+  struct blt_node_s t = {
+    .byte = byte, .mask = x, .gen = blt->gen, .is_internal = 1, .kid = n
+  };
+  replace(blt, slot, p, &t);
+  if (is_new) *is_new = 1;
+  return leaf;
 }
 
-BLT_IT *blt_set(BLT *blt, char *key) { return blt_setp(blt, key, 0); }
+static inline BLT_IT *setp(BLT *blt, char *key, int *is_new, void *data) {
+  return setp_with(blt, key, is_new, 0, data);
+}
+
+BLT_IT *blt_setp(BLT *blt, char *key, int *is_new) {
+  return setp(blt, key, is_new, 0);
+}
+
+BLT_IT *blt_set(BLT *blt, char *key) { return setp(blt, key, 0, 0); }
 
 BLT_IT *blt_put(BLT *blt, char *key, void *data) {
-  BLT_IT *it = blt_set(blt, key);
+  BLT_IT *it = setp(blt, key, 0, data);
   it->data = data;
   return it;
 }
 
 int blt_put_if_absent(BLT *blt, char *key, void *data) {
   int is_new;
-  BLT_IT *it = blt_setp(blt, key, &is_new);
-  if (is_new) it->data = data;
+  setp(blt, key, &is_new, data);
   return !is_new;
 }
 
-int blt_delete(BLT *blt, char *key) {
-  if (blt->empty) return 0;
+int blt_replace(BLT *blt, char *key, void *data, void **old) {
+  int is_new;
+  BLT_IT *it = setp(blt, key, &is_new, data);
+  if (is_new) return 0;
+  if (old) *old = it->data;
+  it->data = data;
+  return 1;
+}
+
+int blt_cas(BLT *blt, char *key, void *expected, void *data) {
+  assert(!blt->origin);
+  BLT_IT *it = blt_get(blt, key);
+  if (!it || it->data != expected) return 0;
+  // Copy the path only now that the swap will happen.
+  if (blt->snapgen >= 0) it = cow_path(blt, key);
+  it->data = data;
+  return 1;
+}
+
+BLT_IT *blt_upsert(BLT *blt, char *key, void *(*fn)(void *, void *),
+    void *ctx) {
+  int is_new;
+  BLT_IT *it = setp_with(blt, key, &is_new, fn, ctx);
+  if (!is_new) it->data = fn(it->data, ctx);
+  return it;
+}
+
+int blt_extract(BLT *blt, char *key, void **data) {
+  assert(!blt->origin);
+  if (!blt->root) return 0;
+  // The descent below copies shared pairs, so first make sure the key is
+  // there to delete.
+  if (blt->snapgen >= 0 && !blt_get(blt, key)) return 0;
   int keylen = strlen(key);
-  blt_node_ptr p = blt->root, p0 = 0;
+  blt_node_ptr *slot = &blt->root, *slot0 = 0, p = *slot, p0 = 0;
   while (p->is_internal) {
     if (p->byte > keylen) return 0;
+    if (blt->snapgen >= 0) cow_node(blt, p);
     p0 = p;
+    slot0 = slot;
+    slot = &p->kid;
     p = follow(p, key);
   }
   BLT_IT *leaf = (BLT_IT *)p;
   if (strcmp(key, leaf->key)) return 0;
-  free(leaf->key);
+  if (data) *data = leaf->data;
+  discard(blt, leaf->key, key_size(&blt->mem, leaf->key), 0);
   if (!p0) {
-    blt->empty = 1;
+    publish(&blt->root, 0);
+    discard(blt, p, sizeof(*p), blt->gen);
     return 1;
   }
   blt_node_ptr q = p0->kid;
-  *p0 = *(p == q ? q + 1 : q);
-  free(q);
+  int gen = p0->gen;
+  replace(blt, slot0, p0, p == q ? q + 1 : q);
+  discard(blt, q, PAIR, gen);
   return 1;
 }
 
-int blt_allprefixed(BLT *blt, char *key, int (*fun)(BLT_IT *)) {
-  if (blt->empty) return 1;
-  blt_node_ptr p = blt->root, top = p;
+int blt_delete(BLT *blt, char *key) { return blt_extract(blt, key, 0); }
+
+typedef unsigned __int128 blt_word2;
+
+// Atomically replaces *p with *t if *p equals *old.
+// Otherwise returns 0 and copies the current contents of *p to *old.
+static inline int cas_node(blt_node_ptr p, blt_node_ptr old, blt_node_ptr t) {
+  blt_word2 o, n;
+  memcpy(&o, old, sizeof(o));
+  memcpy(&n, t, sizeof(n));
+  blt_word2 r = __sync_val_compare_and_swap((blt_word2 *) p, o, n);
+  if (r == o) return 1;
+  memcpy(old, &r, sizeof(r));
+  return 0;
+}
+
+// Nobody else modifies a node we froze, so thawing needs no atomics.
+static void thaw(blt_node_ptr b, int n) {
+  for (int i = 0; i < n; i++) if (b[i].is_internal) b[i].frozen = 0;
+}
+
+// Freezes the internal nodes of the block b of n nodes. Returns 0 if another
+// writer got to one of them first, in which case nothing is left frozen.
+static int freeze(blt_node_ptr b, int n) {
+  for (int i = 0; i < n; i++) {
+    struct blt_node_s old = b[i], t;
+    while (old.is_internal) {
+      if (old.frozen) {
+        thaw(b, i);
+        return 0;
+      }
+      t = old;
+      t.frozen = 1;
+      if (cas_node(b + i, &old, &t)) break;
+    }
+  }
+  return 1;
+}
+
+// Copies the frozen block b of n nodes.
+static blt_node_ptr copy_block(blt_node_ptr b, int n) {
+  blt_node_ptr c = malloc(n * sizeof(*c));
+  memcpy(c, b, n * sizeof(*c));
+  thaw(c, n);
+  return c;
+}
+
+// Swaps the block c in place of b, the kid of x, or the root if x is NULL.
+static int swap_block(BLT *blt, blt_node_ptr x, blt_node_ptr b,
+    blt_node_ptr c) {
+  if (!x) return __sync_bool_compare_and_swap(&blt->root, b, c);
+  struct blt_node_s old = *x, t;
+  old.frozen = 0;
+  old.kid = b;
+  t = old;
+  t.kid = c;
+  return cas_node(x, &old, &t);
+}
+
+int blt_rcu_put(BLT *blt, int reader, char *key, void *data) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  struct blt_limbo_s *limbo = &rcu->reader[reader].limbo;
+  struct {
+    blt_node_ptr node, block;  // The block is where we found the node.
+  } buf[64], *path = buf;
+  int maxdepth = 64, is_new;
+  for (;;) {
+    blt_node_ptr root = get_root(blt);
+    if (!root) {
+      BLT_IT *leaf = malloc(sizeof(struct blt_node_s));
+      leaf->key = strdup(key);
+      leaf->data = data;
+      if (__sync_bool_compare_and_swap(&blt->root, 0, leaf)) {
+        is_new = 1;
+        break;
+      }
+      free(leaf->key);
+      free(leaf);
+      continue;
+    }
+    // Walk down as in walk(), recording the path. Each kid pointer
+    // is read once, so every step is a genuine parent-child link even if
+    // other writers are busy.
+    int keylen = strlen(key), depth = 0;
+    blt_node_ptr b = root, p = root;
+    for (;;) {
+      if (depth == maxdepth) {
+        maxdepth *= 2;
+        path = path == buf ? memcpy(malloc(maxdepth * sizeof(*path)), buf,
+            sizeof(buf)) : realloc(path, maxdepth * sizeof(*path));
+      }
+      path[depth].node = p;
+      path[depth++].block = b;
+      if (!p->is_internal) break;
+      b = p->kid;
+      p = p->byte < keylen && (key[p->byte] & p->mask) ? b + 1 : b;
+    }
+    BLT_IT *l = (BLT_IT *) p;
+    char *c = key + first_diff(key, l->key), *pc = l->key + (c - key);
+    int byte = c - key;
+    uint8_t x = to_mask(*c ^ *pc);
+    // Replace the leaf itself if the key is present. Otherwise replace the
+    // first node on the path whose crit bit is higher, as in setp().
+    int i = depth - 1;
+    if (x) {
+      for (i = 0; i < depth - 1; i++) {
+        p = path[i].node;
+        if ((byte << 8) + p->mask < (p->byte << 8) + x) break;
+      }
+    }
+    p = path[i].node;
+    b = path[i].block;
+    blt_node_ptr parent = i ? path[i - 1].node : 0;
+    int n = parent ? 2 : 1;
+    if (!freeze(b, n)) continue;
+    blt_node_ptr copy = copy_block(b, n), t = copy + (p - b), pair = 0;
+    BLT_IT *leaf = (BLT_IT *) t;
+    if (!x) {
+      leaf->data = data;
+    } else {
+      pair = malloc(2 * sizeof(*pair));
+      leaf = (BLT_IT *) pair;
+      blt_node_ptr other = pair;
+      if (*c & x) leaf++; else other++;
+      leaf->key = strdup(key);
+      leaf->data = data;
+      *other = *t;
+      struct blt_node_s u = {
+        .byte = byte, .mask = x, .is_internal = 1, .kid = pair
+      };
+      *t = u;
+    }
+    if (!swap_block(blt, parent, b, copy)) {
+      thaw(b, n);
+      free(copy);
+      if (pair) {
+        free(leaf->key);
+        free(pair);
+      }
+      continue;
+    }
+    rcu_retire(rcu, limbo, b);
+    is_new = !!x;
+    break;
+  }
+  if (path != buf) free(path);
+  return is_new;
+}
+
+int blt_rcu_delete(BLT *blt, int reader, char *key) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  struct blt_limbo_s *limbo = &rcu->reader[reader].limbo;
+  int keylen = strlen(key);
+  for (;;) {
+    blt_node_ptr p = get_root(blt);
+    if (!p) return 0;
+    // The leaf p lies in the block q, which is the kid of p0. In turn, p0
+    // lies in the block b0, which is the kid of x0, or is the root.
+    blt_node_ptr x0 = 0, b0 = 0, p0 = 0, q = p;
+    while (p->is_internal) {
+      if (p->byte > keylen) return 0;
+      x0 = p0;
+      b0 = q;
+      p0 = p;
+      q = p->kid;
+      p = key[p->byte] & p->mask ? q + 1 : q;
+    }
+    BLT_IT *leaf = (BLT_IT *) p;
+    if (strcmp(key, leaf->key)) return 0;
+    if (!p0) {
+      if (!__sync_bool_compare_and_swap(&blt->root, p, 0)) continue;
+      rcu_retire(rcu, limbo, leaf->key);
+      rcu_retire(rcu, limbo, p);
+      return 1;
+    }
+    int n = x0 ? 2 : 1;
+    if (!freeze(b0, n)) continue;
+    if (p0->kid != q || !freeze(q, 2)) {
+      thaw(b0, n);
+      continue;
+    }
+    blt_node_ptr copy = copy_block(b0, n);
+    copy[p0 - b0] = p == q ? q[1] : q[0];
+    thaw(copy + (p0 - b0), 1);
+    if (!swap_block(blt, x0, b0, copy)) {
+      thaw(q, 2);
+      thaw(b0, n);
+      free(copy);
+      continue;
+    }
+    rcu_retire(rcu, limbo, leaf->key);
+    rcu_retire(rcu, limbo, q);
+    rcu_retire(rcu, limbo, b0);
+    return 1;
+  }
+}
+
+// The first word of an internal node of an OLC tree is its version word.
+typedef uint64_t blt_word;
+
+static inline blt_word load_word(blt_node_ptr p) {
+  return __atomic_load_n((blt_word *) p, __ATOMIC_ACQUIRE);
+}
+
+static inline struct blt_node_s unpack(blt_word w) {
+  struct blt_node_s h;
+  memcpy(&h, &w, sizeof(w));
+  return h;
+}
+
+static inline blt_word pack(struct blt_node_s h) {
+  blt_word w;
+  memcpy(&w, &h, sizeof(w));
+  return w;
+}
+
+// Returns 1 if the version word at p is still w, that is, if nothing it
+// guards has changed since we read w.
+static inline int olc_check(blt_node_ptr p, blt_word w) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return load_word(p) == w;
+}
+
+// Locks the version word at p, provided it is still w.
+static inline int olc_lock(blt_node_ptr p, blt_word w) {
+  struct blt_node_s h = unpack(w);
+  if (h.frozen) return 0;
+  h.frozen = 1;
+  return __sync_bool_compare_and_swap((blt_word *) p, w, pack(h));
+}
+
+// Unlocks the version word at p, which was w before we locked it, bumping
+// the version if we changed anything it guards. Readers validate the whole
+// first word, whose gen field is the version. A node we write into a slot
+// takes the version its guard will have after unlocking, so the version of
+// a slot moves on whenever its contents do, rather than starting afresh.
+// Versions are 22 bits and wrap, so a reader that stalls while its guard
+// changes exactly 2^22 times, ending with the same crit bit, would validate
+// a stale read. Readers hold a version across a few loads only, so we accept
+// this window rather than widen the node.
+static inline void olc_unlock(blt_node_ptr p, blt_word w, int changed) {
+  struct blt_node_s h = unpack(w);
+  h.gen = h.gen + changed;
+  __atomic_store_n((blt_word *) p, pack(h), __ATOMIC_RELEASE);
+}
+
+// Overwrites the node at p, whose guard we hold, with t. The version word
+// goes last, so it also releases any lock we held on p itself.
+static inline void olc_write(blt_node_ptr p, struct blt_node_s t) {
+  __atomic_store_n(&p->kid, t.kid, __ATOMIC_RELAXED);
+  __atomic_store_n((blt_word *) p, pack(t), __ATOMIC_RELEASE);
+}
+
+struct olc_path {
+  int n, max;
+  struct olc_step {
+    blt_node_ptr p;
+    blt_word w;             // First word of p: its version, or the leaf key.
+    blt_node_ptr kid;       // Kid of p, or the leaf data.
+  } *step, buf[64];
+};
+
+static void olc_push(struct olc_path *path, blt_node_ptr p, blt_word w,
+    blt_node_ptr kid) {
+  if (path->n == path->max) {
+    path->max *= 2;
+    path->step = path->step == path->buf ?
+        memcpy(malloc(path->max * sizeof(*path->step)), path->buf,
+            sizeof(path->buf)) :
+        realloc(path->step, path->max * sizeof(*path->step));
+  }
+  struct olc_step *s = path->step + path->n++;
+  s->p = p;
+  s->w = w;
+  s->kid = kid;
+}
+
+// Walks down an OLC tree as in walk(), recording each node with
+// the words we read from it. The first step is the version guarding the
+// root, so path->n == 1 for an empty tree. Every step has been validated
+// against the version guarding it.
+static void olc_walk(BLT *blt, char *key, struct olc_path *path) {
+  blt_node_ptr head = &blt->rcu->head;
+  int keylen = strlen(key);
+  for (;;) {
+    path->n = 0;
+    blt_word w = load_word(head);
+    if (unpack(w).frozen) continue;
+    blt_node_ptr p = get_root(blt);
+    if (!olc_check(head, w)) continue;
+    olc_push(path, head, w, p);
+    while (p) {
+      blt_word pw = load_word(p);
+      blt_node_ptr kid = __atomic_load_n(&p->kid, __ATOMIC_RELAXED);
+      if (!olc_check(path->step[path->n - 1].p, w)) break;
+      olc_push(path, p, pw, kid);
+      struct blt_node_s h = unpack(pw);
+      if (!h.is_internal) return;
+      if (h.frozen) break;
+      w = pw;
+      p = h.byte < keylen && (key[h.byte] & h.mask) ? kid + 1 : kid;
+    }
+    if (!p) return;
+  }
+}
+
+static inline void olc_init(struct olc_path *path) {
+  path->n = 0;
+  path->max = 64;
+  path->step = path->buf;
+}
+
+static inline void olc_free(struct olc_path *path) {
+  if (path->step != path->buf) free(path->step);
+}
+
+static inline char *olc_key(struct olc_step *s) {
+  return (char *) (uintptr_t) s->w;
+}
+
+int blt_olc_get(BLT *blt, char *key, void **data) {
+  blt_node_ptr head = &blt->rcu->head;
+  int keylen = strlen(key);
+  // As olc_walk(), but we only need the guard of the current node.
+  for (;;) {
+    blt_node_ptr g = head;
+    blt_word w = load_word(head), pw;
+    if (unpack(w).frozen) continue;
+    blt_node_ptr p = get_root(blt), kid;
+    if (!olc_check(head, w)) continue;
+    if (!p) return 0;
+    for (;;) {
+      pw = load_word(p);
+      kid = __atomic_load_n(&p->kid, __ATOMIC_RELAXED);
+      if (!olc_check(g, w)) break;
+      struct blt_node_s h = unpack(pw);
+      if (!h.is_internal) {
+        if (strcmp(key, (char *) (uintptr_t) pw)) return 0;
+        if (data) *data = kid;
+        return 1;
+      }
+      if (h.frozen) break;
+      if (h.byte > keylen) return 0;
+      g = p;
+      w = pw;
+      p = key[h.byte] & h.mask ? kid + 1 : kid;
+    }
+  }
+}
+
+int blt_olc_put(BLT *blt, int reader, char *key, void *data) {
+  struct olc_path path;
+  olc_init(&path);
+  int is_new;
+  for (;;) {
+    olc_walk(blt, key, &path);
+    struct olc_step *s = path.step;
+    int d = path.n - 1;
+    if (!d) {  // Empty tree case.
+      if (!olc_lock(s->p, s->w)) continue;
+      BLT_IT *leaf = malloc(sizeof(struct blt_node_s));
+      leaf->key = strdup(key);
+      leaf->data = data;
+      publish(&blt->root, (blt_node_ptr) leaf);
+      olc_unlock(s->p, s->w, 1);
+      is_new = 1;
+      break;
+    }
+    char *pc = olc_key(s + d), *c = key + first_diff(key, pc);
+    pc += c - key;
+    int byte = c - key;
+    uint8_t x = to_mask(*c ^ *pc);
+    if (!x) {
+      if (!olc_lock(s[d - 1].p, s[d - 1].w)) continue;
+      __atomic_store_n(&((BLT_IT *) s[d].p)->data, data, __ATOMIC_RELAXED);
+      olc_unlock(s[d - 1].p, s[d - 1].w, 1);
+      is_new = 0;
+      break;
+    }
+    // Replace the first node on the path whose crit bit is higher, as in
+    // setp(). We lock its guard, and the node itself if it is internal, so
+    // its kids stay put while we move it.
+    int i;
+    for (i = 1; i < d; i++) {
+      struct blt_node_s h = unpack(s[i].w);
+      if ((byte << 8) + h.mask < (h.byte << 8) + x) break;
+    }
+    if (!olc_lock(s[i - 1].p, s[i - 1].w)) continue;
+    if (i < d && !olc_lock(s[i].p, s[i].w)) {
+      olc_unlock(s[i - 1].p, s[i - 1].w, 0);
+      continue;
+    }
+    blt_node_ptr n = malloc(2 * sizeof(*n)), other = n;
+    BLT_IT *leaf = (BLT_IT *) n;
+    if (*c & x) leaf++; else other++;
+    leaf->key = strdup(key);
+    leaf->data = data;
+    memcpy(other, &s[i].w, sizeof(s[i].w));
+    other->kid = s[i].kid;
+    struct blt_node_s t = {
+      .byte = byte, .mask = x, .gen = unpack(s[i - 1].w).gen + 1,
+      .is_internal = 1, .kid = n
+    };
+    olc_write(s[i].p, t);
+    olc_unlock(s[i - 1].p, s[i - 1].w, 1);
+    is_new = 1;
+    break;
+  }
+  olc_free(&path);
+  return is_new;
+}
+
+int blt_olc_delete(BLT *blt, int reader, char *key) {
+  struct blt_rcu_s *rcu = blt->rcu;
+  struct blt_limbo_s *limbo = &rcu->reader[reader].limbo;
+  struct olc_path path;
+  olc_init(&path);
+  int r = 1;
+  for (;;) {
+    olc_walk(blt, key, &path);
+    struct olc_step *s = path.step;
+    int d = path.n - 1;
+    if (!d || strcmp(key, olc_key(s + d))) {
+      r = 0;
+      break;
+    }
+    if (d == 1) {
+      if (!olc_lock(s->p, s->w)) continue;
+      publish(&blt->root, 0);
+      olc_unlock(s->p, s->w, 1);
+      rcu_retire(rcu, limbo, olc_key(s + 1));
+      rcu_retire(rcu, limbo, s[1].p);
+      break;
+    }
+    // Overwrite the parent p0 with the sibling of the leaf. We lock the
+    // guard of p0, p0 itself, and the sibling if it is internal, which stays
+    // locked so no writer ever uses the stale copy.
+    struct olc_step *x0 = s + d - 2, *p0 = s + d - 1;
+    if (!olc_lock(x0->p, x0->w)) continue;
+    if (!olc_lock(p0->p, p0->w)) {
+      olc_unlock(x0->p, x0->w, 0);
+      continue;
+    }
+    blt_node_ptr q = p0->kid, sib = s[d].p == q ? q + 1 : q;
+    blt_word sw = load_word(sib);
+    struct blt_node_s t = unpack(sw);
+    if (t.is_internal) {
+      if (!olc_lock(sib, sw)) {
+        olc_unlock(p0->p, p0->w, 0);
+        olc_unlock(x0->p, x0->w, 0);
+        continue;
+      }
+      t.gen = unpack(x0->w).gen + 1;
+    }
+    t.kid = sib->kid;
+    olc_write(p0->p, t);
+    olc_unlock(x0->p, x0->w, 1);
+    rcu_retire(rcu, limbo, olc_key(s + d));
+    rcu_retire(rcu, limbo, q);
+    break;
+  }
+  olc_free(&path);
+  return r;
+}
+
+// Parallel bulk loading. First we find the longest prefix common to all the
+// keys. Keys sharing the two bytes after it form a bucket, and buckets are
+// independent subtrees, since every crit bit between different buckets lies
+// within those bytes. Skipping the prefix keeps keys such as URLs or paths
+// from all landing in one bucket. We sort key indices by bucket with a
+// parallel counting sort that preserves input order, build each bucket's
+// tree on whichever thread claims it, then join the buckets with a spine of
+// internal nodes on the 16 bits after the prefix.
+enum { BUILD_BUCKETS = 1 << 16 };
+
+struct build_s {
+  char **keys;
+  void **vals;
+  int n, nthreads;
+  int prefix;               // Length of the prefix common to all keys.
+  int *count;               // Per-thread bucket counts, then offsets.
+  int *order;               // Key indices sorted by bucket.
+  int *start;               // Where each bucket begins in order.
+  BLT **sub;                // Tree for each bucket.
+  int next;                 // Next bucket to be claimed.
+};
+
+struct build_arg_s {
+  struct build_s *b;
+  int id;
+};
+
+static inline int bucket_of(struct build_s *b, char *key) {
+  key += b->prefix;
+  uint8_t c = *key;
+  return c ? c << 8 | (uint8_t) key[1] : 0;
+}
+
+static void *build_prefix(void *arg) {
+  struct build_arg_s *a = arg;
+  struct build_s *b = a->b;
+  int lo = (long) a->id * b->n / b->nthreads;
+  int hi = (long) (a->id + 1) * b->n / b->nthreads;
+  int prefix = __atomic_load_n(&b->prefix, __ATOMIC_RELAXED);
+  for (int i = lo; i < hi && prefix; i++) {
+    int k = first_diff(b->keys[0], b->keys[i]);
+    if (k < prefix) prefix = k;
+  }
+  int old = __atomic_load_n(&b->prefix, __ATOMIC_RELAXED);
+  while (prefix < old && !__atomic_compare_exchange_n(&b->prefix, &old,
+      prefix, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+static void *build_count(void *arg) {
+  struct build_arg_s *a = arg;
+  struct build_s *b = a->b;
+  int *count = b->count + (size_t) a->id * BUILD_BUCKETS;
+  int lo = (long) a->id * b->n / b->nthreads;
+  int hi = (long) (a->id + 1) * b->n / b->nthreads;
+  for (int i = lo; i < hi; i++) count[bucket_of(b, b->keys[i])]++;
+  return 0;
+}
+
+static void *build_scatter(void *arg) {
+  struct build_arg_s *a = arg;
+  struct build_s *b = a->b;
+  int *offset = b->count + (size_t) a->id * BUILD_BUCKETS;
+  int lo = (long) a->id * b->n / b->nthreads;
+  int hi = (long) (a->id + 1) * b->n / b->nthreads;
+  for (int i = lo; i < hi; i++) {
+    b->order[offset[bucket_of(b, b->keys[i])]++] = i;
+  }
+  return 0;
+}
+
+static void *build_buckets(void *arg) {
+  struct build_s *b = ((struct build_arg_s *) arg)->b;
+  for (;;) {
+    int k = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (k >= BUILD_BUCKETS) return 0;
+    if (b->start[k] == b->start[k + 1]) continue;
+    BLT *t = b->sub[k] = blt_new();
+    for (int j = b->start[k]; j < b->start[k + 1]; j++) {
+      int i = b->order[j];
+      blt_put(t, b->keys[i], b->vals ? b->vals[i] : 0);
+    }
+  }
+}
+
+static void build_run(struct build_s *b, void *(*fun)(void *)) {
+  pthread_t th[b->nthreads];
+  struct build_arg_s arg[b->nthreads];
+  for (int i = 0; i < b->nthreads; i++) {
+    arg[i].b = b;
+    arg[i].id = i;
+    pthread_create(th + i, 0, fun, arg + i);
+  }
+  for (int i = 0; i < b->nthreads; i++) pthread_join(th[i], 0);
+}
+
+// Writes to *slot the root of the crit-bit tree over the nonempty buckets
+// id[lo], ..., id[hi - 1], which are in increasing order.
+static void build_spine(struct build_s *b, int *id, int lo, int hi,
+    blt_node_ptr slot) {
+  if (hi - lo == 1) {
+    BLT *t = b->sub[id[lo]];
+    *slot = *t->root;
+    free(t->root);
+    free(t);
+    return;
+  }
+  int bit = 31 - __builtin_clz(id[lo] ^ id[hi - 1]), mid = lo;
+  while (!(id[mid] & 1 << bit)) mid++;
+  blt_node_ptr kid = malloc(2 * sizeof(*kid));
+  build_spine(b, id, lo, mid, kid);
+  build_spine(b, id, mid, hi, kid + 1);
+  struct blt_node_s t = {
+    .byte = b->prefix + (bit < 8), .mask = 1 << (bit & 7), .is_internal = 1, .kid = kid
+  };
+  *slot = t;
+}
+
+BLT *blt_build_parallel(char **keys, void **vals, int n, int nthreads) {
+  if (nthreads < 1) nthreads = 1;
+  struct build_s b = {
+    .keys = keys, .vals = vals, .n = n, .nthreads = nthreads,
+    .count = calloc((size_t) nthreads * BUILD_BUCKETS, sizeof(int)),
+    .order = malloc(n * sizeof(int)),
+    .start = malloc((BUILD_BUCKETS + 1) * sizeof(int)),
+    .sub = calloc(BUILD_BUCKETS, sizeof(BLT *)),
+    .prefix = n ? strlen(keys[0]) : 0,
+  };
+  build_run(&b, build_prefix);
+  build_run(&b, build_count);
+  // Turn counts into offsets: bucket by bucket, then thread by thread, so
+  // each bucket lists its keys in input order.
+  int total = 0;
+  for (int k = 0; k < BUILD_BUCKETS; k++) {
+    b.start[k] = total;
+    for (int t = 0; t < nthreads; t++) {
+      int *c = b.count + (size_t) t * BUILD_BUCKETS + k, m = *c;
+      *c = total;
+      total += m;
+    }
+  }
+  b.start[BUILD_BUCKETS] = total;
+  build_run(&b, build_scatter);
+  build_run(&b, build_buckets);
+  int *id = b.count, nid = 0;  // Reuse the counts.
+  for (int k = 0; k < BUILD_BUCKETS; k++) if (b.sub[k]) id[nid++] = k;
+  BLT *blt = blt_new();
+  if (nid) {
+    blt->root = malloc(sizeof(*blt->root));
+    build_spine(&b, id, 0, nid, blt->root);
+  }
+  free(b.count);
+  free(b.order);
+  free(b.start);
+  free(b.sub);
+  return blt;
+}
+
+// Building from sorted keys. Each key lands to the right of every key so
+// far, so only the rightmost path of the tree changes. We keep that path on
+// a stack. As in setp(), the new key splits the first node on the path
+// whose crit bit is higher than the one between the new key and the last
+// key, which we find by popping from the bottom.
+struct BLT_BUILDER {
+  BLT *blt;
+  int n, max;
+  blt_node_ptr *spine;      // The rightmost path, from the root down.
+};
+
+BLT_BUILDER *blt_builder_new() {
+  BLT_BUILDER *b = malloc(sizeof(*b));
+  b->blt = blt_new();
+  b->n = 0;
+  b->max = 64;
+  b->spine = malloc(b->max * sizeof(*b->spine));
+  return b;
+}
+
+int blt_builder_add(BLT_BUILDER *b, char *key, void *data) {
+  BLT_IT *leaf;
+  if (!b->n) {
+    leaf = malloc(sizeof(struct blt_node_s));
+    b->blt->root = (blt_node_ptr) leaf;
+  } else {
+    char *pc = ((BLT_IT *) b->spine[b->n - 1])->key;
+    char *c = key + first_diff(key, pc);
+    pc += c - key;
+    uint8_t x = *c ^ *pc;
+    if (!x) return -1;
+    x = to_mask(x);
+    if (!(*c & x)) return -1;  // Out of order.
+    int byte = c - key, k = b->n - 1;
+    while (k) {
+      blt_node_ptr p = b->spine[k - 1];
+      if ((byte << 8) + p->mask >= (p->byte << 8) + x) break;
+      k--;
+    }
+    blt_node_ptr p = b->spine[k], n = malloc(2 * sizeof(*n));
+    n[0] = *p;
+    struct blt_node_s t = {
+      .byte = byte, .mask = x, .is_internal = 1, .kid = n
+    };
+    *p = t;
+    leaf = (BLT_IT *) (n + 1);
+    b->n = k + 1;
+  }
+  if (b->n == b->max) {
+    b->max *= 2;
+    b->spine = realloc(b->spine, b->max * sizeof(*b->spine));
+  }
+  b->spine[b->n++] = (blt_node_ptr) leaf;
+  leaf->key = strdup(key);
+  leaf->data = data;
+  return 0;
+}
+
+BLT *blt_builder_finish(BLT_BUILDER *b) {
+  BLT *blt = b->blt;
+  free(b->spine);
+  free(b);
+  return blt;
+}
+
+// Returns the root of the subtree holding the keys with the given prefix, or
+// NULL if there are none.
+static blt_node_ptr prefix_top(BLT *blt, char *key) {
+  blt_node_ptr p = get_root(blt), top = p;
+  if (!p) return 0;
   int keylen = strlen(key);
   while (p->is_internal) {
     if (p->byte >= keylen) {
@@ -307,7 +1536,13 @@ int blt_allprefixed(BLT *blt, char *key, int (*fun)(BLT_IT *)) {
       top = p;
     }
   }
-  if (strncmp(key, ((BLT_IT *)p)->key, keylen)) return 1;
+  if (strncmp(key, ((BLT_IT *)p)->key, keylen)) return 0;
+  return top;
+}
+
+int blt_allprefixed(BLT *blt, char *key, int (*fun)(BLT_IT *)) {
+  blt_node_ptr top = prefix_top(blt, key);
+  if (!top) return 1;
   int traverse(blt_node_ptr p) {
     if (p->is_internal) {
       int status = traverse(p->kid);
@@ -321,9 +1556,316 @@ int blt_allprefixed(BLT *blt, char *key, int (*fun)(BLT_IT *)) {
   return traverse(top);
 }
 
+// Bulk deletion. Normally we unlink whole subtrees, each as blt_delete()
+// unlinks a leaf. With snapshots or RCU readers, they may share the nodes,
+// so instead we delete the keys one at a time. RCU readers may still be
+// looking at a deleted leaf, so a copy of it waits in limbo for fun.
+
+// Deletes keys from the least key at least lo, as long as in() holds.
+static void delete_each(BLT *blt, BLT_GARBAGE *g, char *lo,
+    int (*in)(char *)) {
+  char *key = strdup(lo);
+  for (BLT_IT *it; (it = blt_ceil(blt, key)) && in(it->key);) {
+    free(key);
+    key = strdup(it->key);
+    if (g->fun && blt->rcu) {
+      struct blt_limbo_s *limbo = &blt->rcu->limbo;
+      BLT_IT *copy = malloc(sizeof(*copy));
+      *copy = *it;
+      rcu_retire(blt->rcu, limbo, copy);
+      limbo->item[limbo->n - 1].fun = g->fun;
+    } else if (g->fun) {
+      g->fun(it);
+    }
+    blt_delete(blt, key);
+    g->count++;
+  }
+  free(key);
+}
+
+BLT_GARBAGE *blt_detach_prefixed(BLT *blt, char *key,
+    void (*fun)(BLT_IT *)) {
+  assert(!blt->origin);
+  BLT_GARBAGE *g = gc_new(blt, fun);
+  int keylen = strlen(key);
+  if (blt->snapgen >= 0 || blt->rcu) {
+    int in(char *k) { return !strncmp(k, key, keylen); }
+    delete_each(blt, g, key, in);
+    return g;
+  }
+  // As prefix_top(), but also find the parent of the top.
+  blt_node_ptr p = blt->root, top = p, top0 = 0;
+  if (!p) return g;
+  while (p->is_internal) {
+    if (p->byte >= keylen) {
+      p = p->kid;
+    } else {
+      top0 = p;
+      p = top = follow(p, key);
+    }
+  }
+  if (!strncmp(key, ((BLT_IT *)p)->key, keylen)) gc_detach(blt, g, top0, top);
+  return g;
+}
+
+BLT_GARBAGE *blt_detach_range(BLT *blt, char *lo, char *hi,
+    void (*fun)(BLT_IT *)) {
+  assert(!blt->origin);
+  BLT_GARBAGE *g = gc_new(blt, fun);
+  int below_hi(char *k) { return !hi || strcmp(k, hi) < 0; }
+  if (blt->snapgen >= 0 || blt->rcu) {
+    delete_each(blt, g, lo, below_hi);
+    return g;
+  }
+  int max = 64;
+  blt_node_ptr *path = malloc(max * sizeof(*path));
+  BLT_IT *it;
+  // Unlink the largest subtree holding the least key in the range, and no
+  // keys outside it, until none are left.
+  while ((it = blt_ceil(blt, lo)) && below_hi(it->key)) {
+    // Below the last right turn on the path to the least key, it is the
+    // least key of every subtree, so they hold no keys less than lo.
+    int n = 0, k = 0;
+    for (blt_node_ptr p = blt->root;; p = follow(p, it->key)) {
+      if (n == max) path = realloc(path, (max *= 2) * sizeof(*path));
+      path[n++] = p;
+      if (!p->is_internal) break;
+      if (it->key[p->byte] & p->mask) k = n;
+    }
+    // Find the highest of those whose greatest key is less than hi. Their
+    // keys match the least key above their crit bits, and we only turned
+    // left, so one whose crit bit is higher than the first bit where the
+    // least key differs from hi holds keys greater than hi, and one whose
+    // crit bit is lower holds none. Only one on that very bit needs its
+    // greatest key checked.
+    if (hi) {
+      int byte = first_diff(it->key, hi);
+      uint8_t x = to_mask(it->key[byte] ^ hi[byte]);
+      while (k < n - 1 &&
+          (byte << 8) + path[k]->mask > (path[k]->byte << 8) + x) {
+        k++;
+      }
+      if (k < n - 1 && path[k]->byte == byte && path[k]->mask == x &&
+          !below_hi(blt_firstlast(path[k], 1)->key)) {
+        k++;
+      }
+    }
+    gc_detach(blt, g, k ? path[k - 1] : 0, path[k]);
+  }
+  free(path);
+  return g;
+}
+
+static int gc_finish(BLT_GARBAGE *g) {
+  while (gc_step(g, 1 << 30));
+  int n = g->count;
+  free(g);
+  return n;
+}
+
+int blt_delete_prefixed(BLT *blt, char *key, void (*fun)(BLT_IT *)) {
+  return gc_finish(blt_detach_prefixed(blt, key, fun));
+}
+
+int blt_delete_range(BLT *blt, char *lo, char *hi, void (*fun)(BLT_IT *)) {
+  return gc_finish(blt_detach_range(blt, lo, hi, fun));
+}
+
+// Parallel traversal. Until a given depth, running a task on an internal
+// node pushes a task for its right kid, then continues with the left kid.
+// Below that depth, a task walks its subtree, which we call a chunk, on its
+// own. Each thread pops tasks from the bottom of its own deque, and when it
+// runs out, steals from the top of another's. A task records its path from
+// the top as bits, left-justified, so sorting chunks by path puts them in
+// key order.
+struct par_task_s {
+  blt_node_ptr p;
+  int depth;
+  uint64_t path;
+};
+
+struct par_deque_s {
+  pthread_mutex_t lock;
+  int top, bottom, max;
+  struct par_task_s *task;
+} __attribute__((aligned(64)));
+
+struct par_chunk_s {
+  uint64_t path;
+  void *acc;
+};
+
+struct par_s {
+  int nthreads, depth;
+  int pending;              // Tasks pushed but not yet finished.
+  struct par_deque_s *deque;
+  void (*fun)(BLT_IT *, int);
+  void *(*start)(void);
+  void (*ofun)(void *, BLT_IT *);
+  struct par_worker_s {
+    struct par_s *par;
+    int id, n, max;
+    struct par_chunk_s *chunk;  // Ordered mode: chunks done by this thread.
+  } *worker;
+};
+
+static void par_push(struct par_deque_s *d, struct par_task_s t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->max) {
+    // Slide everything down before growing.
+    if (d->top) {
+      memmove(d->task, d->task + d->top, (d->bottom - d->top) * sizeof(t));
+    }
+    d->bottom -= d->top;
+    d->top = 0;
+    if (d->bottom >= d->max / 2) {
+      d->max = d->max ? 2 * d->max : 64;
+      d->task = realloc(d->task, d->max * sizeof(t));
+    }
+  }
+  d->task[d->bottom++] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Takes a task from the bottom of the deque if own, and the top otherwise.
+static int par_pop(struct par_deque_s *d, struct par_task_s *t, int own) {
+  // Peek first, to spare the lock.
+  if (__atomic_load_n(&d->top, __ATOMIC_RELAXED) ==
+      __atomic_load_n(&d->bottom, __ATOMIC_RELAXED)) return 0;
+  pthread_mutex_lock(&d->lock);
+  int r = d->top < d->bottom;
+  if (r) *t = own ? d->task[--d->bottom] : d->task[d->top++];
+  pthread_mutex_unlock(&d->lock);
+  return r;
+}
+
+static void par_walk(struct par_worker_s *w, blt_node_ptr p, void *acc) {
+  while (p->is_internal) {
+    par_walk(w, p->kid, acc);
+    p = p->kid + 1;
+  }
+  if (w->par->fun) {
+    w->par->fun((BLT_IT *) p, w->id);
+  } else {
+    w->par->ofun(acc, (BLT_IT *) p);
+  }
+}
+
+static void par_run(struct par_worker_s *w, struct par_task_s t) {
+  struct par_s *par = w->par;
+  while (t.p->is_internal && t.depth < par->depth) {
+    struct par_task_s right = {
+      t.p->kid + 1, t.depth + 1, t.path | 1ull << (63 - t.depth)
+    };
+    __atomic_add_fetch(&par->pending, 1, __ATOMIC_RELAXED);
+    par_push(par->deque + w->id, right);
+    t.p = t.p->kid;
+    t.depth++;
+  }
+  void *acc = 0;
+  if (!par->fun) {
+    acc = par->start();
+    if (w->n == w->max) {
+      w->max = w->max ? 2 * w->max : 64;
+      w->chunk = realloc(w->chunk, w->max * sizeof(*w->chunk));
+    }
+    w->chunk[w->n].path = t.path;
+    w->chunk[w->n++].acc = acc;
+  }
+  par_walk(w, t.p, acc);
+}
+
+static void *par_worker(void *arg) {
+  struct par_worker_s *w = arg;
+  struct par_s *par = w->par;
+  unsigned seed = w->id;
+  struct par_task_s t;
+  while (__atomic_load_n(&par->pending, __ATOMIC_ACQUIRE)) {
+    if (!par_pop(par->deque + w->id, &t, 1)) {
+      seed = seed * 1103515245 + 12345;
+      int victim = (seed >> 16) % par->nthreads;
+      if (!par_pop(par->deque + victim, &t, victim == w->id)) {
+        sched_yield();
+        continue;
+      }
+    }
+    par_run(w, t);
+    __atomic_sub_fetch(&par->pending, 1, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+static int chunk_cmp(const void *a, const void *b) {
+  uint64_t x = ((struct par_chunk_s *) a)->path;
+  uint64_t y = ((struct par_chunk_s *) b)->path;
+  return (x > y) - (x < y);
+}
+
+static void par_traverse(BLT *blt, char *key, struct par_s *par,
+    void (*finish)(void *)) {
+  blt_node_ptr top = prefix_top(blt, key);
+  if (!top) return;
+  int n = par->nthreads < 1 ? 1 : par->nthreads;
+  par->nthreads = n;
+  // Aim for a few hundred chunks per thread if the tree is balanced.
+  par->depth = 8;
+  while (1 << (par->depth - 8) < n && par->depth < 32) par->depth++;
+  struct par_deque_s deque[n];
+  struct par_worker_s worker[n];
+  par->deque = deque;
+  par->worker = worker;
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_init(&deque[i].lock, 0);
+    deque[i].top = deque[i].bottom = deque[i].max = 0;
+    deque[i].task = 0;
+    worker[i] = (struct par_worker_s) { .par = par, .id = i };
+  }
+  par->pending = 1;
+  par_push(deque, (struct par_task_s) { top, 0, 0 });
+  pthread_t th[n];
+  for (int i = 1; i < n; i++) pthread_create(th + i, 0, par_worker, worker + i);
+  par_worker(worker);
+  for (int i = 1; i < n; i++) pthread_join(th[i], 0);
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_destroy(&deque[i].lock);
+    free(deque[i].task);
+  }
+  if (par->fun) return;
+  // Gather the chunks and finish them in order.
+  int total = 0;
+  for (int i = 0; i < n; i++) total += worker[i].n;
+  struct par_chunk_s *chunk = malloc(total * sizeof(*chunk));
+  total = 0;
+  for (int i = 0; i < n; i++) {
+    if (worker[i].n) {
+      memcpy(chunk + total, worker[i].chunk, worker[i].n * sizeof(*chunk));
+    }
+    total += worker[i].n;
+    free(worker[i].chunk);
+  }
+  qsort(chunk, total, sizeof(*chunk), chunk_cmp);
+  for (int i = 0; i < total; i++) finish(chunk[i].acc);
+  free(chunk);
+}
+
+void blt_allprefixed_parallel(BLT *blt, char *key, int nthreads,
+    void (*fun)(BLT_IT *, int)) {
+  struct par_s par = { .nthreads = nthreads, .fun = fun };
+  par_traverse(blt, key, &par, 0);
+}
+
+void blt_allprefixed_ordered(BLT *blt, char *key, int nthreads,
+    void *(*start)(void), void (*fun)(void *, BLT_IT *),
+    void (*finish)(void *)) {
+  struct par_s par = {
+    .nthreads = nthreads, .start = start, .ofun = fun
+  };
+  par_traverse(blt, key, &par, finish);
+}
+
 BLT_IT *blt_get(BLT *blt, char *key) {
-  if (blt->empty) return 0;
-  blt_node_ptr p = blt->root;
+  blt_node_ptr p = get_root(blt);
+  if (!p) return 0;
   int keylen = strlen(key);
   while (p->is_internal) {
     // We could shave off a few percent by skipping checks like the
@@ -336,7 +1878,7 @@ BLT_IT *blt_get(BLT *blt, char *key) {
 }
 
 int blt_empty(BLT *blt) {
-  return blt->empty;
+  return !get_root(blt);
 }
 
 int blt_size(BLT *blt) {
@@ -16,6 +16,15 @@
 //   // Delete the tree.
 //   blt_clear(blt);
 
+#ifndef __BLT_H__
+#define __BLT_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct BLT;
 typedef struct BLT BLT;
 struct BLT_IT {
@@ -27,9 +36,113 @@ typedef struct BLT_IT BLT_IT;
 // Creates a new tree.
 BLT *blt_new();
 
-// Destroys a tree.
+// Creates a new tree whose nodes and keys come from alloc(ctx, n) instead
+// of malloc(), and go back through dealloc(ctx, p, n), where n is the size
+// that was passed to alloc(). Blocks must be aligned for any type, as those
+// of malloc() are. Pass both functions, or neither to get malloc() and
+// free(); returns NULL if only one is given. Snapshots of the tree, and
+// garbage detached from it, use the same allocator, so it must outlive them.
+// For example, an arena may ignore dealloc() and be thrown away with the
+// tree.
+BLT *blt_new_with_allocator(void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx);
+
+// Creates a new tree that can be read by many threads while one thread
+// modifies it, without locks.
+//
+// Only one thread at a time may call functions that modify the tree.
+// Any number of reader threads may concurrently call blt_get(), blt_ceil(),
+// blt_floor(), blt_first(), blt_last(), blt_allprefixed() and blt_forall().
+// A reader first calls blt_rcu_register(), and then must call
+// blt_rcu_quiescent() regularly, at points where it holds no leaf nodes of
+// the tree. Leaf nodes obtained by a reader remain valid, though possibly
+// outdated, until its next quiescent state. Memory discarded by the writer is
+// freed once all readers have passed through a quiescent state.
+BLT *blt_new_rcu();
+
+// Registers the calling thread as a reader of an RCU tree.
+// Returns a handle for the functions below, or -1 if there are too many
+// readers.
+int blt_rcu_register(BLT *blt);
+
+// Announces that the given reader holds no leaf nodes of the tree.
+void blt_rcu_quiescent(BLT *blt, int reader);
+
+// Unregisters a reader. It must not access the tree until it registers again.
+void blt_rcu_unregister(BLT *blt, int reader);
+
+// Inserts or updates a key in an RCU tree. Unlike blt_put(), any number of
+// registered threads may call this and blt_rcu_delete() at the same time,
+// alongside readers. Returns 1 if the key is new, and 0 otherwise.
+int blt_rcu_put(BLT *blt, int reader, char *key, void *data);
+
+// Deletes a key from an RCU tree; see blt_rcu_put().
+// Returns 1 if a key was deleted, and 0 otherwise.
+int blt_rcu_delete(BLT *blt, int reader, char *key);
+
+// Optimistic lock coupling: an alternative to blt_rcu_put() and
+// blt_rcu_delete() that modifies nodes in place, so writers allocate and copy
+// less. Any number of registered threads may call the following on a tree
+// from blt_new_rcu(), but such a tree must not be modified or read in any
+// other way while they do. Writers pass their handle from blt_rcu_register().
+
+// Looks up a key. If present, returns 1 and copies its data to *data when
+// data is not NULL. Otherwise returns 0.
+int blt_olc_get(BLT *blt, char *key, void **data);
+
+// Inserts or updates a key. Returns 1 if the key is new, and 0 otherwise.
+int blt_olc_put(BLT *blt, int reader, char *key, void *data);
+
+// Deletes a key. Returns 1 if a key was deleted, and 0 otherwise.
+int blt_olc_delete(BLT *blt, int reader, char *key);
+
+// Destroys a tree, or releases a snapshot.
+// All snapshots of a tree must be released before the tree is destroyed.
 void blt_clear(BLT *blt);
 
+// Frees a tree a little at a time, or on another thread, for trees so large
+// that blt_clear() would block for too long.
+typedef struct BLT_GARBAGE BLT_GARBAGE;
+
+// Destroys a tree in O(1) time, apart from memory held for snapshots or RCU
+// readers, and returns its nodes and keys, which remain to be freed.
+BLT_GARBAGE *blt_clear_detach(BLT *blt);
+
+// Frees up to budget pairs of nodes along with their keys. Returns 1 if
+// anything is left, and otherwise frees g and returns 0.
+int blt_clear_step(BLT_GARBAGE *g, int budget);
+
+// Destroys a tree on a background thread.
+void blt_clear_async(BLT *blt);
+
+// Frees garbage on a background thread.
+void blt_garbage_async(BLT_GARBAGE *g);
+
+// Returns an immutable snapshot of the tree in O(1) time.
+// The snapshot supports all functions that do not modify a tree, and is
+// unaffected by later changes to the original tree, which copies only the
+// nodes along the paths it modifies while snapshots are alive.
+// Release the snapshot with blt_clear().
+BLT *blt_snapshot(BLT *blt);
+
+// Builds a tree from n keys with the given number of threads. If vals is
+// NULL, all data is NULL. If a key appears more than once, the last value
+// wins, as with repeated calls to blt_put().
+BLT *blt_build_parallel(char **keys, void **vals, int n, int nthreads);
+
+// Builds a tree from keys in increasing order, in linear time:
+//
+//   BLT_BUILDER *b = blt_builder_new();
+//   for (...) blt_builder_add(b, key, data);
+//   BLT *blt = blt_builder_finish(b);
+//
+// blt_builder_add() returns 0, or -1 without adding anything if the key is
+// not greater than the previous one.
+typedef struct BLT_BUILDER BLT_BUILDER;
+BLT_BUILDER *blt_builder_new();
+int blt_builder_add(BLT_BUILDER *b, char *key, void *data);
+BLT *blt_builder_finish(BLT_BUILDER *b);
+
 // Retrieves the leaf node at a given key.
 // Returns NULL if there is no such key.
 BLT_IT *blt_get(BLT *blt, char *key);
@@ -50,21 +163,85 @@ BLT_IT *blt_put(BLT *blt, char *key, void *data);
 // Returns 0 on success. Returns 1 if key is already present.
 int blt_put_if_absent(BLT *blt, char *key, void *data);
 
+// Inserts or updates a key. If the key was present, returns 1 and copies its
+// previous data to *old when old is not NULL. Otherwise returns 0.
+int blt_replace(BLT *blt, char *key, void *data, void **old);
+
+// If the key is present and its data is expected, changes its data and
+// returns 1. Otherwise returns 0.
+int blt_cas(BLT *blt, char *key, void *expected, void *data);
+
+// Creates or retrieves the leaf node at a given key, and sets its data to
+// fn(data, ctx), where data is NULL if the key is new. Returns the leaf node.
+BLT_IT *blt_upsert(BLT *blt, char *key, void *(*fn)(void *, void *),
+    void *ctx);
+
 // Deletes a given key from the tree.
 // Returns 1 if a key was deleted, and 0 otherwise.
 int blt_delete(BLT *blt, char *key);
 
+// As blt_delete(), but also copies the data of the deleted key to *data when
+// data is not NULL.
+int blt_extract(BLT *blt, char *key, void **data);
+
+// Deletes all keys with a given prefix. If fun is not NULL, it is called on
+// each leaf node before it is freed, for example to free its data.
+// Returns the number of keys deleted.
+int blt_delete_prefixed(BLT *blt, char *key, void (*fun)(BLT_IT *));
+
+// Deletes all keys at least lo and less than hi, or all keys at least lo if
+// hi is NULL, as blt_delete_prefixed().
+int blt_delete_range(BLT *blt, char *lo, char *hi, void (*fun)(BLT_IT *));
+
+// As blt_delete_prefixed() and blt_delete_range(), but only unlinks the keys
+// from the tree, and returns them to be freed with blt_clear_step() or
+// blt_garbage_async(), which call fun. Unlinking takes time proportional to
+// the depth of the tree rather than the number of keys, except in trees
+// with snapshots or RCU readers, where keys are deleted one at a time. In
+// RCU trees, fun is called once readers have moved on, when the writer
+// frees the leaf.
+BLT_GARBAGE *blt_detach_prefixed(BLT *blt, char *key, void (*fun)(BLT_IT *));
+BLT_GARBAGE *blt_detach_range(BLT *blt, char *lo, char *hi,
+    void (*fun)(BLT_IT *));
+
 // Iterates through all leaf nodes with a given prefix in order and runs the
 // given callback on each one.
 // If the callback returns 1, continues iteration, otherwise halts and returns
 // the value returned by the callback.
 int blt_allprefixed(BLT *blt, char *key, int (*fun)(BLT_IT *));
 
+#ifndef __cplusplus
 // Iterates through all leaf nodes in order and runs the given callback.
+// A GNU C nested function, so C++ code iterates with blt_first() and
+// blt_next() instead, or uses blt_map.h.
 static inline void blt_forall(BLT *blt, void (*fun)(BLT_IT *)) {
   int f(BLT_IT *it) { return fun(it), 1; }
   blt_allprefixed(blt, "", f);
 }
+#endif
+
+// Runs the given callback on every leaf node with a given prefix, using the
+// given number of threads, which steal subtrees from each other to share
+// the work. The callback is called concurrently and in no particular order.
+// Its second argument identifies the calling thread, from 0 to nthreads - 1,
+// so it can add to per-thread totals without locks. The tree must not be
+// modified meanwhile.
+void blt_allprefixed_parallel(BLT *blt, char *key, int nthreads,
+    void (*fun)(BLT_IT *, int));
+
+static inline void blt_forall_parallel(BLT *blt, int nthreads,
+    void (*fun)(BLT_IT *, int)) {
+  blt_allprefixed_parallel(blt, (char *) "", nthreads, fun);
+}
+
+// As blt_allprefixed_parallel(), but splits the leaf nodes into chunks of
+// consecutive keys. For each chunk, start() creates an accumulator, then
+// fun() is called with it on each leaf node of the chunk in order. Once all
+// chunks are done, finish() is called on each accumulator in turn, in key
+// order, from the calling thread.
+void blt_allprefixed_ordered(BLT *blt, char *key, int nthreads,
+    void *(*start)(void), void (*fun)(void *, BLT_IT *),
+    void (*finish)(void *));
 
 // Returns the leaf node with the smallest key.
 BLT_IT *blt_first(BLT *blt);
@@ -97,3 +274,9 @@ int blt_empty(BLT *blt);
 
 // Returns number of keys.
 int blt_size(BLT *blt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __BLT_H__
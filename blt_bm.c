@@ -43,6 +43,7 @@ void f(char **key, int m) {
   bm_init();
   REP(i, m) blt_delete(blt, key[i]);
   bm_report("BLT delete");
+  blt_clear(blt);
 }
 
 int main() {
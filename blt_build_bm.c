@@ -0,0 +1,54 @@
+// Benchmark building a tree from unsorted keys with blt_put() against
+// blt_build_parallel() with various numbers of threads. For example:
+//
+//   $ blt_build_bm 1 2 4 8 16 < /usr/share/dict/words
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static int nthreads[64], nn;
+
+void f(char **key, int m) {
+  // Shuffle, as the input to a cold start is rarely sorted.
+  srand(1);
+  for (int i = m - 1; i > 0; i--) {
+    int j = rand() % (i + 1);
+    char *t = key[i];
+    key[i] = key[j];
+    key[j] = t;
+  }
+  bm_init();
+  BLT *want = blt_new();
+  REP(i, m) blt_put(want, key[i], (void *) (intptr_t) i);
+  bm_report("BLT build with blt_put");
+  void **val = malloc(m * sizeof(*val));
+  REP(i, m) val[i] = (void *) (intptr_t) i;
+  REP(j, nn) {
+    char msg[64];
+    bm_init();
+    BLT *blt = blt_build_parallel(key, val, m, nthreads[j]);
+    sprintf(msg, "BLT build, %d threads", nthreads[j]);
+    bm_report(msg);
+    if (blt_size(blt) != blt_size(want)) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    blt_clear(blt);
+  }
+  free(val);
+  blt_clear(want);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 16; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
@@ -0,0 +1,43 @@
+// Benchmark bulk deletion from a BLT. For example:
+//
+//   $ blt_delete_bm < /usr/share/dict/words
+//
+// We time deleting every key one at a time, then with blt_delete_range(),
+// then unlinking them all with blt_detach_range() and freeing them
+// separately.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  REP(i, m) blt_put(blt, key[i], 0);
+  bm_init();
+  REP(i, m) blt_delete(blt, key[i]);
+  bm_report("BLT delete");
+  REP(i, m) blt_put(blt, key[i], 0);
+  bm_init();
+  blt_delete_range(blt, "", 0, 0);
+  bm_report("BLT delete_range");
+  REP(i, m) blt_put(blt, key[i], 0);
+  bm_init();
+  BLT_GARBAGE *g = blt_detach_range(blt, "", 0, 0);
+  bm_report("BLT detach_range");
+  if (!blt_empty(blt)) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  bm_init();
+  while (blt_clear_step(g, 1 << 16));
+  bm_report("BLT free_range");
+  blt_clear(blt);
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Front-coded key streams.
+//
+// A stream is the magic string, then one record per key, in increasing
+// order, then a record with lcp and len both 0. A record is:
+//
+//   varint lcp;     // Bytes shared with the previous key.
+//   varint len;     // One more than the number of remaining bytes.
+//   char rest[len - 1];
+//
+// Varints hold 7 bits per byte, least significant first, with the top bit
+// set on all but the last byte. Every RESTART keys, lcp is 0, so a reader
+// can start decoding there without the keys before it.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blt_export.h"
+
+enum { RESTART = 64 };
+
+static const char magic[8] = "BLTFC1\n";
+
+static char *put_varint(char *p, uint64_t v) {
+  for (; v >= 128; v >>= 7) *p++ = v | 128;
+  *p++ = v;
+  return p;
+}
+
+// Returns -1 at the end of the stream or on overflow.
+static int64_t get_varint(FILE *in) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 63; shift += 7) {
+    int c = getc(in);
+    if (c == EOF) return -1;
+    v |= (uint64_t) (c & 127) << shift;
+    if (!(c & 128)) return v;
+  }
+  return -1;
+}
+
+int blt_export_frontcoded(BLT *blt, FILE *out) {
+  fwrite(magic, 1, sizeof(magic), out);
+  char *prev = "", *buf = 0;
+  size_t max = 0;
+  int n = 0;
+  blt_forall(blt, ({ void _(BLT_IT *it) {
+    size_t lcp = 0;
+    if (n++ % RESTART) {
+      while (prev[lcp] && prev[lcp] == it->key[lcp]) lcp++;
+    }
+    size_t len = strlen(it->key + lcp);
+    if (len + 20 > max) buf = realloc(buf, max = 2 * (len + 20));
+    char *p = put_varint(put_varint(buf, lcp), len + 1);
+    memcpy(p, it->key + lcp, len);
+    fwrite(buf, 1, p + len - buf, out);
+    prev = it->key;
+  }_; }));
+  fwrite("\0", 1, 2, out);
+  free(buf);
+  return ferror(out) ? -1 : 0;
+}
+
+// Reads the bytes of a key from at to end, growing the buffer only as the
+// bytes arrive, so a corrupt length costs no more memory than the stream
+// holds. Returns -1 on a short read or if out of memory.
+static int read_rest(FILE *in, char **key, size_t *max, size_t at,
+    size_t end) {
+  for (;;) {
+    size_t room = *max - 1 - at, n = end - at < room ? end - at : room;
+    if (fread(*key + at, 1, n, in) != n) return -1;
+    at += n;
+    if (at == end) return 0;
+    char *p = realloc(*key, *max * 2);
+    if (!p) return -1;
+    *key = p;
+    *max *= 2;
+  }
+}
+
+BLT *blt_import_frontcoded(FILE *in) {
+  char m[sizeof(magic)];
+  if (fread(m, 1, sizeof(m), in) != sizeof(m) || memcmp(m, magic, sizeof(m))) {
+    return 0;
+  }
+  BLT_BUILDER *b = blt_builder_new();
+  size_t max = 256, keylen = 0;
+  char *key = malloc(max);
+  int ok = 0;
+  while (key) {
+    int64_t lcp = get_varint(in), len = lcp < 0 ? -1 : get_varint(in);
+    if (!len) {
+      ok = !lcp;
+      break;
+    }
+    if (len < 0 || lcp > keylen) break;
+    if (read_rest(in, &key, &max, lcp, lcp + len - 1)) break;
+    keylen = lcp + len - 1;
+    key[keylen] = 0;
+    if (blt_builder_add(b, key, 0)) break;
+  }
+  free(key);
+  BLT *blt = blt_builder_finish(b);
+  if (!ok) {
+    blt_clear(blt);
+    return 0;
+  }
+  return blt;
+}
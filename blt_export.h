@@ -0,0 +1,29 @@
+// = Front-coded key streams =
+//
+// A compact way to ship the keys of a tree elsewhere:
+//
+//   blt_export_frontcoded(blt, stdout);
+//   ...
+//   BLT *copy = blt_import_frontcoded(stdin);
+//
+// Keys are written in order, each as the length of the prefix it shares
+// with the previous key followed by the rest, so the common prefixes of
+// keys such as URLs cost a byte or two. Neither side holds more than a key
+// at a time beyond the tree itself.
+
+#ifndef __BLT_EXPORT_H__
+#define __BLT_EXPORT_H__
+
+#include <stdio.h>
+#include "blt.h"
+
+// Writes the keys of a tree to a stream. Returns 0 on success, and -1 on
+// error.
+int blt_export_frontcoded(BLT *blt, FILE *out);
+
+// Reads keys written by blt_export_frontcoded() and builds a tree of them,
+// in linear time. The data of each key is NULL. Returns NULL if the stream
+// is not a valid export.
+BLT *blt_import_frontcoded(FILE *in);
+
+#endif  // __BLT_EXPORT_H__
@@ -0,0 +1,65 @@
+// Benchmark shipping a tree as a front-coded stream, against dumping its
+// keys one per line and inserting them with blt_put(). For example:
+//
+//   $ blt_export_bm < /usr/share/dict/words
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bm.h"
+#include "blt.h"
+#include "blt_export.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  REP(i, m) blt_put(blt, key[i], 0);
+  FILE *fp = tmpfile();
+  bm_init();
+  blt_forall(blt, ({ void _(BLT_IT *it) { fprintf(fp, "%s\n", it->key); }_; }));
+  fflush(fp);
+  bm_report("BLT export plain");
+  printf("BLT export plain size: %ld bytes\n", ftell(fp));
+  rewind(fp);
+  bm_init();
+  BLT *copy = blt_new();
+  char *line = 0;
+  size_t len = 0;
+  ssize_t n;
+  while ((n = getline(&line, &len, fp)) > 0) {
+    line[n - 1] = 0;
+    blt_put(copy, line, 0);
+  }
+  free(line);
+  bm_report("BLT import plain");
+  if (blt_size(copy) != blt_size(blt)) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  blt_clear(copy);
+  fclose(fp);
+
+  fp = tmpfile();
+  bm_init();
+  blt_export_frontcoded(blt, fp);
+  fflush(fp);
+  bm_report("BLT export frontcoded");
+  printf("BLT export frontcoded size: %ld bytes\n", ftell(fp));
+  rewind(fp);
+  bm_init();
+  copy = blt_import_frontcoded(fp);
+  bm_report("BLT import frontcoded");
+  if (!copy || blt_size(copy) != blt_size(blt)) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  blt_clear(copy);
+  fclose(fp);
+  blt_clear(blt);
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
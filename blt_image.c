@@ -0,0 +1,364 @@
+// Crit-bit tree images.
+//
+// An image is a header, an array of nodes, then the keys, each followed by
+// a NUL. Nodes are 16 bytes: two 64-bit words. An internal node holds its
+// crit byte, mask and 1 in the first word, and the index of its left kid in
+// the second. A leaf holds twice the offset of its key in the first word,
+// and its data in the second. As in a BLT, the two kids of a node are
+// adjacent. The root is node 0, and below it each pair is followed by the
+// pairs of the left subtree, then those of the right, so scans move forward
+// through the file. Keys are stored in order for the same reason.
+//
+// Saving lists the keys in order, and rebuilds the tree from them: the crit
+// bit of a run of sorted keys lies between its first and last keys, and
+// splits the run into those with the bit clear and those with it set.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blt_image.h"
+#include "first_diff.h"
+
+struct blt_image_header_s {
+  char magic[8];
+  uint64_t order;           // 1, to detect byte order mismatches.
+  uint64_t nkeys, nnodes;
+  uint64_t strlen;          // Size of the key region.
+};
+
+static const char magic[8] = "BLTIMG1";
+
+struct img_node_s {
+  uint64_t w, kid;
+};
+typedef const struct img_node_s *img_node_ptr;
+
+struct BLT_IMAGE {
+  void *base;               // The mapping we own, if any.
+  size_t len;
+  img_node_ptr node;
+  char *str;
+  uint64_t nkeys, nnodes, strlen;
+};
+
+static inline int is_internal(img_node_ptr p) { return p->w & 1; }
+static inline uint32_t crit_byte(img_node_ptr p) { return p->w >> 32; }
+static inline uint8_t crit_mask(img_node_ptr p) { return p->w >> 8; }
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *c = buf;
+  while (len) {
+    ssize_t n = write(fd, c, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    c += n;
+    len -= n;
+  }
+  return 0;
+}
+
+struct save_s {
+  char **key;
+  uint64_t *data;
+  uint64_t *off;
+  struct img_node_s *node;
+};
+
+// Writes the subtree holding keys lo to hi - 1 to node i, with its pairs
+// starting at node j.
+static void save_tree(struct save_s *s, int lo, int hi, uint64_t i,
+    uint64_t j) {
+  struct img_node_s *n = s->node + i;
+  if (hi - lo == 1) {
+    n->w = s->off[lo] << 1;
+    n->kid = s->data[lo];
+    return;
+  }
+  char *a = s->key[lo], *b = s->key[hi - 1];
+  uint32_t byte = 0;
+  while (a[byte] == b[byte]) byte++;
+  uint8_t mask = leading_bit(a[byte] ^ b[byte]);
+  // Find the first key with the crit bit set.
+  int l = lo + 1, h = hi - 1;
+  while (l < h) {
+    int m = l + (h - l) / 2;
+    if (s->key[m][byte] & mask) h = m; else l = m + 1;
+  }
+  n->w = (uint64_t) byte << 32 | mask << 8 | 1;
+  n->kid = j;
+  save_tree(s, lo, l, j, j + 2);
+  save_tree(s, l, hi, j + 1, j + 2 + 2 * (uint64_t) (l - lo - 1));
+}
+
+uint64_t blt_save_size(BLT *blt) {
+  uint64_t n = 0, len = sizeof(struct blt_image_header_s);
+  blt_forall(blt, ({void _(BLT_IT *it) {
+    n++;
+    len += strlen(it->key) + 1;
+  }_;}));
+  return len + (n ? 2 * n - 1 : 0) * sizeof(struct img_node_s);
+}
+
+int blt_save_with(BLT *blt, int fd, uint64_t (*fun)(BLT_IT *)) {
+  int n = blt_size(blt), i = 0;
+  struct save_s s = {
+    .key = malloc(n * sizeof(char *)),
+    .data = malloc(n * sizeof(uint64_t)),
+    .off = malloc(n * sizeof(uint64_t)),
+    .node = malloc((n ? 2 * n - 1 : 0) * sizeof(struct img_node_s)),
+  };
+  struct blt_image_header_s h = {
+    .order = 1, .nkeys = n, .nnodes = n ? 2 * n - 1 : 0
+  };
+  memcpy(h.magic, magic, sizeof(magic));
+  blt_forall(blt, ({void _(BLT_IT *it) {
+    s.key[i] = it->key;
+    s.data[i] = fun ? fun(it) : (uintptr_t) it->data;
+    s.off[i++] = h.strlen;
+    h.strlen += strlen(it->key) + 1;
+  }_;}));
+  if (n) save_tree(&s, 0, n, 0, 1);
+  int r = write_all(fd, &h, sizeof(h));
+  if (!r) r = write_all(fd, s.node, h.nnodes * sizeof(*s.node));
+  // Batch the keys into larger writes.
+  enum { BUFSIZE = 1 << 16 };
+  char *buf = malloc(BUFSIZE);
+  size_t len = 0;
+  for (i = 0; i < n && !r; i++) {
+    size_t k = strlen(s.key[i]) + 1;
+    if (len + k > BUFSIZE) {
+      r = write_all(fd, buf, len);
+      len = 0;
+    }
+    if (k > BUFSIZE) {
+      if (!r) r = write_all(fd, s.key[i], k);
+    } else {
+      memcpy(buf + len, s.key[i], k);
+      len += k;
+    }
+  }
+  if (!r) r = write_all(fd, buf, len);
+  free(buf);
+  free(s.key);
+  free(s.data);
+  free(s.off);
+  free(s.node);
+  return r;
+}
+
+int blt_save(BLT *blt, int fd) { return blt_save_with(blt, fd, 0); }
+
+BLT_IMAGE *blt_image_view(const void *buf, size_t len) {
+  const struct blt_image_header_s *h = buf;
+  if (len < sizeof(*h)) return 0;
+  if (memcmp(h->magic, magic, sizeof(magic)) || h->order != 1 ||
+      h->nnodes > (len - sizeof(*h)) / sizeof(struct img_node_s) ||
+      h->nnodes != (h->nkeys ? 2 * h->nkeys - 1 : 0)) {
+    return 0;
+  }
+  size_t nodes = sizeof(*h) + h->nnodes * sizeof(struct img_node_s);
+  if (h->strlen > len - nodes) return 0;
+  BLT_IMAGE *img = malloc(sizeof(*img));
+  img->base = 0;
+  img->len = 0;
+  img->node = (img_node_ptr) (h + 1);
+  img->str = (char *) buf + nodes;
+  img->nkeys = h->nkeys;
+  img->nnodes = h->nnodes;
+  img->strlen = h->strlen;
+  return img;
+}
+
+// Pairs come after their parents, so walks down the tree always end. Keys
+// need only start in the key region, which ends with a NUL.
+int blt_image_check(BLT_IMAGE *img) {
+  uint64_t n = img->nnodes;
+  if (!n) return 1;
+  if (img->str[img->strlen - 1]) return 0;
+  for (uint64_t i = 0; i < n; i++) {
+    img_node_ptr p = img->node + i;
+    if (is_internal(p) ? p->kid <= i || p->kid >= n - 1 :
+        p->w >> 1 >= img->strlen) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+BLT_IMAGE *blt_open_mmap(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (!fstat(fd, &st) && st.st_size) {
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) return 0;
+  BLT_IMAGE *img = blt_image_view(base, st.st_size);
+  if (!img) {
+    munmap(base, st.st_size);
+    return 0;
+  }
+  img->base = base;
+  img->len = st.st_size;
+  return img;
+}
+
+BLT_IMAGE *blt_open_mmap_checked(const char *path) {
+  BLT_IMAGE *img = blt_open_mmap(path);
+  if (img && !blt_image_check(img)) {
+    blt_image_close(img);
+    return 0;
+  }
+  return img;
+}
+
+void blt_image_close(BLT_IMAGE *img) {
+  if (img->base) munmap(img->base, img->len);
+  free(img);
+}
+
+uint64_t blt_image_size(BLT_IMAGE *img) { return img->nkeys; }
+
+uint64_t blt_image_bytes(BLT_IMAGE *img) {
+  return img->str + img->strlen - (char *) (img->node) +
+      sizeof(struct blt_image_header_s);
+}
+
+static inline img_node_ptr kid(BLT_IMAGE *img, img_node_ptr p, int dir) {
+  return img->node + p->kid + dir;
+}
+
+static inline img_node_ptr follow(BLT_IMAGE *img, img_node_ptr p, char *key) {
+  return kid(img, p, !!(key[crit_byte(p)] & crit_mask(p)));
+}
+
+static inline int fill(BLT_IMAGE *img, img_node_ptr p, BLT_IMAGE_IT *it) {
+  if (!p) return 0;
+  it->key = img->str + (p->w >> 1);
+  it->data = p->kid;
+  return 1;
+}
+
+static inline img_node_ptr root(BLT_IMAGE *img) {
+  return img->nnodes ? img->node : 0;
+}
+
+static img_node_ptr firstlast(BLT_IMAGE *img, img_node_ptr p, int dir) {
+  if (!p) return 0;
+  while (is_internal(p)) p = kid(img, p, dir);
+  return p;
+}
+
+int blt_image_first(BLT_IMAGE *img, BLT_IMAGE_IT *it) {
+  return fill(img, firstlast(img, root(img), 0), it);
+}
+
+int blt_image_last(BLT_IMAGE *img, BLT_IMAGE_IT *it) {
+  return fill(img, firstlast(img, root(img), 1), it);
+}
+
+// Moves to the next key (way = 1) or the previous one (way = 0).
+// The key is from the image, and a corrupt image may test bytes past its
+// end, which we take to be 0.
+static int nextprev(BLT_IMAGE *img, BLT_IMAGE_IT *it, int way) {
+  img_node_ptr p = root(img), other = 0;
+  uint32_t len = strlen(it->key);
+  while (is_internal(p)) {
+    int dir = crit_byte(p) <= len && (it->key[crit_byte(p)] & crit_mask(p));
+    if (dir != way) other = kid(img, p, way);
+    p = kid(img, p, dir);
+  }
+  return fill(img, firstlast(img, other, !way), it);
+}
+
+int blt_image_next(BLT_IMAGE *img, BLT_IMAGE_IT *it) {
+  return nextprev(img, it, 1);
+}
+
+int blt_image_prev(BLT_IMAGE *img, BLT_IMAGE_IT *it) {
+  return nextprev(img, it, 0);
+}
+
+int blt_image_get(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it) {
+  img_node_ptr p = root(img);
+  if (!p) return 0;
+  uint32_t keylen = strlen(key);
+  while (is_internal(p)) {
+    if (crit_byte(p) > keylen) return 0;
+    p = follow(img, p, key);
+  }
+  char *k = img->str + (p->w >> 1);
+  return strcmp(key, k) ? 0 : fill(img, p, it);
+}
+
+// As blt_ceilfloor().
+static int ceilfloor(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it, int way) {
+  img_node_ptr top = root(img), p = top;
+  if (!p) return 0;
+  uint32_t keylen = strlen(key);
+  while (is_internal(p)) {
+    p = crit_byte(p) < keylen ? follow(img, p, key) : kid(img, p, 0);
+  }
+  char *pc = img->str + (p->w >> 1);
+  for (char *c = key;; c++, pc++) {
+    uint8_t x = *c ^ *pc;
+    if (x) {
+      uint32_t byte = c - key;
+      x = leading_bit(x);
+      img_node_ptr q = top, other = 0;
+      while (is_internal(q)) {
+        if (((uint64_t) byte << 8) + crit_mask(q) <
+            ((uint64_t) crit_byte(q) << 8) + x) break;
+        int dir = !!(crit_mask(q) & key[crit_byte(q)]);
+        if (dir == way) other = kid(img, q, 1 - way);
+        q = kid(img, q, dir);
+      }
+      if (!!(x & key[byte]) == way) other = q;
+      return fill(img, firstlast(img, other, way), it);
+    }
+    if (!*c) return fill(img, p, it);
+  }
+}
+
+int blt_image_ceil(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it) {
+  return ceilfloor(img, key, it, 0);
+}
+
+int blt_image_floor(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it) {
+  return ceilfloor(img, key, it, 1);
+}
+
+int blt_image_allprefixed(BLT_IMAGE *img, char *key,
+    int (*fun)(BLT_IMAGE_IT *)) {
+  img_node_ptr p = root(img), top = p;
+  if (!p) return 1;
+  uint32_t keylen = strlen(key);
+  while (is_internal(p)) {
+    if (crit_byte(p) >= keylen) {
+      p = kid(img, p, 0);
+    } else {
+      p = follow(img, p, key);
+      top = p;
+    }
+  }
+  if (strncmp(key, img->str + (p->w >> 1), keylen)) return 1;
+  int traverse(img_node_ptr p) {
+    if (is_internal(p)) {
+      int status = traverse(kid(img, p, 0));
+      if (status != 1) return status;
+      return traverse(kid(img, p, 1));
+    }
+    BLT_IMAGE_IT it;
+    fill(img, p, &it);
+    return fun(&it);
+  }
+  return traverse(top);
+}
@@ -0,0 +1,99 @@
+// = Crit-bit tree images =
+//
+// A tree can be saved to a file as an image that is used in place: opening
+// it maps the file into memory and parses nothing, and processes mapping the
+// same image share its pages.
+//
+// Usage:
+//
+//   int fd = open("words.blt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+//   blt_save(blt, fd);
+//   close(fd);
+//
+//   BLT_IMAGE *img = blt_open_mmap("words.blt");
+//   BLT_IMAGE_IT it;
+//   if (blt_image_get(img, "hello", &it)) printf("%lu\n", it.data);
+//   blt_image_close(img);
+//
+// Images hold the data of each key as a 64-bit integer, as pointers would be
+// meaningless to another process. They are in host byte order.
+
+#ifndef __BLT_IMAGE_H__
+#define __BLT_IMAGE_H__
+
+#include <stdint.h>
+#include "blt.h"
+
+struct BLT_IMAGE;
+typedef struct BLT_IMAGE BLT_IMAGE;
+
+// A key in an image, and its data. The key points into the image.
+struct BLT_IMAGE_IT {
+  char *key;
+  uint64_t data;
+};
+typedef struct BLT_IMAGE_IT BLT_IMAGE_IT;
+
+// Writes an image of the tree to the given file descriptor.
+// Returns 0 on success, and -1 on error, with errno set.
+int blt_save(BLT *blt, int fd);
+
+// As blt_save(), but stores fun(it) as the data of each leaf node it,
+// calling fun on the leaf nodes in order.
+int blt_save_with(BLT *blt, int fd, uint64_t (*fun)(BLT_IT *));
+
+// Returns the number of bytes blt_save() would write.
+uint64_t blt_save_size(BLT *blt);
+
+// Maps the image in the given file. Returns NULL on error. Only the header
+// is checked, so opening takes constant time, but the file must come from a
+// trusted source.
+BLT_IMAGE *blt_open_mmap(const char *path);
+
+// As blt_open_mmap(), but also returns NULL if blt_image_check() rejects the
+// image. Use this for files that may be corrupt or hostile.
+BLT_IMAGE *blt_open_mmap_checked(const char *path);
+
+// Uses an image already in memory, which must outlive the returned handle.
+// Returns NULL if the buffer does not start with a valid image header. Only
+// the header is checked, so the image must come from a trusted source, or
+// pass blt_image_check().
+BLT_IMAGE *blt_image_view(const void *buf, size_t len);
+
+// Returns 1 if every node and key offset in the image lies within it, so
+// that lookups cannot stray outside the image, and 0 otherwise. Reads every
+// node once.
+int blt_image_check(BLT_IMAGE *img);
+
+// Releases an image, unmapping it if it came from blt_open_mmap() or
+// blt_open_mmap_checked(). Keys obtained from it are no longer valid.
+void blt_image_close(BLT_IMAGE *img);
+
+// Returns number of keys.
+uint64_t blt_image_size(BLT_IMAGE *img);
+
+// Returns the number of bytes the image occupies, which is what
+// blt_save_size() returned for its tree. Anything after this in the file or
+// buffer is not part of the image.
+uint64_t blt_image_bytes(BLT_IMAGE *img);
+
+// The functions below mirror their counterparts in blt.h. Rather than
+// returning a leaf node, they return 1 and fill in *it if they find a key,
+// and return 0 otherwise.
+
+int blt_image_get(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it);
+int blt_image_ceil (BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it);
+int blt_image_floor(BLT_IMAGE *img, char *key, BLT_IMAGE_IT *it);
+int blt_image_first(BLT_IMAGE *img, BLT_IMAGE_IT *it);
+int blt_image_last (BLT_IMAGE *img, BLT_IMAGE_IT *it);
+
+// Moves *it to the next or previous key, which must be present.
+int blt_image_next(BLT_IMAGE *img, BLT_IMAGE_IT *it);
+int blt_image_prev(BLT_IMAGE *img, BLT_IMAGE_IT *it);
+
+// Iterates through all keys with a given prefix in order and runs the given
+// callback on each one, as blt_allprefixed().
+int blt_image_allprefixed(BLT_IMAGE *img, char *key,
+    int (*fun)(BLT_IMAGE_IT *));
+
+#endif  // __BLT_IMAGE_H__
@@ -0,0 +1,52 @@
+// Benchmark saving a BLT as an image and reading it back. For example:
+//
+//   $ blt_image_bm < /usr/share/dict/words
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bm.h"
+#include "blt.h"
+#include "blt_image.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  REP(i, m) blt_put(blt, key[i], (void *) (intptr_t) i);
+  char path[] = "/tmp/blt_image_bm.XXXXXX";
+  int fd = mkstemp(path);
+  bm_init();
+  if (fd < 0 || blt_save(blt, fd)) {
+    perror("blt_save");
+    exit(1);
+  }
+  close(fd);
+  bm_report("BLT save");
+  BLT_IMAGE *img = blt_open_mmap(path);
+  bm_report("BLT open_mmap");
+  BLT_IMAGE_IT it;
+  REP(i, m) if (!blt_image_get(img, key[i], &it) || i != it.data) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  bm_report("BLT image_get");
+  int count = 0;
+  for (int ok = blt_image_first(img, &it); ok; ok = blt_image_next(img, &it)) {
+    count++;
+  }
+  if (count != m) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  bm_report("BLT image_iterate");
+  blt_image_close(img);
+  unlink(path);
+  blt_clear(blt);
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
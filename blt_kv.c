@@ -0,0 +1,441 @@
+// Durable key-value store.
+//
+// Each update appends a record to a buffer in memory and applies itself to
+// the tree under one mutex, so the log order matches the order in which
+// updates take effect. Then the writer waits for its record to be synced.
+// If no sync is in progress, it becomes the leader: it waits out the group
+// commit window, takes the buffer, and writes and syncs it without the
+// mutex, while later writers fill the other buffer. Followers sleep until a
+// sync covers their records.
+//
+// A log record is:
+//
+//   uint32_t klen, vlen;      // vlen is DELETED for a delete.
+//   uint32_t sum;             // FNV-1a hash of the rest of the record.
+//   char key[klen], value[vlen];
+//
+// Recovery replays the log until the first incomplete or corrupt record,
+// which is cut off. Replaying a record more than once is harmless, as each
+// one sets a key to a fixed state.
+//
+// A checkpoint is an image whose data is the file offset of each value,
+// followed by the values, NUL-terminated. It is written to a temporary file
+// which is synced and renamed over the last one before the log is emptied.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blt.h"
+#include "blt_image.h"
+#include "blt_kv.h"
+
+enum { DELETED = 0xffffffff };
+
+struct wal_header_s {
+  uint32_t klen, vlen, sum;
+};
+
+struct buf_s {
+  char *p;
+  size_t len, max;
+};
+
+struct BLT_KV {
+  char *dir;
+  int wal;
+  int window_us;
+  size_t checkpoint_bytes;
+  pthread_mutex_t lock;     // Guards everything below.
+  pthread_cond_t synced;
+  BLT *blt;                 // Data: malloc'd copies of the values.
+  struct buf_s buf[2];      // Records waiting to be written, and a spare.
+  uint64_t lsn;             // Number of records logged.
+  uint64_t durable;         // Number of records synced or checkpointed.
+  size_t wal_size;          // Bytes written to the log.
+  int syncing;
+  int error;
+};
+
+static uint32_t fnv(uint32_t h, const void *p, size_t n) {
+  const unsigned char *s = p;
+  while (n--) h = (h ^ *s++) * 16777619;
+  return h;
+}
+
+static uint32_t record_sum(uint32_t klen, uint32_t vlen, const char *key,
+    const char *value) {
+  uint32_t h = 2166136261;
+  h = fnv(h, &klen, 4);
+  h = fnv(h, &vlen, 4);
+  h = fnv(h, key, klen);
+  if (vlen != DELETED) h = fnv(h, value, vlen);
+  return h;
+}
+
+static char *path(BLT_KV *kv, const char *name) {
+  char *s = malloc(strlen(kv->dir) + strlen(name) + 2);
+  sprintf(s, "%s/%s", kv->dir, name);
+  return s;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r, n -= r;
+  }
+  return 0;
+}
+
+static int sync_dir(BLT_KV *kv) {
+  int fd = open(kv->dir, O_RDONLY);
+  if (fd < 0) return -1;
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+// Sets a key in the tree, or deletes it if value is NULL.
+static int apply(BLT *blt, char *key, char *value) {
+  if (!value) {
+    void *data;
+    if (!blt_extract(blt, key, &data)) return 0;
+    free(data);
+    return 1;
+  }
+  int is_new;
+  BLT_IT *it = blt_setp(blt, key, &is_new);
+  if (!is_new) free(it->data);
+  it->data = strdup(value);
+  return is_new;
+}
+
+// Grows a buffer to hold at least n bytes.
+static void reserve(struct buf_s *b, size_t n) {
+  if (n > b->max) {
+    while (n > b->max) b->max = b->max ? 2 * b->max : 4096;
+    b->p = realloc(b->p, b->max);
+  }
+}
+
+static void append(struct buf_s *b, char *key, char *value) {
+  uint32_t klen = strlen(key), vlen = value ? strlen(value) : DELETED;
+  size_t n = sizeof(struct wal_header_s) + klen + (value ? vlen : 0);
+  reserve(b, b->len + n);
+  struct wal_header_s h = { klen, vlen, record_sum(klen, vlen, key, value) };
+  char *p = b->p + b->len;
+  memcpy(p, &h, sizeof(h));
+  memcpy(p + sizeof(h), key, klen);
+  if (value) memcpy(p + sizeof(h) + klen, value, vlen);
+  b->len += n;
+}
+
+// Waits until record lsn is durable. Called with the lock held.
+static void commit(BLT_KV *kv, uint64_t lsn) {
+  while (kv->durable < lsn && !kv->error) {
+    if (kv->syncing) {
+      pthread_cond_wait(&kv->synced, &kv->lock);
+      continue;
+    }
+    kv->syncing = 1;
+    if (kv->window_us) {
+      pthread_mutex_unlock(&kv->lock);
+      usleep(kv->window_us);
+      pthread_mutex_lock(&kv->lock);
+    }
+    struct buf_s b = kv->buf[0];
+    kv->buf[0] = kv->buf[1];
+    kv->buf[0].len = 0;
+    uint64_t end = kv->lsn;
+    pthread_mutex_unlock(&kv->lock);
+    int r = write_all(kv->wal, b.p, b.len);
+    if (!r) r = fdatasync(kv->wal);
+    pthread_mutex_lock(&kv->lock);
+    kv->buf[1] = b;
+    if (r) kv->error = errno ? errno : EIO;
+    kv->wal_size += b.len;
+    if (kv->durable < end) kv->durable = end;
+    kv->syncing = 0;
+    pthread_cond_broadcast(&kv->synced);
+  }
+}
+
+static int checkpoint_locked(BLT_KV *kv);
+
+static int update(BLT_KV *kv, char *key, char *value) {
+  pthread_mutex_lock(&kv->lock);
+  if (kv->error) {
+    pthread_mutex_unlock(&kv->lock);
+    errno = kv->error;
+    return -1;
+  }
+  append(&kv->buf[0], key, value);
+  int r = apply(kv->blt, key, value);
+  commit(kv, ++kv->lsn);
+  if (!kv->error && kv->checkpoint_bytes &&
+      kv->wal_size >= kv->checkpoint_bytes) {
+    checkpoint_locked(kv);
+  }
+  if (kv->error) errno = kv->error, r = -1;
+  pthread_mutex_unlock(&kv->lock);
+  return r;
+}
+
+int blt_kv_put(BLT_KV *kv, char *key, char *value) {
+  return update(kv, key, value) < 0 ? -1 : 0;
+}
+
+int blt_kv_delete(BLT_KV *kv, char *key) {
+  return update(kv, key, 0);
+}
+
+char *blt_kv_get(BLT_KV *kv, char *key) {
+  pthread_mutex_lock(&kv->lock);
+  BLT_IT *it = blt_get(kv->blt, key);
+  char *s = it ? strdup(it->data) : 0;
+  pthread_mutex_unlock(&kv->lock);
+  return s;
+}
+
+int blt_kv_size(BLT_KV *kv) {
+  pthread_mutex_lock(&kv->lock);
+  int n = blt_size(kv->blt);
+  pthread_mutex_unlock(&kv->lock);
+  return n;
+}
+
+static int write_checkpoint(BLT_KV *kv, int fd) {
+  uint64_t off = blt_save_size(kv->blt);
+  uint64_t value_offset(BLT_IT *it) {
+    uint64_t r = off;
+    off += strlen(it->data) + 1;
+    return r;
+  }
+  if (blt_save_with(kv->blt, fd, value_offset)) return -1;
+  struct buf_s b = { 0 };
+  int r = 0;
+  int f(BLT_IT *it) {
+    size_t n = strlen(it->data) + 1;
+    if (b.len + n > b.max) {
+      if (write_all(fd, b.p, b.len)) return r = -1, 0;
+      b.len = 0;
+      if (n > b.max) {
+        b.max = n < 1 << 16 ? 1 << 16 : n;
+        b.p = realloc(b.p, b.max);
+      }
+    }
+    memcpy(b.p + b.len, it->data, n);
+    b.len += n;
+    return 1;
+  }
+  blt_allprefixed(kv->blt, "", f);
+  if (!r && b.len) r = write_all(fd, b.p, b.len);
+  free(b.p);
+  if (!r) r = fsync(fd);
+  return r;
+}
+
+// Called with the lock held, so no records are logged meanwhile.
+static int checkpoint_locked(BLT_KV *kv) {
+  while (kv->syncing) pthread_cond_wait(&kv->synced, &kv->lock);
+  char *tmp = path(kv, "checkpoint.tmp"), *dst = path(kv, "checkpoint");
+  int r = -1;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    r = write_checkpoint(kv, fd);
+    if (close(fd)) r = -1;
+    if (!r) r = rename(tmp, dst);
+    if (!r) r = sync_dir(kv);
+  }
+  free(tmp);
+  free(dst);
+  if (r) {
+    kv->error = errno ? errno : EIO;
+  } else {
+    // The checkpoint holds every record logged so far.
+    kv->buf[0].len = 0;
+    kv->durable = kv->lsn;
+    if (ftruncate(kv->wal, 0) || fdatasync(kv->wal)) {
+      kv->error = errno;
+      r = -1;
+    }
+    kv->wal_size = 0;
+  }
+  pthread_cond_broadcast(&kv->synced);
+  return r;
+}
+
+int blt_kv_checkpoint(BLT_KV *kv) {
+  pthread_mutex_lock(&kv->lock);
+  int r = kv->error ? -1 : checkpoint_locked(kv);
+  if (r) errno = kv->error;
+  pthread_mutex_unlock(&kv->lock);
+  return r;
+}
+
+// Maps a file, or returns NULL with *len set to 0 if it is missing or empty.
+static char *map_file(char *name, size_t *len) {
+  *len = 0;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  char *p = 0;
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) p = 0;
+    else *len = st.st_size;
+  }
+  close(fd);
+  return p;
+}
+
+// Replays the log into a tree whose data is a copy of each value, or
+// tombstone for a delete. Returns the length of the intact prefix.
+static size_t replay(char *p, size_t len, BLT *tail, char *tombstone) {
+  size_t i = 0;
+  // Keys may be too long for the stack.
+  struct buf_s k = { 0 };
+  for (;;) {
+    struct wal_header_s h;
+    if (len - i < sizeof(h)) break;
+    memcpy(&h, p + i, sizeof(h));
+    size_t vlen = h.vlen == DELETED ? 0 : h.vlen;
+    if (len - i - sizeof(h) < (uint64_t) h.klen + vlen) break;
+    char *key = p + i + sizeof(h), *val = key + h.klen;
+    if (record_sum(h.klen, h.vlen, key, val) != h.sum) break;
+    reserve(&k, (size_t) h.klen + 1);
+    memcpy(k.p, key, h.klen);
+    k.p[h.klen] = 0;
+    int is_new;
+    BLT_IT *it = blt_setp(tail, k.p, &is_new);
+    if (!is_new && it->data != tombstone) free(it->data);
+    if (h.vlen == DELETED) {
+      it->data = tombstone;
+    } else {
+      it->data = malloc(vlen + 1);
+      memcpy(it->data, val, vlen);
+      ((char *) it->data)[vlen] = 0;
+    }
+    i += sizeof(h) + h.klen + vlen;
+  }
+  free(k.p);
+  return i;
+}
+
+// Merges the checkpoint with the replayed log, both in key order, with the
+// builder.
+// Returns NULL if the checkpoint is corrupt.
+static BLT *recover(char *ck, size_t cklen, BLT *tail, char *tombstone) {
+  BLT_IMAGE *img = 0;
+  if (ck && !(img = blt_image_view(ck, cklen))) return 0;
+  if (img && !blt_image_check(img)) {
+    blt_image_close(img);
+    return 0;
+  }
+  BLT_IMAGE_IT ci;
+  if (img) {
+    // Values follow the image, and each must end before the file does.
+    uint64_t vals = blt_image_bytes(img);
+    for (int ok = blt_image_first(img, &ci); ok;
+         ok = blt_image_next(img, &ci)) {
+      if (ci.data < vals || ci.data >= cklen ||
+          !memchr(ck + ci.data, 0, cklen - ci.data)) {
+        blt_image_close(img);
+        return 0;
+      }
+    }
+  }
+  BLT_BUILDER *b = blt_builder_new();
+  int more = img && blt_image_first(img, &ci);
+  BLT_IT *ti = blt_first(tail);
+  while (more || ti) {
+    int c = !more ? 1 : !ti ? -1 : strcmp(ci.key, ti->key);
+    if (c < 0) {
+      blt_builder_add(b, ci.key, strdup(ck + ci.data));
+    } else {
+      if (ti->data != tombstone) blt_builder_add(b, ti->key, ti->data);
+      ti = blt_next(tail, ti);
+    }
+    if (c <= 0) more = blt_image_next(img, &ci);
+  }
+  if (img) blt_image_close(img);
+  return blt_builder_finish(b);
+}
+
+BLT_KV *blt_kv_open(const char *dir, int window_us, size_t checkpoint_bytes) {
+  if (mkdir(dir, 0755) && errno != EEXIST) return 0;
+  BLT_KV *kv = calloc(1, sizeof(*kv));
+  kv->dir = strdup(dir);
+  kv->window_us = window_us;
+  kv->checkpoint_bytes = checkpoint_bytes;
+  pthread_mutex_init(&kv->lock, 0);
+  pthread_cond_init(&kv->synced, 0);
+
+  char *name = path(kv, "wal");
+  kv->wal = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+  free(name);
+  // The log may be new, so its directory entry must be durable before we
+  // acknowledge anything written to it.
+  if (kv->wal >= 0 && sync_dir(kv)) {
+    close(kv->wal);
+    kv->wal = -1;
+  }
+  if (kv->wal < 0) {
+    free(kv->dir);
+    free(kv);
+    return 0;
+  }
+  static char tombstone[1];
+  BLT *tail = blt_new();
+  size_t walen;
+  name = path(kv, "wal");
+  char *w = map_file(name, &walen);
+  free(name);
+  kv->wal_size = w ? replay(w, walen, tail, tombstone) : 0;
+  if (w) munmap(w, walen);
+  if (kv->wal_size < walen) {
+    // Cut off a torn write.
+    if (ftruncate(kv->wal, kv->wal_size)) kv->error = errno;
+  }
+
+  size_t cklen;
+  name = path(kv, "checkpoint");
+  char *ck = map_file(name, &cklen);
+  free(name);
+  kv->blt = recover(ck, cklen, tail, tombstone);
+  if (ck) munmap(ck, cklen);
+  if (!kv->blt) {
+    blt_forall(tail, ({ void _(BLT_IT *it) {
+      if (it->data != tombstone) free(it->data);
+    }_; }));
+    kv->blt = blt_new();
+    blt_kv_close(kv);
+    kv = 0;
+  }
+  blt_clear(tail);
+  return kv;
+}
+
+void blt_kv_close(BLT_KV *kv) {
+  pthread_mutex_lock(&kv->lock);
+  while (kv->syncing) pthread_cond_wait(&kv->synced, &kv->lock);
+  pthread_mutex_unlock(&kv->lock);
+  close(kv->wal);
+  blt_forall(kv->blt, ({ void _(BLT_IT *it) { free(it->data); }_; }));
+  blt_clear(kv->blt);
+  for (int i = 0; i < 2; i++) free(kv->buf[i].p);
+  pthread_cond_destroy(&kv->synced);
+  pthread_mutex_destroy(&kv->lock);
+  free(kv->dir);
+  free(kv);
+}
@@ -0,0 +1,58 @@
+// = Durable key-value store =
+//
+// String keys and values, indexed in memory by a crit-bit tree, and made
+// durable by a write-ahead log (WAL) and checkpoints. A directory holds the
+// log in "wal", and the latest checkpoint in "checkpoint", which is a tree
+// image (see blt_image.h) followed by the values.
+//
+// Usage:
+//
+//   BLT_KV *kv = blt_kv_open("db", 100, 64 << 20);
+//   blt_kv_put(kv, "hello", "world");
+//   char *s = blt_kv_get(kv, "hello");
+//   free(s);
+//   blt_kv_close(kv);
+//
+// Any number of threads may use the store at once. Each update is appended
+// to the log and applied to the tree at once, so readers may see it before
+// it is durable, but the update only returns once it has been synced.
+// Concurrent writers share syncs: whichever thread syncs first waits out the
+// group commit window, then syncs everything logged so far.
+
+#ifndef __BLT_KV_H__
+#define __BLT_KV_H__
+
+#include <stddef.h>
+
+struct BLT_KV;
+typedef struct BLT_KV BLT_KV;
+
+// Opens the store in the given directory, creating it if needed, and
+// recovers its contents from the last checkpoint and the log. Syncs wait
+// window_us microseconds to gather more updates. Once the log grows past
+// checkpoint_bytes, the next update checkpoints; 0 means only explicit
+// checkpoints. Returns NULL on error.
+BLT_KV *blt_kv_open(const char *dir, int window_us, size_t checkpoint_bytes);
+
+// Durably sets the value of a key. Returns 0 on success, and -1 on error.
+int blt_kv_put(BLT_KV *kv, char *key, char *value);
+
+// Durably deletes a key. Returns 1 if a key was deleted, 0 if it was absent,
+// and -1 on error.
+int blt_kv_delete(BLT_KV *kv, char *key);
+
+// Returns a copy of the value of a key, which the caller frees, or NULL if
+// the key is absent.
+char *blt_kv_get(BLT_KV *kv, char *key);
+
+// Returns number of keys.
+int blt_kv_size(BLT_KV *kv);
+
+// Writes a checkpoint and empties the log. Returns 0 on success, and -1 on
+// error.
+int blt_kv_checkpoint(BLT_KV *kv);
+
+// Closes the store.
+void blt_kv_close(BLT_KV *kv);
+
+#endif  // __BLT_KV_H__
@@ -0,0 +1,97 @@
+// Benchmark durable writes with group commit, for several commit windows and
+// numbers of threads. For example:
+//
+//   $ blt_kv_bm 1 4 16 64 < /usr/share/dict/words
+//
+// The store lives in a temporary directory under the current one, so run it
+// on the disk of interest. Every write is synced, so only the first 20000
+// keys are used.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "bm.h"
+#include "blt_kv.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static int nthreads[64], nn;
+static char **key;
+static int m, t;
+static BLT_KV *kv;
+
+static void *worker(void *arg) {
+  intptr_t id = (intptr_t) arg;
+  int lo = id * m / t, hi = (id + 1) * m / t;
+  for (int i = lo; i < hi; i++) {
+    if (blt_kv_put(kv, key[i], key[i])) {
+      perror("blt_kv_put");
+      exit(1);
+    }
+  }
+  return 0;
+}
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void rm_store(char *dir) {
+  char s[64];
+  char *files[] = { "wal", "checkpoint", "checkpoint.tmp" };
+  REP(i, 3) {
+    sprintf(s, "%s/%s", dir, files[i]);
+    unlink(s);
+  }
+  rmdir(dir);
+}
+
+void f(char **k, int n) {
+  key = k;
+  m = n < 20000 ? n : 20000;
+  int window[] = { 0, 100, 1000 };
+  REP(w, 3) REP(j, nn) {
+    t = nthreads[j];
+    char dir[] = "blt_kv_bm.XXXXXX";
+    if (!mkdtemp(dir)) {
+      perror("mkdtemp");
+      exit(1);
+    }
+    kv = blt_kv_open(dir, window[w], 64 << 20);
+    pthread_t th[t];
+    char msg[64];
+    bm_init();
+    double start = now();
+    REP(i, t) pthread_create(th + i, 0, worker, (void *) (intptr_t) i);
+    REP(i, t) pthread_join(th[i], 0);
+    double secs = now() - start;
+    sprintf(msg, "BLT kv put, window %dus, %d threads", window[w], t);
+    bm_report(msg);
+    printf("BLT kv put, window %dus, %d threads: %.0f writes/s\n",
+        window[w], t, m / secs);
+    bm_init();
+    blt_kv_close(kv);
+    kv = blt_kv_open(dir, 0, 0);
+    if (blt_kv_size(kv) != m) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    bm_report("BLT kv recover");
+    blt_kv_close(kv);
+    rm_store(dir);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 64; t *= 4) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
@@ -0,0 +1,1028 @@
+// Log-structured merge trees.
+//
+// A run is named "run-<lo>-<hi>", where lo and hi are the first and last
+// flushes whose keys it holds. A flush writes run-n-n. A merge of runs
+// holding flushes lo through hi writes run-lo-hi, and only then deletes its
+// inputs, so after a crash, any run whose flushes another run covers is
+// stale and is deleted on open.
+//
+// A run file is a sequence of blocks, then the block index, then a footer:
+//
+//   block:  entries of uint32_t klen, vlen; char key[klen], value[vlen];
+//           where vlen is DELETED for a deleted key
+//   index:  for each block, uint64_t offset; uint32_t klen; char key[klen];
+//           giving the first key of the block
+//   footer: struct run_footer_s
+//
+// A block ends at the first entry that takes it past BLOCK bytes. On open,
+// the index is loaded into a BLT mapping the first key of each block to its
+// number, so blt_floor() finds the only block that could hold a key.
+//
+// Deleted keys are kept as tombstones in the memtable and runs, and only
+// dropped by a merge that includes the oldest run.
+//
+// One mutex guards everything but the contents of runs and immutable
+// memtables, which the background thread reads without it. Only the
+// background thread adds or removes runs. It flushes and merges in turn, so
+// while it merges, a full memtable waits to be flushed, and writers wait
+// once the next one fills up too.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blt.h"
+#include "blt_lsm.h"
+
+enum { BLOCK = 4096, DELETED = 0xffffffff, MAX_RUNS = 64 };
+
+// The value of a deleted key.
+static char tombstone[1];
+
+struct run_footer_s {
+  char magic[8];
+  uint64_t index, nblocks, nkeys;
+};
+
+static const char magic[8] = "BLTRUN1";
+
+// A growable buffer.
+struct buf_s {
+  char *p;
+  size_t len, max;
+};
+
+static void buf_add(struct buf_s *b, const void *p, size_t n) {
+  if (!n) return;
+  if (b->len + n > b->max) {
+    while (b->len + n > b->max) b->max = b->max ? 2 * b->max : BLOCK;
+    b->p = realloc(b->p, b->max);
+  }
+  memcpy(b->p + b->len, p, n);
+  b->len += n;
+}
+
+// Copies n bytes of s into b as a NUL-terminated string.
+static char *buf_str(struct buf_s *b, const char *s, size_t n) {
+  b->len = 0;
+  buf_add(b, s, n);
+  buf_add(b, "", 1);
+  return b->p;
+}
+
+struct run_s {
+  uint64_t lo, hi;
+  uint64_t id;              // Identifies its blocks in the cache.
+  int fd;
+  uint64_t size, nkeys;
+  int nblocks;
+  uint64_t *off;            // Offset of each block, then of the index.
+  BLT *index;
+  struct buf_s key, val;    // Scratch space for results.
+};
+
+// A key and its value, or tombstone.
+struct entry_s {
+  char *key, *val;
+};
+
+// A cached block, in a hash chain and in a list from most to least recently
+// used.
+struct cblock_s {
+  uint64_t id;
+  int block;
+  char *p;
+  size_t len;
+  struct cblock_s *hnext, *prev, *next;
+};
+
+struct cache_s {
+  size_t bytes, max;
+  unsigned mask;
+  struct cblock_s **bucket;
+  struct cblock_s lru;
+};
+
+struct BLT_LSM {
+  char *dir;
+  size_t memtable_bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t work;      // Signalled when there is a memtable to flush.
+  pthread_cond_t done;      // Signalled when one has been flushed.
+  BLT *mem, *imm;           // Data: malloc'd values, or tombstone.
+  size_t mem_size;
+  struct run_s *run[MAX_RUNS];  // Oldest first.
+  int nruns;
+  uint64_t seq;             // Number of the next flush.
+  uint64_t next_id;
+  struct cache_s cache;
+  struct buf_s key;         // Scratch space for seeks.
+  pthread_t thread;
+  int stop;
+  int error;
+};
+
+// Compares a key of n bytes with a string, as strcmp() would.
+static int keycmp(const char *a, size_t n, const char *b) {
+  size_t m = strlen(b);
+  int c = memcmp(a, b, n < m ? n : m);
+  return c ? c : (n > m) - (n < m);
+}
+
+static char *path(BLT_LSM *lsm, uint64_t lo, uint64_t hi, int tmp) {
+  char *s = malloc(strlen(lsm->dir) + 64);
+  sprintf(s, "%s/run-%lu-%lu%s", lsm->dir, (unsigned long) lo,
+      (unsigned long) hi, tmp ? ".tmp" : "");
+  return s;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r, n -= r;
+  }
+  return 0;
+}
+
+static int read_all(int fd, char *p, size_t n, uint64_t off) {
+  while (n) {
+    ssize_t r = pread(fd, p, n, off);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      if (!r) errno = EIO;
+      return -1;
+    }
+    p += r, n -= r, off += r;
+  }
+  return 0;
+}
+
+// Decodes the entry at p, returning the lengths of its key and value.
+static char *decode(char *p, uint32_t *klen, uint32_t *vlen) {
+  memcpy(klen, p, 4);
+  memcpy(vlen, p + 4, 4);
+  return p + 8;
+}
+
+static size_t entry_len(uint32_t klen, uint32_t vlen) {
+  return 8 + klen + (vlen == DELETED ? 0 : vlen);
+}
+
+// The block cache.
+
+static void cache_init(struct cache_s *c, size_t max) {
+  c->bytes = 0;
+  c->max = max;
+  unsigned n = 1024;
+  while (n < max / BLOCK * 2) n *= 2;
+  c->mask = n - 1;
+  c->bucket = calloc(n, sizeof(*c->bucket));
+  c->lru.prev = c->lru.next = &c->lru;
+}
+
+static struct cblock_s **cache_slot(struct cache_s *c, uint64_t id,
+    int block) {
+  uint64_t h = (id * 0x9e3779b97f4a7c15 + block) * 0xff51afd7ed558ccd;
+  struct cblock_s **p = c->bucket + ((h >> 32) & c->mask);
+  while (*p && ((*p)->id != id || (*p)->block != block)) p = &(*p)->hnext;
+  return p;
+}
+
+static void lru_unlink(struct cblock_s *b) {
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static void lru_push(struct cache_s *c, struct cblock_s *b) {
+  b->next = c->lru.next;
+  b->prev = &c->lru;
+  b->next->prev = b;
+  c->lru.next = b;
+}
+
+static void cache_drop(struct cache_s *c, uint64_t id, int block) {
+  struct cblock_s **p = cache_slot(c, id, block), *b = *p;
+  if (!b) return;
+  *p = b->hnext;
+  lru_unlink(b);
+  c->bytes -= b->len;
+  free(b->p);
+  free(b);
+}
+
+// Returns a block of a run, which stays valid until the next call.
+static struct cblock_s *get_block(BLT_LSM *lsm, struct run_s *r, int i) {
+  struct cache_s *c = &lsm->cache;
+  struct cblock_s **p = cache_slot(c, r->id, i), *b = *p;
+  if (b) {
+    lru_unlink(b);
+    lru_push(c, b);
+    return b;
+  }
+  b = malloc(sizeof(*b));
+  b->id = r->id;
+  b->block = i;
+  b->len = r->off[i + 1] - r->off[i];
+  b->p = malloc(b->len);
+  if (read_all(r->fd, b->p, b->len, r->off[i])) {
+    free(b->p);
+    free(b);
+    return 0;
+  }
+  b->hnext = 0;
+  *p = b;
+  lru_push(c, b);
+  c->bytes += b->len;
+  while (c->bytes > c->max && c->lru.prev != b) {
+    struct cblock_s *old = c->lru.prev;
+    cache_drop(c, old->id, old->block);
+  }
+  return b;
+}
+
+// Runs.
+
+static void run_free(BLT_LSM *lsm, struct run_s *r) {
+  for (int i = 0; i < r->nblocks; i++) cache_drop(&lsm->cache, r->id, i);
+  close(r->fd);
+  blt_clear(r->index);
+  free(r->off);
+  free(r->key.p);
+  free(r->val.p);
+  free(r);
+}
+
+// Returns 1 if the n bytes at p hold exactly f->nblocks index entries, each
+// an 8-byte block offset and a 4-byte key length followed by the key, with
+// offsets that never decrease or pass the index.
+static int index_ok(char *p, size_t n, struct run_footer_s *f) {
+  if (f->nblocks > n / 12 || f->nblocks >= INT_MAX) return 0;
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i < f->nblocks; i++) {
+    uint64_t off;
+    uint32_t klen;
+    if (n < 12) return 0;
+    memcpy(&off, p, 8);
+    memcpy(&klen, p + 8, 4);
+    if (klen > n - 12 || off < prev || off > f->index) return 0;
+    prev = off;
+    p += 12 + klen;
+    n -= 12 + klen;
+  }
+  return !n;
+}
+
+static struct run_s *run_open(BLT_LSM *lsm, uint64_t lo, uint64_t hi) {
+  char *name = path(lsm, lo, hi, 0);
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd < 0) return 0;
+  struct stat st;
+  struct run_footer_s f;
+  if (fstat(fd, &st) || st.st_size < sizeof(f) ||
+      read_all(fd, (char *) &f, sizeof(f), st.st_size - sizeof(f)) ||
+      memcmp(f.magic, magic, 8) || f.index > st.st_size - sizeof(f)) {
+    close(fd);
+    errno = EINVAL;
+    return 0;
+  }
+  size_t n = st.st_size - sizeof(f) - f.index;
+  char *p = malloc(n);
+  int err = read_all(fd, p, n, f.index);
+  if (!err && !index_ok(p, n, &f)) {
+    errno = EINVAL;
+    err = -1;
+  }
+  if (err) {
+    free(p);
+    close(fd);
+    return 0;
+  }
+  struct run_s *r = calloc(1, sizeof(*r));
+  r->lo = lo;
+  r->hi = hi;
+  r->id = lsm->next_id++;
+  r->fd = fd;
+  r->size = st.st_size;
+  r->nkeys = f.nkeys;
+  r->nblocks = f.nblocks;
+  r->off = malloc((f.nblocks + 1) * sizeof(*r->off));
+  r->index = blt_new();
+  char *q = p;
+  struct buf_s key = { 0 };
+  for (int i = 0; i < r->nblocks; i++) {
+    uint32_t klen;
+    memcpy(r->off + i, q, 8);
+    memcpy(&klen, q + 8, 4);
+    blt_put(r->index, buf_str(&key, q + 12, klen), (void *) (intptr_t) i);
+    q += 12 + klen;
+  }
+  r->off[r->nblocks] = f.index;
+  free(key.p);
+  free(p);
+  return r;
+}
+
+// Finds the least key greater than key (way = 0), or the greatest key less
+// than key (way = 1), or equal to it unless strict. The result is valid
+// until the next call on the run. Returns 1 if found, 0 if not, and -1 on
+// error.
+static int run_seek(BLT_LSM *lsm, struct run_s *r, char *key, int way,
+    int strict, struct entry_s *e) {
+  if (!r->nblocks) return 0;
+  BLT_IT *it = blt_floor(r->index, key);
+  int i = it ? (intptr_t) it->data : 0;
+  if (!it && way) return 0;
+  for (;;) {
+    struct cblock_s *b = get_block(lsm, r, i);
+    if (!b) return -1;
+    char *found = 0;
+    uint32_t fk = 0, fv = 0;
+    for (char *p = b->p; p < b->p + b->len;) {
+      uint32_t klen, vlen;
+      char *k = decode(p, &klen, &vlen);
+      int c = keycmp(k, klen, key);
+      if (!way) {
+        if (c > 0 || (!c && !strict)) {
+          found = k, fk = klen, fv = vlen;
+          break;
+        }
+      } else {
+        if (c > 0 || (!c && strict)) break;
+        found = k, fk = klen, fv = vlen;
+      }
+      p = k + entry_len(klen, vlen) - 8;
+    }
+    if (found) {
+      e->key = buf_str(&r->key, found, fk);
+      e->val = fv == DELETED ? tombstone : buf_str(&r->val, found + fk, fv);
+      return 1;
+    }
+    // The key is past the end of block i, or before its start.
+    i += way ? -1 : 1;
+    if (i < 0 || i >= r->nblocks) return 0;
+  }
+}
+
+// Writes a run. Entries must be added in increasing order of keys.
+struct run_writer_s {
+  int fd;
+  struct buf_s block, index;
+  uint64_t off, nblocks, nkeys;
+  int error;
+};
+
+static void writer_flush(struct run_writer_s *w) {
+  if (!w->block.len) return;
+  if (!w->error && write_all(w->fd, w->block.p, w->block.len)) {
+    w->error = errno;
+  }
+  w->off += w->block.len;
+  w->block.len = 0;
+}
+
+static void writer_add(struct run_writer_s *w, char *key, uint32_t klen,
+    char *val, uint32_t vlen) {
+  if (!w->block.len) {
+    buf_add(&w->index, &w->off, 8);
+    buf_add(&w->index, &klen, 4);
+    buf_add(&w->index, key, klen);
+    w->nblocks++;
+  }
+  buf_add(&w->block, &klen, 4);
+  buf_add(&w->block, &vlen, 4);
+  buf_add(&w->block, key, klen);
+  if (vlen != DELETED) buf_add(&w->block, val, vlen);
+  w->nkeys++;
+  if (w->block.len >= BLOCK) writer_flush(w);
+}
+
+static int sync_dir(BLT_LSM *lsm) {
+  int fd = open(lsm->dir, O_RDONLY);
+  if (fd < 0) return -1;
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+// Writes the index and footer, and moves the run into place. The rename is
+// synced before we return, as merges delete their inputs next.
+static struct run_s *writer_finish(BLT_LSM *lsm, struct run_writer_s *w,
+    uint64_t lo, uint64_t hi) {
+  writer_flush(w);
+  struct run_footer_s f = { .index = w->off, .nblocks = w->nblocks,
+      .nkeys = w->nkeys };
+  memcpy(f.magic, magic, 8);
+  buf_add(&w->index, &f, sizeof(f));
+  if (!w->error && (write_all(w->fd, w->index.p, w->index.len) ||
+      fsync(w->fd))) {
+    w->error = errno;
+  }
+  close(w->fd);
+  free(w->block.p);
+  free(w->index.p);
+  char *tmp = path(lsm, lo, hi, 1), *name = path(lsm, lo, hi, 0);
+  if (!w->error && rename(tmp, name)) w->error = errno;
+  if (w->error) unlink(tmp);
+  else if (sync_dir(lsm)) w->error = errno;
+  free(tmp);
+  free(name);
+  if (w->error) {
+    errno = w->error;
+    return 0;
+  }
+  return run_open(lsm, lo, hi);
+}
+
+static int writer_init(BLT_LSM *lsm, struct run_writer_s *w, uint64_t lo,
+    uint64_t hi) {
+  memset(w, 0, sizeof(*w));
+  char *tmp = path(lsm, lo, hi, 1);
+  w->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  free(tmp);
+  return w->fd < 0 ? -1 : 0;
+}
+
+static struct run_s *flush(BLT_LSM *lsm, BLT *imm, uint64_t seq) {
+  struct run_writer_s w;
+  if (writer_init(lsm, &w, seq, seq)) return 0;
+  int f(BLT_IT *it) {
+    char *v = it->data;
+    writer_add(&w, it->key, strlen(it->key), v,
+        v == tombstone ? DELETED : strlen(v));
+    return 1;
+  }
+  blt_allprefixed(imm, "", f);
+  return writer_finish(lsm, &w, seq, seq);
+}
+
+// Reads a run from start to end without the cache.
+struct cursor_s {
+  struct run_s *r;
+  int block;
+  struct buf_s buf;
+  size_t pos;
+  char *key;
+  uint32_t klen, vlen;
+};
+
+// Moves to the next entry. Returns 1 if there is one, 0 at the end, and -1
+// on error.
+static int cursor_next(struct cursor_s *c) {
+  if (c->pos == c->buf.len) {
+    if (++c->block >= c->r->nblocks) return 0;
+    struct run_s *r = c->r;
+    size_t n = r->off[c->block + 1] - r->off[c->block];
+    c->buf.len = 0;
+    if (n > c->buf.max) c->buf.p = realloc(c->buf.p, c->buf.max = n);
+    if (read_all(r->fd, c->buf.p, n, r->off[c->block])) return -1;
+    c->buf.len = n;
+    c->pos = 0;
+  }
+  c->key = decode(c->buf.p + c->pos, &c->klen, &c->vlen);
+  c->pos += entry_len(c->klen, c->vlen);
+  return 1;
+}
+
+// Moves to the first entry with a key at least the given one, or greater if
+// strict. Returns as cursor_next().
+static int cursor_seek(struct cursor_s *c, char *key, int strict) {
+  BLT_IT *it = blt_floor(c->r->index, key);
+  c->block = (it ? (intptr_t) it->data : 0) - 1;
+  c->buf.len = c->pos = 0;
+  int r;
+  while ((r = cursor_next(c)) > 0) {
+    int d = keycmp(c->key, c->klen, key);
+    if (d > 0 || (!d && !strict)) break;
+  }
+  return r;
+}
+
+// Compares keys of the given lengths, as strcmp() would.
+static int keycmp_n(const char *a, uint32_t an, const char *b, uint32_t bn) {
+  int c = memcmp(a, b, an < bn ? an : bn);
+  return c ? c : (an > bn) - (an < bn);
+}
+
+static int cursor_cmp(struct cursor_s *a, struct cursor_s *b) {
+  return keycmp_n(a->key, a->klen, b->key, b->klen);
+}
+
+// Merges runs, given oldest first, into one. Where they share a key, the
+// newest wins.
+static struct run_s *merge(BLT_LSM *lsm, struct run_s **in, int n,
+    int drop_tombstones) {
+  uint64_t lo = in[0]->lo, hi = in[n - 1]->hi;
+  struct run_writer_s w;
+  if (writer_init(lsm, &w, lo, hi)) return 0;
+  struct cursor_s c[n];
+  int live[n];
+  memset(c, 0, sizeof(c));
+  for (int i = 0; i < n; i++) {
+    c[i].r = in[i];
+    c[i].block = -1;
+    live[i] = cursor_next(c + i);
+    if (live[i] < 0) w.error = errno;
+  }
+  while (!w.error) {
+    int best = -1;
+    for (int i = n - 1; i >= 0; i--) {
+      if (live[i] > 0 && (best < 0 || cursor_cmp(c + i, c + best) < 0)) {
+        best = i;
+      }
+    }
+    if (best < 0) break;
+    struct cursor_s *b = c + best;
+    if (!(drop_tombstones && b->vlen == DELETED)) {
+      writer_add(&w, b->key, b->klen, b->key + b->klen, b->vlen);
+    }
+    for (int i = 0; i < n; i++) {
+      if (i != best && live[i] > 0 && !cursor_cmp(c + i, b)) {
+        live[i] = cursor_next(c + i);
+        if (live[i] < 0) w.error = errno;
+      }
+    }
+    live[best] = cursor_next(b);
+    if (live[best] < 0) w.error = errno;
+  }
+  for (int i = 0; i < n; i++) free(c[i].buf.p);
+  return writer_finish(lsm, &w, lo, hi);
+}
+
+// Deletes a run that has been replaced.
+static void run_remove(BLT_LSM *lsm, struct run_s *r) {
+  char *name = path(lsm, r->lo, r->hi, 0);
+  unlink(name);
+  free(name);
+  run_free(lsm, r);
+}
+
+// Merges the newest runs while some run is no more than twice the size of
+// all the runs after it, so sizes grow geometrically from newest to oldest.
+// Called with the lock held, which is released while merging.
+static void compact(BLT_LSM *lsm) {
+  while (lsm->nruns > 1) {
+    int n = lsm->nruns, j = n - 1;
+    uint64_t sum = lsm->run[j]->size;
+    while (j > 0 && lsm->run[j - 1]->size <= 2 * sum) {
+      sum += lsm->run[--j]->size;
+    }
+    if (j == n - 1 && n < MAX_RUNS) return;
+    if (j == n - 1) j = n - 2;
+    struct run_s *in[n - j];
+    memcpy(in, lsm->run + j, sizeof(in));
+    pthread_mutex_unlock(&lsm->lock);
+    struct run_s *r = merge(lsm, in, n - j, !j);
+    pthread_mutex_lock(&lsm->lock);
+    if (!r) {
+      lsm->error = errno;
+      return;
+    }
+    // Dropping tombstones may leave nothing, in which case the empty run
+    // goes too, once its inputs are gone.
+    lsm->nruns = j;
+    if (r->nkeys) lsm->run[lsm->nruns++] = r;
+    for (int i = 0; i < n - j; i++) run_remove(lsm, in[i]);
+    if (!r->nkeys) run_remove(lsm, r);
+  }
+}
+
+static void free_values(BLT *blt) {
+  blt_forall(blt, ({ void _(BLT_IT *it) {
+    if (it->data != tombstone) free(it->data);
+  }_; }));
+}
+
+static void *background(void *arg) {
+  BLT_LSM *lsm = arg;
+  pthread_mutex_lock(&lsm->lock);
+  for (;;) {
+    while (!lsm->imm && !lsm->stop) pthread_cond_wait(&lsm->work, &lsm->lock);
+    if (!lsm->imm) break;
+    BLT *imm = lsm->imm;
+    uint64_t seq = lsm->seq++;
+    pthread_mutex_unlock(&lsm->lock);
+    struct run_s *r = flush(lsm, imm, seq);
+    pthread_mutex_lock(&lsm->lock);
+    if (!r) {
+      // Keep the memtable readable, but refuse further updates.
+      lsm->error = errno;
+      pthread_cond_broadcast(&lsm->done);
+      break;
+    }
+    lsm->run[lsm->nruns++] = r;
+    lsm->imm = 0;
+    pthread_cond_broadcast(&lsm->done);
+    pthread_mutex_unlock(&lsm->lock);
+    free_values(imm);
+    blt_clear(imm);
+    pthread_mutex_lock(&lsm->lock);
+    compact(lsm);
+  }
+  pthread_mutex_unlock(&lsm->lock);
+  return 0;
+}
+
+// Hands the memtable to the background thread, first waiting for it to
+// finish with the last one. Called with the lock held.
+static int rotate(BLT_LSM *lsm) {
+  while (lsm->imm && !lsm->error) pthread_cond_wait(&lsm->done, &lsm->lock);
+  if (lsm->error) return -1;
+  if (blt_empty(lsm->mem)) return 0;
+  lsm->imm = lsm->mem;
+  lsm->mem = blt_new();
+  lsm->mem_size = 0;
+  pthread_cond_signal(&lsm->work);
+  return 0;
+}
+
+static int update(BLT_LSM *lsm, char *key, char *value) {
+  pthread_mutex_lock(&lsm->lock);
+  if (lsm->error) {
+    errno = lsm->error;
+    pthread_mutex_unlock(&lsm->lock);
+    return -1;
+  }
+  int is_new;
+  BLT_IT *it = blt_setp(lsm->mem, key, &is_new);
+  if (!is_new && it->data != tombstone) free(it->data);
+  it->data = value ? strdup(value) : tombstone;
+  lsm->mem_size += strlen(key) + (value ? strlen(value) : 0) + 32;
+  int r = 0;
+  if (lsm->mem_size > lsm->memtable_bytes) r = rotate(lsm);
+  pthread_mutex_unlock(&lsm->lock);
+  return r;
+}
+
+int blt_lsm_put(BLT_LSM *lsm, char *key, char *value) {
+  return update(lsm, key, value);
+}
+
+int blt_lsm_delete(BLT_LSM *lsm, char *key) {
+  return update(lsm, key, 0);
+}
+
+int blt_lsm_flush(BLT_LSM *lsm) {
+  pthread_mutex_lock(&lsm->lock);
+  int r = rotate(lsm);
+  while (!r && lsm->imm && !lsm->error) {
+    pthread_cond_wait(&lsm->done, &lsm->lock);
+  }
+  if (lsm->error) errno = lsm->error, r = -1;
+  pthread_mutex_unlock(&lsm->lock);
+  return r;
+}
+
+int blt_lsm_runs(BLT_LSM *lsm) {
+  pthread_mutex_lock(&lsm->lock);
+  int n = lsm->nruns;
+  pthread_mutex_unlock(&lsm->lock);
+  return n;
+}
+
+// Finds the value of a key, which may be tombstone, or returns NULL if
+// the key is absent. Called with the lock held.
+static char *lookup(BLT_LSM *lsm, char *key) {
+  BLT *mem[2] = { lsm->mem, lsm->imm };
+  for (int i = 0; i < 2; i++) {
+    BLT_IT *it = mem[i] ? blt_get(mem[i], key) : 0;
+    if (it) return it->data;
+  }
+  for (int i = lsm->nruns - 1; i >= 0; i--) {
+    struct entry_s e;
+    if (run_seek(lsm, lsm->run[i], key, 0, 0, &e) > 0 &&
+        !strcmp(e.key, key)) {
+      return e.val;
+    }
+  }
+  return 0;
+}
+
+char *blt_lsm_get(BLT_LSM *lsm, char *key) {
+  pthread_mutex_lock(&lsm->lock);
+  char *v = lookup(lsm, key);
+  v = v && v != tombstone ? strdup(v) : 0;
+  pthread_mutex_unlock(&lsm->lock);
+  return v;
+}
+
+static BLT_IT *mem_seek(BLT *blt, char *key, int way, int strict) {
+  BLT_IT *it = way ? blt_floor(blt, key) : blt_ceil(blt, key);
+  if (it && strict && !strcmp(it->key, key)) {
+    it = way ? blt_prev(blt, it) : blt_next(blt, it);
+  }
+  return it;
+}
+
+// Finds the first live key past the given one in the given direction, as
+// run_seek(), merging the memtables and runs. Called with the lock held.
+static int seek(BLT_LSM *lsm, char *key, int way, int strict,
+    struct entry_s *e) {
+  key = buf_str(&lsm->key, key, strlen(key));
+  for (;;) {
+    // Sources from newest to oldest, so the first to have a key wins.
+    struct entry_s best = { 0 };
+    int better(char *k) {
+      if (!best.key) return 1;
+      int c = strcmp(k, best.key);
+      return way ? c > 0 : c < 0;
+    }
+    BLT *mem[2] = { lsm->mem, lsm->imm };
+    for (int i = 0; i < 2; i++) {
+      BLT_IT *it = mem[i] ? mem_seek(mem[i], key, way, strict) : 0;
+      if (it && better(it->key)) best.key = it->key, best.val = it->data;
+    }
+    for (int i = lsm->nruns - 1; i >= 0; i--) {
+      struct entry_s x;
+      int r = run_seek(lsm, lsm->run[i], key, way, strict, &x);
+      if (r < 0) return -1;
+      if (r && better(x.key)) best = x;
+    }
+    if (!best.key) return 0;
+    if (best.val != tombstone) {
+      *e = best;
+      return 1;
+    }
+    key = buf_str(&lsm->key, best.key, strlen(best.key));
+    strict = 1;
+  }
+}
+
+static int ceilfloor(BLT_LSM *lsm, char *key, int way, char **k, char **v) {
+  pthread_mutex_lock(&lsm->lock);
+  struct entry_s e;
+  int r = seek(lsm, key, way, 0, &e) > 0;
+  if (r) {
+    *k = strdup(e.key);
+    *v = strdup(e.val);
+  }
+  pthread_mutex_unlock(&lsm->lock);
+  return r;
+}
+
+int blt_lsm_ceil(BLT_LSM *lsm, char *key, char **k, char **v) {
+  return ceilfloor(lsm, key, 0, k, v);
+}
+
+int blt_lsm_floor(BLT_LSM *lsm, char *key, char **k, char **v) {
+  return ceilfloor(lsm, key, 1, k, v);
+}
+
+// A memtable or run in a range scan, and its current entry. Runs are read
+// with a cursor, so scans leave the block cache alone.
+struct source_s {
+  BLT *mem;                 // The memtable, or NULL for a run.
+  BLT_IT *it;
+  struct cursor_s *c;
+  int live;                 // As cursor_next().
+  char *key, *val;
+  uint32_t klen, vlen;
+};
+
+static void source_load(struct source_s *s) {
+  if (s->mem) {
+    s->live = !!s->it;
+    if (!s->live) return;
+    s->key = s->it->key;
+    s->klen = strlen(s->key);
+    s->val = s->it->data;
+    s->vlen = s->val == tombstone ? DELETED : strlen(s->val);
+  } else if (s->live > 0) {
+    s->key = s->c->key;
+    s->klen = s->c->klen;
+    s->val = s->key + s->klen;
+    s->vlen = s->c->vlen;
+  }
+}
+
+static void source_seek(struct source_s *s, char *key, int strict) {
+  if (s->mem) s->it = mem_seek(s->mem, key, 0, strict);
+  else s->live = cursor_seek(s->c, key, strict);
+  source_load(s);
+}
+
+static void source_next(struct source_s *s) {
+  if (s->mem) s->it = blt_next(s->mem, s->it);
+  else s->live = cursor_next(s->c);
+  source_load(s);
+}
+
+static int source_cmp(struct source_s *a, struct source_s *b) {
+  return keycmp_n(a->key, a->klen, b->key, b->klen);
+}
+
+// Number of keys a range scan visits each time it takes the lock.
+enum { SCAN_BATCH = 256 };
+
+// Merges the memtables and runs from the given key, as merge() does, into
+// a batch of live entries below hi: for each, uint32_t klen, then the key
+// and value, each NUL-terminated. Stops after SCAN_BATCH keys, copying the
+// last key visited to *last and returning 1 if there may be more. Returns 0
+// at the end, and -1 on error. Called with the lock held, and cursors c for
+// each run.
+static int scan_batch(BLT_LSM *lsm, struct cursor_s *c, char *key,
+    char *hi, struct buf_s *batch, struct buf_s *last) {
+  // Sources from newest to oldest, so the first to have a key wins.
+  struct source_s src[2 + MAX_RUNS];
+  int n = 0;
+  BLT *mem[2] = { lsm->mem, lsm->imm };
+  for (int i = 0; i < 2; i++) {
+    if (mem[i]) src[n++] = (struct source_s) { .mem = mem[i] };
+  }
+  for (int i = lsm->nruns - 1; i >= 0; i--) {
+    c[i].r = lsm->run[i];
+    src[n++] = (struct source_s) { .c = c + i };
+  }
+  for (int i = 0; i < n; i++) {
+    source_seek(src + i, key, 0);
+    if (src[i].live < 0) return -1;
+  }
+  batch->len = 0;
+  for (int count = 0;; count++) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      if (src[i].live > 0 &&
+          (best < 0 || source_cmp(src + i, src + best) < 0)) {
+        best = i;
+      }
+    }
+    if (best < 0) return 0;
+    struct source_s *b = src + best;
+    if (hi && keycmp(b->key, b->klen, hi) >= 0) return 0;
+    if (count == SCAN_BATCH) {
+      buf_str(last, b->key, b->klen);
+      return 1;
+    }
+    if (b->vlen != DELETED) {
+      buf_add(batch, &b->klen, 4);
+      buf_add(batch, b->key, b->klen);
+      buf_add(batch, "", 1);
+      buf_add(batch, b->val, b->vlen);
+      buf_add(batch, "", 1);
+    }
+    for (int i = 0; i < n; i++) {
+      if (i != best && src[i].live > 0 && !source_cmp(src + i, b)) {
+        source_next(src + i);
+        if (src[i].live < 0) return -1;
+      }
+    }
+    source_next(b);
+    if (b->live < 0) return -1;
+  }
+}
+
+int blt_lsm_range(BLT_LSM *lsm, char *lo, char *hi,
+    int (*fun)(char *key, char *value)) {
+  struct cursor_s c[MAX_RUNS];
+  memset(c, 0, sizeof(c));
+  for (int i = 0; i < MAX_RUNS; i++) c[i].block = -1;
+  struct buf_s batch = { 0 }, last = { 0 }, from = { 0 };
+  char *key = lo;
+  int status = 1, more = 1;
+  while (more && status == 1) {
+    pthread_mutex_lock(&lsm->lock);
+    more = scan_batch(lsm, c, key, hi, &batch, &last);
+    pthread_mutex_unlock(&lsm->lock);
+    if (more < 0) {
+      status = -1;
+      break;
+    }
+    for (char *p = batch.p; p < batch.p + batch.len && status == 1;) {
+      uint32_t klen;
+      memcpy(&klen, p, 4);
+      char *k = p + 4, *v = k + klen + 1;
+      p = v + strlen(v) + 1;
+      status = fun(k, v);
+    }
+    // The next batch starts at the first key this one did not visit.
+    struct buf_s t = from;
+    from = last, last = t;
+    key = from.p;
+  }
+  for (int i = 0; i < MAX_RUNS; i++) free(c[i].buf.p);
+  free(batch.p);
+  free(last.p);
+  free(from.p);
+  return status;
+}
+
+// Finds the runs in the directory, deleting any left over from a crash.
+static int load_runs(BLT_LSM *lsm) {
+  DIR *d = opendir(lsm->dir);
+  if (!d) return -1;
+  uint64_t lo[MAX_RUNS], hi[MAX_RUNS];
+  int n = 0;
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    unsigned long a, b;
+    int len = 0;
+    if (sscanf(de->d_name, "run-%lu-%lu%n", &a, &b, &len) != 2) continue;
+    if (de->d_name[len]) {
+      // An unfinished run.
+      char *s = malloc(strlen(lsm->dir) + strlen(de->d_name) + 2);
+      if (!s) {
+        closedir(d);
+        errno = ENOMEM;
+        return -1;
+      }
+      sprintf(s, "%s/%s", lsm->dir, de->d_name);
+      unlink(s);
+      free(s);
+      continue;
+    }
+    if (n == MAX_RUNS) {
+      closedir(d);
+      errno = EMFILE;
+      return -1;
+    }
+    lo[n] = a, hi[n] = b, n++;
+  }
+  closedir(d);
+  int covered(int i) {
+    for (int j = 0; j < n; j++) {
+      if (j != i && lo[j] <= lo[i] && hi[i] <= hi[j] &&
+          (lo[j] != lo[i] || hi[j] != hi[i])) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  int keep[n + 1];
+  for (int i = 0; i < n; i++) keep[i] = !covered(i);
+  for (int i = 0; i < n; i++) if (!keep[i]) {
+    char *name = path(lsm, lo[i], hi[i], 0);
+    unlink(name);
+    free(name);
+  }
+  // Open the rest, oldest first.
+  for (;;) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      if (keep[i] && (best < 0 || lo[i] < lo[best])) best = i;
+    }
+    if (best < 0) break;
+    keep[best] = 0;
+    struct run_s *r = run_open(lsm, lo[best], hi[best]);
+    if (!r) return -1;
+    lsm->run[lsm->nruns++] = r;
+    if (lsm->seq <= hi[best]) lsm->seq = hi[best] + 1;
+  }
+  return 0;
+}
+
+BLT_LSM *blt_lsm_open(const char *dir, size_t memtable_bytes,
+    size_t cache_bytes) {
+  if (mkdir(dir, 0755) && errno != EEXIST) return 0;
+  BLT_LSM *lsm = calloc(1, sizeof(*lsm));
+  lsm->dir = strdup(dir);
+  lsm->memtable_bytes = memtable_bytes;
+  pthread_mutex_init(&lsm->lock, 0);
+  pthread_cond_init(&lsm->work, 0);
+  pthread_cond_init(&lsm->done, 0);
+  lsm->mem = blt_new();
+  cache_init(&lsm->cache, cache_bytes);
+  if (load_runs(lsm)) {
+    int e = errno;
+    lsm->stop = 1;
+    blt_lsm_close(lsm);
+    errno = e;
+    return 0;
+  }
+  pthread_create(&lsm->thread, 0, background, lsm);
+  return lsm;
+}
+
+void blt_lsm_close(BLT_LSM *lsm) {
+  if (!lsm->stop) {
+    blt_lsm_flush(lsm);
+    pthread_mutex_lock(&lsm->lock);
+    lsm->stop = 1;
+    pthread_cond_signal(&lsm->work);
+    pthread_mutex_unlock(&lsm->lock);
+    pthread_join(lsm->thread, 0);
+  }
+  BLT *mem[2] = { lsm->mem, lsm->imm };
+  for (int i = 0; i < 2; i++) if (mem[i]) {
+    free_values(mem[i]);
+    blt_clear(mem[i]);
+  }
+  for (int i = 0; i < lsm->nruns; i++) run_free(lsm, lsm->run[i]);
+  free(lsm->cache.bucket);
+  free(lsm->key.p);
+  pthread_cond_destroy(&lsm->done);
+  pthread_cond_destroy(&lsm->work);
+  pthread_mutex_destroy(&lsm->lock);
+  free(lsm->dir);
+  free(lsm);
+}
@@ -0,0 +1,76 @@
+// = Log-structured merge trees =
+//
+// String keys and values, in a crit-bit tree in memory backed by sorted runs
+// on disk, for data sets larger than memory.
+//
+// Usage:
+//
+//   BLT_LSM *lsm = blt_lsm_open("db", 64 << 20, 256 << 20);
+//   blt_lsm_put(lsm, "hello", "world");
+//   char *s = blt_lsm_get(lsm, "hello");
+//   free(s);
+//   blt_lsm_close(lsm);
+//
+// Updates go to a tree, the memtable. Once it holds more than a given number
+// of bytes, a background thread writes it out in order as an immutable run:
+// a file of blocks of sorted keys, indexed by the first key of each block.
+// The same thread merges runs of similar sizes, so there are only a
+// logarithmic number of them. Lookups check the memtable, then the runs
+// from newest to oldest, reading blocks through a cache of a given size.
+//
+// The memtable is only written out when full, or by blt_lsm_flush() or
+// blt_lsm_close(), so unlike BLT_KV, updates are lost if the process dies.
+//
+// Any number of threads may use the tree at once.
+
+#ifndef __BLT_LSM_H__
+#define __BLT_LSM_H__
+
+#include <stddef.h>
+
+struct BLT_LSM;
+typedef struct BLT_LSM BLT_LSM;
+
+// Opens the tree in the given directory, creating it if needed. The
+// memtable is flushed once it exceeds memtable_bytes, and up to cache_bytes
+// of blocks are cached. Returns NULL on error.
+BLT_LSM *blt_lsm_open(const char *dir, size_t memtable_bytes,
+    size_t cache_bytes);
+
+// Sets the value of a key. Returns 0 on success, and -1 on error.
+int blt_lsm_put(BLT_LSM *lsm, char *key, char *value);
+
+// Deletes a key. Returns 0 on success, and -1 on error.
+int blt_lsm_delete(BLT_LSM *lsm, char *key);
+
+// Returns a copy of the value of a key, which the caller frees, or NULL if
+// the key is absent.
+char *blt_lsm_get(BLT_LSM *lsm, char *key);
+
+// As blt_ceil() and blt_floor(). If there is such a key, returns 1 and sets
+// *k and *v to copies of it and its value, which the caller frees.
+// Otherwise returns 0.
+int blt_lsm_ceil (BLT_LSM *lsm, char *key, char **k, char **v);
+int blt_lsm_floor(BLT_LSM *lsm, char *key, char **k, char **v);
+
+// Iterates in order through all keys at least lo and less than hi, or all
+// keys at least lo if hi is NULL, and runs the given callback on each key
+// and value, which it must not keep. If the callback returns 1, continues
+// iteration, otherwise halts and returns the value returned by the callback.
+// Returns -1 on error. Keys are merged from the memtable and runs in
+// batches, and the callback runs between them without the lock, so it may
+// use the tree. A key updated during the scan may show either value.
+int blt_lsm_range(BLT_LSM *lsm, char *lo, char *hi,
+    int (*fun)(char *key, char *value));
+
+// Writes out the memtable and waits until it is in a run. Returns 0 on
+// success, and -1 on error.
+int blt_lsm_flush(BLT_LSM *lsm);
+
+// Returns the number of runs.
+int blt_lsm_runs(BLT_LSM *lsm);
+
+// Writes out the memtable and closes the tree.
+void blt_lsm_close(BLT_LSM *lsm);
+
+#endif  // __BLT_LSM_H__
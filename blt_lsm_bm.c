@@ -0,0 +1,70 @@
+// Benchmark an LSM tree holding more data than it may keep in memory.
+// For example:
+//
+//   $ blt_lsm_bm < /usr/share/dict/words
+//   $ blt_lsm_bm 1048576 < keys
+//
+// The optional argument is the memory budget in bytes, split evenly between
+// the memtable and the block cache. By default it is a quarter of the size
+// of the keys and values. The tree lives in a temporary directory under the
+// current one.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bm.h"
+#include "blt_lsm.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static size_t budget;
+
+void f(char **key, int m) {
+  size_t total = 0;
+  REP(i, m) total += 2 * strlen(key[i]);
+  size_t b = budget ? budget : total / 4;
+  printf("BLT lsm: %lu bytes of data, %lu bytes of memory\n", total, b);
+  char dir[] = "blt_lsm_bm.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  BLT_LSM *lsm = blt_lsm_open(dir, b / 2, b / 2);
+  bm_init();
+  REP(i, m) blt_lsm_put(lsm, key[i], key[i]);
+  blt_lsm_flush(lsm);
+  bm_report("BLT lsm put");
+  printf("BLT lsm runs: %d\n", blt_lsm_runs(lsm));
+  REP(i, m) {
+    char *s = blt_lsm_get(lsm, key[i]);
+    if (!s || strcmp(s, key[i])) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    free(s);
+  }
+  bm_report("BLT lsm get");
+  REP(i, m) {
+    char *k, *v;
+    if (blt_lsm_ceil(lsm, key[i], &k, &v)) free(k), free(v);
+  }
+  bm_report("BLT lsm ceil");
+  int n = 0;
+  blt_lsm_range(lsm, "", 0, ({ int _(char *k, char *v) { return n++, 1; }_; }));
+  bm_report("BLT lsm range");
+  REP(i, m) if (i & 1) blt_lsm_delete(lsm, key[i]);
+  blt_lsm_flush(lsm);
+  bm_report("BLT lsm delete");
+  blt_lsm_close(lsm);
+  char cmd[64];
+  sprintf(cmd, "rm -r %s", dir);
+  if (system(cmd)) exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) budget = strtoul(argv[1], 0, 0);
+  bm_read_keys(f);
+  return 0;
+}
@@ -0,0 +1,472 @@
+// = C++ containers =
+//
+// Header-only wrappers that present BLT as sorted associative containers in
+// the style of std::map and std::set. Requires C++17.
+//
+// Usage:
+//
+//   blt::map<int> m;
+//   m["hello"] = 1;
+//   m.emplace("world", 2);
+//   for (auto [key, value] : m) printf("%.*s %d\n", (int) key.size(),
+//       key.data(), value);
+//   auto it = m.lower_bound("h");  // blt_ceil()
+//
+//   blt::set s;
+//   s.insert("hello");
+//   if (s.contains("hello")) ...
+//
+// Keys are std::string_view. The tree keeps its own NUL-terminated copy of
+// each key, so keys must not contain NUL bytes. Lookups copy short keys to
+// the stack rather than building a std::string.
+//
+// Differences from std::map:
+//
+//   - Dereferencing an iterator yields, by value, a pair of the key and a
+//     reference to the value.
+//   - Inserting or erasing invalidates all iterators, as BLT moves leaves.
+//   - References to values survive inserts and erases of other keys, except
+//     for trivially copyable values no bigger than a pointer, which live in
+//     the leaf itself.
+//   - The allocator only allocates values that live outside the leaves. BLT
+//     allocates its own nodes and keys.
+
+#ifndef __BLT_MAP_H__
+#define __BLT_MAP_H__
+
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "blt.h"
+
+namespace blt {
+
+namespace detail {
+
+// NUL-terminated copy of a key, on the stack unless it is long.
+class key_buf {
+ public:
+  explicit key_buf(std::string_view k) {
+    if (k.size() < sizeof(small_)) {
+      p_ = small_;
+    } else {
+      big_.reset(new char[k.size() + 1]);
+      p_ = big_.get();
+    }
+    memcpy(p_, k.data(), k.size());
+    p_[k.size()] = 0;
+  }
+  key_buf(const key_buf &) = delete;
+  key_buf &operator=(const key_buf &) = delete;
+
+  char *get() const { return p_; }
+
+ private:
+  char small_[256];
+  std::unique_ptr<char[]> big_;
+  char *p_;
+};
+
+// Bidirectional iterator over the leaves of a tree. Traits::get() turns a
+// leaf into what the iterator yields.
+template<typename Traits>
+class leaf_iterator {
+ public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = typename Traits::value_type;
+  using reference = typename Traits::reference;
+  using difference_type = std::ptrdiff_t;
+  // Holds the result of operator* so that operator-> can point at it.
+  struct pointer {
+    reference r;
+    reference *operator->() { return &r; }
+  };
+
+  leaf_iterator() = default;
+  leaf_iterator(BLT *blt, BLT_IT *it) : blt_(blt), it_(it) {}
+  // Iterators convert to const iterators.
+  template<typename T, std::enable_if_t<Traits::is_const && !T::is_const &&
+      std::is_same_v<typename T::tree, typename Traits::tree>, int> = 0>
+  leaf_iterator(const leaf_iterator<T> &o) : blt_(o.tree()), it_(o.leaf()) {}
+
+  reference operator*() const { return Traits::get(it_); }
+  pointer operator->() const { return pointer{**this}; }
+
+  leaf_iterator &operator++() {
+    it_ = blt_next(blt_, it_);
+    return *this;
+  }
+  leaf_iterator operator++(int) {
+    leaf_iterator t = *this;
+    ++*this;
+    return t;
+  }
+  // Decrementing end() gives the last leaf.
+  leaf_iterator &operator--() {
+    it_ = it_ ? blt_prev(blt_, it_) : blt_last(blt_);
+    return *this;
+  }
+  leaf_iterator operator--(int) {
+    leaf_iterator t = *this;
+    --*this;
+    return t;
+  }
+
+  bool operator==(const leaf_iterator &o) const { return it_ == o.it_; }
+  bool operator!=(const leaf_iterator &o) const { return it_ != o.it_; }
+
+  BLT *tree() const { return blt_; }
+  BLT_IT *leaf() const { return it_; }
+
+ private:
+  BLT *blt_ = nullptr;
+  BLT_IT *it_ = nullptr;
+};
+
+// Returns the first leaf with a key greater than k.
+inline BLT_IT *upper_leaf(BLT *blt, char *k) {
+  BLT_IT *it = blt_ceil(blt, k);
+  return it && !strcmp(it->key, k) ? blt_next(blt, it) : it;
+}
+
+}  // namespace detail
+
+template<typename V, typename Alloc = std::allocator<V>>
+class map {
+  using alloc_traits = typename std::allocator_traits<Alloc>::template
+      rebind_traits<V>;
+  using value_alloc = typename alloc_traits::allocator_type;
+
+  // Small values live in the data pointer of the leaf; others live in a
+  // separate allocation that the data pointer points to.
+  static constexpr bool in_leaf = std::is_trivially_copyable_v<V> &&
+      sizeof(V) <= sizeof(void *) && alignof(V) <= alignof(void *);
+
+  static V *value(BLT_IT *it) {
+    if constexpr (in_leaf) {
+      return std::launder(reinterpret_cast<V *>(&it->data));
+    } else {
+      return static_cast<V *>(it->data);
+    }
+  }
+
+  template<bool Const>
+  struct traits {
+    using tree = map;
+    static constexpr bool is_const = Const;
+    using mapped = std::conditional_t<Const, const V, V>;
+    using value_type = std::pair<const std::string_view, V>;
+    using reference = std::pair<std::string_view, mapped &>;
+    static reference get(BLT_IT *it) { return {it->key, *value(it)}; }
+  };
+
+ public:
+  using key_type = std::string_view;
+  using mapped_type = V;
+  using value_type = std::pair<const std::string_view, V>;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using allocator_type = Alloc;
+  using iterator = detail::leaf_iterator<traits<false>>;
+  using const_iterator = detail::leaf_iterator<traits<true>>;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  map() : map(Alloc()) {}
+  explicit map(const Alloc &a) : blt_(blt_new()), alloc_(a) {}
+  map(const map &o) : map(alloc_traits::select_on_container_copy_construction(
+      o.alloc_)) {
+    for (auto [k, v] : o) try_emplace(k, v);
+  }
+  // A moved-from map is empty.
+  map(map &&o) : blt_(o.blt_), alloc_(std::move(o.alloc_)) {
+    o.blt_ = blt_new();
+  }
+  map &operator=(map o) {
+    swap(o);
+    return *this;
+  }
+  ~map() {
+    destroy_values();
+    blt_clear(blt_);
+  }
+
+  allocator_type get_allocator() const { return Alloc(alloc_); }
+
+  iterator begin() { return {blt_, blt_first(blt_)}; }
+  iterator end() { return {blt_, nullptr}; }
+  const_iterator begin() const { return {blt_, blt_first(blt_)}; }
+  const_iterator end() const { return {blt_, nullptr}; }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  bool empty() const { return blt_empty(blt_); }
+  size_type size() const { return blt_size(blt_); }
+
+  void clear() {
+    destroy_values();
+    blt_clear(blt_);
+    blt_ = blt_new();
+  }
+
+  // Constructs the value from args if the key is absent; otherwise leaves
+  // the map alone, and args untouched.
+  template<typename... Args>
+  std::pair<iterator, bool> try_emplace(std::string_view k, Args &&...args) {
+    detail::key_buf key(k);
+    int is_new;
+    BLT_IT *it = blt_setp(blt_, key.get(), &is_new);
+    if (is_new) construct(it, std::forward<Args>(args)...);
+    return {iterator(blt_, it), is_new};
+  }
+
+  template<typename... Args>
+  std::pair<iterator, bool> emplace(std::string_view k, Args &&...args) {
+    return try_emplace(k, std::forward<Args>(args)...);
+  }
+
+  template<typename P>
+  std::pair<iterator, bool> insert(P &&p) {
+    return try_emplace(p.first, std::forward<P>(p).second);
+  }
+
+  template<typename M>
+  std::pair<iterator, bool> insert_or_assign(std::string_view k, M &&obj) {
+    detail::key_buf key(k);
+    int is_new;
+    BLT_IT *it = blt_setp(blt_, key.get(), &is_new);
+    if (is_new) {
+      construct(it, std::forward<M>(obj));
+    } else {
+      *value(it) = std::forward<M>(obj);
+    }
+    return {iterator(blt_, it), is_new};
+  }
+
+  V &operator[](std::string_view k) {
+    return *value(try_emplace(k).first.leaf());
+  }
+
+  V &at(std::string_view k) {
+    BLT_IT *it = blt_get(blt_, detail::key_buf(k).get());
+    if (!it) throw std::out_of_range("blt::map::at");
+    return *value(it);
+  }
+  const V &at(std::string_view k) const {
+    return const_cast<map *>(this)->at(k);
+  }
+
+  iterator find(std::string_view k) {
+    return {blt_, blt_get(blt_, detail::key_buf(k).get())};
+  }
+  const_iterator find(std::string_view k) const {
+    return {blt_, blt_get(blt_, detail::key_buf(k).get())};
+  }
+  size_type count(std::string_view k) const { return contains(k); }
+  bool contains(std::string_view k) const {
+    return blt_get(blt_, detail::key_buf(k).get());
+  }
+
+  // The first entry with a key at least k: blt_ceil().
+  iterator lower_bound(std::string_view k) {
+    return {blt_, blt_ceil(blt_, detail::key_buf(k).get())};
+  }
+  const_iterator lower_bound(std::string_view k) const {
+    return {blt_, blt_ceil(blt_, detail::key_buf(k).get())};
+  }
+  // The first entry with a key greater than k.
+  iterator upper_bound(std::string_view k) {
+    return {blt_, detail::upper_leaf(blt_, detail::key_buf(k).get())};
+  }
+  const_iterator upper_bound(std::string_view k) const {
+    return {blt_, detail::upper_leaf(blt_, detail::key_buf(k).get())};
+  }
+  std::pair<iterator, iterator> equal_range(std::string_view k) {
+    return {lower_bound(k), upper_bound(k)};
+  }
+  std::pair<const_iterator, const_iterator> equal_range(
+      std::string_view k) const {
+    return {lower_bound(k), upper_bound(k)};
+  }
+
+  size_type erase(std::string_view k) {
+    detail::key_buf key(k);
+    BLT_IT *it = blt_get(blt_, key.get());
+    if (!it) return 0;
+    destroy(it);
+    blt_delete(blt_, key.get());
+    return 1;
+  }
+
+  // Returns an iterator to the entry after pos. The leaf of that entry may
+  // move, but its key does not, so we look it up again afterwards.
+  iterator erase(const_iterator pos) {
+    BLT_IT *next = blt_next(blt_, pos.leaf());
+    char *key = next ? next->key : nullptr;
+    destroy(pos.leaf());
+    blt_delete(blt_, pos.leaf()->key);
+    return {blt_, key ? blt_get(blt_, key) : nullptr};
+  }
+
+  void swap(map &o) {
+    std::swap(blt_, o.blt_);
+    if constexpr (alloc_traits::propagate_on_container_swap::value) {
+      std::swap(alloc_, o.alloc_);
+    }
+  }
+
+  // The underlying tree, for calling the C API directly.
+  BLT *tree() const { return blt_; }
+
+ private:
+  // Constructs the value of a new leaf. If that throws, the key goes too.
+  template<typename... Args>
+  void construct(BLT_IT *it, Args &&...args) {
+    V *p = in_leaf ? value(it) : alloc_traits::allocate(alloc_, 1);
+    try {
+      if constexpr (in_leaf) {
+        ::new (static_cast<void *>(p)) V(std::forward<Args>(args)...);
+      } else {
+        alloc_traits::construct(alloc_, p, std::forward<Args>(args)...);
+      }
+    } catch (...) {
+      if (!in_leaf) alloc_traits::deallocate(alloc_, p, 1);
+      blt_delete(blt_, it->key);
+      throw;
+    }
+    if (!in_leaf) it->data = p;
+  }
+
+  void destroy(BLT_IT *it) {
+    if constexpr (!in_leaf) {
+      V *p = value(it);
+      alloc_traits::destroy(alloc_, p);
+      alloc_traits::deallocate(alloc_, p, 1);
+    }
+  }
+
+  void destroy_values() {
+    if constexpr (!in_leaf) {
+      for (BLT_IT *it = blt_first(blt_); it; it = blt_next(blt_, it)) {
+        destroy(it);
+      }
+    }
+  }
+
+  BLT *blt_;
+  value_alloc alloc_;
+};
+
+template<typename V, typename Alloc>
+void swap(map<V, Alloc> &a, map<V, Alloc> &b) { a.swap(b); }
+
+class set {
+  struct traits {
+    using tree = set;
+    static constexpr bool is_const = true;
+    using value_type = std::string_view;
+    using reference = std::string_view;
+    static reference get(BLT_IT *it) { return it->key; }
+  };
+
+ public:
+  using key_type = std::string_view;
+  using value_type = std::string_view;
+  using size_type = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using iterator = detail::leaf_iterator<traits>;
+  using const_iterator = iterator;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = reverse_iterator;
+
+  set() : blt_(blt_new()) {}
+  set(std::initializer_list<std::string_view> keys) : set() {
+    for (auto k : keys) insert(k);
+  }
+  set(const set &o) : set() {
+    for (auto k : o) insert(k);
+  }
+  set(set &&o) : blt_(o.blt_) { o.blt_ = blt_new(); }
+  set &operator=(set o) {
+    swap(o);
+    return *this;
+  }
+  ~set() { blt_clear(blt_); }
+
+  iterator begin() const { return {blt_, blt_first(blt_)}; }
+  iterator end() const { return {blt_, nullptr}; }
+  iterator cbegin() const { return begin(); }
+  iterator cend() const { return end(); }
+  reverse_iterator rbegin() const { return reverse_iterator(end()); }
+  reverse_iterator rend() const { return reverse_iterator(begin()); }
+
+  bool empty() const { return blt_empty(blt_); }
+  size_type size() const { return blt_size(blt_); }
+
+  void clear() {
+    blt_clear(blt_);
+    blt_ = blt_new();
+  }
+
+  std::pair<iterator, bool> insert(std::string_view k) {
+    int is_new;
+    BLT_IT *it = blt_setp(blt_, detail::key_buf(k).get(), &is_new);
+    return {iterator(blt_, it), is_new};
+  }
+  std::pair<iterator, bool> emplace(std::string_view k) { return insert(k); }
+
+  iterator find(std::string_view k) const {
+    return {blt_, blt_get(blt_, detail::key_buf(k).get())};
+  }
+  size_type count(std::string_view k) const { return contains(k); }
+  bool contains(std::string_view k) const {
+    return blt_get(blt_, detail::key_buf(k).get());
+  }
+
+  iterator lower_bound(std::string_view k) const {
+    return {blt_, blt_ceil(blt_, detail::key_buf(k).get())};
+  }
+  iterator upper_bound(std::string_view k) const {
+    return {blt_, detail::upper_leaf(blt_, detail::key_buf(k).get())};
+  }
+  std::pair<iterator, iterator> equal_range(std::string_view k) const {
+    return {lower_bound(k), upper_bound(k)};
+  }
+
+  size_type erase(std::string_view k) {
+    return blt_delete(blt_, detail::key_buf(k).get());
+  }
+  iterator erase(iterator pos) {
+    BLT_IT *next = blt_next(blt_, pos.leaf());
+    char *key = next ? next->key : nullptr;
+    blt_delete(blt_, pos.leaf()->key);
+    return {blt_, key ? blt_get(blt_, key) : nullptr};
+  }
+
+  void swap(set &o) { std::swap(blt_, o.blt_); }
+
+  BLT *tree() const { return blt_; }
+
+ private:
+  BLT *blt_;
+};
+
+inline void swap(set &a, set &b) { a.swap(b); }
+
+}  // namespace blt
+
+#endif  // __BLT_MAP_H__
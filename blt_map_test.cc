@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <map>
+#include <memory>
+#include <string>
+#include "blt_map.h"
+
+#define EXPECT(_x_) if (_x_); else fprintf(stderr, "%s:%d: FAIL\n", __FILE__, __LINE__)
+#define F(i, n) for(int i = 0; i < n; i++)
+
+// Counts allocations, to check the map uses its allocator.
+static int live;
+
+template<typename T>
+struct counting_alloc {
+  using value_type = T;
+  counting_alloc() = default;
+  template<typename U> counting_alloc(const counting_alloc<U> &) {}
+  T *allocate(size_t n) {
+    live += n;
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T *p, size_t n) {
+    live -= n;
+    std::allocator<T>().deallocate(p, n);
+  }
+  bool operator==(const counting_alloc &) const { return true; }
+  bool operator!=(const counting_alloc &) const { return false; }
+};
+
+// Agrees with std::map on the same operations.
+void test_map() {
+  blt::map<int> m;
+  std::map<std::string, int> ref;
+  F(i, 1000) {
+    std::string k = std::to_string(i * 7 % 1000);
+    m[k] = i;
+    ref[k] = i;
+  }
+  EXPECT(m.size() == ref.size());
+  auto it = m.begin();
+  for (auto &[k, v] : ref) {
+    EXPECT(it != m.end() && it->first == k && it->second == v);
+    ++it;
+  }
+  EXPECT(it == m.end());
+  // Walk back from the end.
+  auto rit = ref.rbegin();
+  for (auto r = m.rbegin(); r != m.rend(); ++r, ++rit) {
+    EXPECT((*r).first == rit->first);
+  }
+  EXPECT(rit == ref.rend());
+
+  for (const char *k : { "", "1", "10", "105", "5a", "999", "a" }) {
+    auto lo = m.lower_bound(k), hi = m.upper_bound(k);
+    auto rlo = ref.lower_bound(k), rhi = ref.upper_bound(k);
+    EXPECT(lo == m.end() ? rlo == ref.end() : lo->first == rlo->first);
+    EXPECT(hi == m.end() ? rhi == ref.end() : hi->first == rhi->first);
+  }
+
+  EXPECT(!m.try_emplace("5", 42).second && m.at("5") == ref["5"]);
+  EXPECT(m.insert_or_assign("5", 42).second == false && m["5"] == 42);
+  EXPECT(m.emplace("new", 1).second && m.count("new") && m.contains("new"));
+  EXPECT(m.find("nope") == m.end());
+  try {
+    m.at("nope");
+    EXPECT(0);
+  } catch (const std::out_of_range &) {}
+
+  // Erase every other entry through iterators.
+  int n = m.size();
+  for (auto i = m.begin(); i != m.end();) {
+    i = m.erase(i);
+    if (i != m.end()) ++i;
+  }
+  EXPECT((int) m.size() == n / 2);
+  EXPECT(m.erase("1") + m.erase("10") == 1);
+
+  const blt::map<int> &c = m;
+  blt::map<int>::const_iterator ci = m.begin();
+  EXPECT(ci == c.begin() && ci->second == c.begin()->second);
+  m.clear();
+  EXPECT(m.empty() && m.begin() == m.end());
+}
+
+// Values too big to live in the leaf, and values that cannot be copied.
+void test_values() {
+  {
+    blt::map<std::string, counting_alloc<std::string>> m;
+    F(i, 100) m[std::to_string(i)] = std::string(50, 'a' + i % 26);
+    EXPECT(live == 100);
+    // References to values survive other inserts and erases.
+    std::string &s = m["42"];
+    F(i, 100) if (i != 42) m.erase(std::to_string(i));
+    F(i, 100) m.emplace("x" + std::to_string(i), "y");
+    EXPECT(s == std::string(50, 'a' + 42 % 26));
+    EXPECT(live == 101);
+    blt::map<std::string, counting_alloc<std::string>> copy(m);
+    EXPECT(live == 202 && copy.size() == 101 && copy["42"] == s);
+    copy.clear();
+    EXPECT(live == 101);
+  }
+  EXPECT(live == 0);
+
+  blt::map<std::unique_ptr<int>> m;
+  m.emplace("a", new int(1));
+  m["b"] = std::make_unique<int>(2);
+  auto p = std::make_unique<int>(3);
+  EXPECT(!m.try_emplace("a", std::move(p)).second && p);
+  blt::map<std::unique_ptr<int>> m2(std::move(m));
+  EXPECT(m.empty() && *m2["a"] == 1 && *m2["b"] == 2);
+  m = std::move(m2);
+  EXPECT(m.size() == 2 && m2.empty());
+
+  // Keys longer than the buffer on the stack.
+  std::string big(1000, 'k');
+  m.emplace(big, new int(4));
+  EXPECT(*m.at(big) == 4 && m.lower_bound(std::string(999, 'k'))->first == big);
+}
+
+void test_set() {
+  blt::set s = { "b", "a", "c" };
+  EXPECT(!s.insert("a").second && s.insert("d").second && s.size() == 4);
+  std::string all;
+  for (std::string_view k : s) all += k;
+  EXPECT(all == "abcd");
+  EXPECT(*s.lower_bound("bb") == "c" && *s.upper_bound("c") == "d");
+  EXPECT(s.upper_bound("d") == s.end() && *--s.end() == "d");
+  EXPECT(s.erase("b") && !s.erase("b") && !s.contains("b"));
+  EXPECT(*s.erase(s.find("a")) == "c" && s.size() == 2);
+}
+
+int main() {
+  test_map();
+  test_values();
+  test_set();
+  return 0;
+}
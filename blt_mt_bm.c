@@ -0,0 +1,136 @@
+// Benchmark concurrent writers, comparing blt_rcu_put() and blt_rcu_delete()
+// against a tree guarded by a mutex, and a sharded tree. For example:
+//
+//   $ blt_mt_bm 1 2 4 8 16 32 64 < /usr/share/dict/words
+//
+// The keys are split evenly among the threads, which insert, look up and
+// then delete their share. The sharded tree has 64 shards, split at keys
+// sampled from the input, so each holds about as many keys.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bm.h"
+#include "blt.h"
+#include "blt_sharded.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static int nthreads[64], nn;
+static char **key;
+static int m, t;
+static BLT *blt;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t barrier;
+static BLT_SHARDED *sharded;
+static int mode;
+enum { MUTEX, SHARDED, CAS };
+static char *mode_name[] = { "mutex", "sharded", "cas" };
+
+static void *worker(void *arg) {
+  intptr_t id = (intptr_t) arg;
+  int lo = id * m / t, hi = (id + 1) * m / t;
+  int r = mode == CAS ? blt_rcu_register(blt) : 0;
+  pthread_barrier_wait(&barrier);
+  for (int i = lo; i < hi; i++) {
+    if (mode == CAS) {
+      blt_rcu_put(blt, r, key[i], (void *) (intptr_t) i);
+      if (!(i & 63)) blt_rcu_quiescent(blt, r);
+    } else if (mode == SHARDED) {
+      blt_sharded_put(sharded, key[i], (void *) (intptr_t) i);
+    } else {
+      pthread_mutex_lock(&lock);
+      blt_put(blt, key[i], (void *) (intptr_t) i);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  for (int i = lo; i < hi; i++) {
+    int found;
+    if (mode == CAS) {
+      found = !!blt_get(blt, key[i]);
+      if (!(i & 63)) blt_rcu_quiescent(blt, r);
+    } else if (mode == SHARDED) {
+      found = blt_sharded_get(sharded, key[i], 0);
+    } else {
+      pthread_mutex_lock(&lock);
+      found = !!blt_get(blt, key[i]);
+      pthread_mutex_unlock(&lock);
+    }
+    if (!found) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+  }
+  pthread_barrier_wait(&barrier);
+  pthread_barrier_wait(&barrier);
+  for (int i = lo; i < hi; i++) {
+    if (mode == CAS) {
+      blt_rcu_delete(blt, r, key[i]);
+      if (!(i & 63)) blt_rcu_quiescent(blt, r);
+    } else if (mode == SHARDED) {
+      blt_sharded_delete(sharded, key[i]);
+    } else {
+      pthread_mutex_lock(&lock);
+      blt_delete(blt, key[i]);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  if (mode == CAS) blt_rcu_unregister(blt, r);
+  pthread_barrier_wait(&barrier);
+  return 0;
+}
+
+enum { SHARDS = 64, SAMPLE = 4096 };
+
+static int cmp(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+void f(char **k, int n) {
+  key = k;
+  m = n;
+  char *sample[SAMPLE], *split[SHARDS - 1];
+  int ns = n < SAMPLE ? n : SAMPLE;
+  REP(i, ns) sample[i] = key[(long) i * n / ns];
+  qsort(sample, ns, sizeof(*sample), cmp);
+  REP(i, SHARDS - 1) split[i] = ns ? sample[(i + 1) * ns / SHARDS] : "";
+  for (mode = MUTEX; mode <= CAS; mode++) REP(j, nn) {
+    t = nthreads[j];
+    blt = mode == CAS ? blt_new_rcu() : blt_new();
+    if (mode == SHARDED) sharded = blt_sharded_new_split(SHARDS, split);
+    pthread_t th[t];
+    pthread_barrier_init(&barrier, 0, t + 1);
+    REP(i, t) pthread_create(th + i, 0, worker, (void *) (intptr_t) i);
+    char msg[64], *name = mode_name[mode];
+    bm_init();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    sprintf(msg, "BLT %s insert, %d threads", name, t);
+    bm_report(msg);
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    sprintf(msg, "BLT %s get, %d threads", name, t);
+    bm_report(msg);
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    sprintf(msg, "BLT %s delete, %d threads", name, t);
+    bm_report(msg);
+    REP(i, t) pthread_join(th[i], 0);
+    pthread_barrier_destroy(&barrier);
+    blt_clear(blt);
+    if (mode == SHARDED) blt_sharded_clear(sharded);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 64; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
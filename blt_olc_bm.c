@@ -0,0 +1,99 @@
+// YCSB-style mixed workloads on a tree shared by several threads, comparing
+// a global lock, CAS writers and optimistic lock coupling. For example:
+//
+//   $ blt_olc_bm 1 2 4 8 < /usr/share/dict/words
+//
+// The tree starts with every other key. Each operation picks a random key,
+// then either looks it up or, for a write, inserts or deletes it with equal
+// odds. We run 50/50 and 95/5 read/write mixes.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+enum { MUTEX, CAS, OLC };
+static char *mode_name[] = { "mutex", "cas", "olc" };
+
+static int nthreads[64], nn;
+static char **key;
+static int m, t, mode, read_pct;
+static BLT *blt;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t barrier;
+
+static void *worker(void *arg) {
+  uint64_t seed = (intptr_t) arg * 0x9e3779b97f4a7c15ull + 1;
+  int r = mode == MUTEX ? 0 : blt_rcu_register(blt);
+  int ops = 4 * m / t;
+  pthread_barrier_wait(&barrier);
+  REP(i, ops) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    char *k = key[seed % m];
+    void *data = (void *) (intptr_t) i;
+    int is_read = (seed >> 32) % 100 < read_pct, is_put = (seed >> 40) & 1;
+    switch (mode) {
+    case MUTEX:
+      pthread_mutex_lock(&lock);
+      if (is_read) blt_get(blt, k);
+      else if (is_put) blt_put(blt, k, data);
+      else blt_delete(blt, k);
+      pthread_mutex_unlock(&lock);
+      break;
+    case CAS:
+      if (is_read) blt_get(blt, k);
+      else if (is_put) blt_rcu_put(blt, r, k, data);
+      else blt_rcu_delete(blt, r, k);
+      break;
+    case OLC:
+      if (is_read) blt_olc_get(blt, k, 0);
+      else if (is_put) blt_olc_put(blt, r, k, data);
+      else blt_olc_delete(blt, r, k);
+      break;
+    }
+    if (mode != MUTEX && !(i & 63)) blt_rcu_quiescent(blt, r);
+  }
+  if (mode != MUTEX) blt_rcu_unregister(blt, r);
+  pthread_barrier_wait(&barrier);
+  return 0;
+}
+
+void f(char **k, int n) {
+  key = k;
+  m = n;
+  int mix[] = { 50, 95 };
+  REP(w, 2) for (mode = MUTEX; mode <= OLC; mode++) REP(j, nn) {
+    read_pct = mix[w];
+    t = nthreads[j];
+    blt = mode == MUTEX ? blt_new() : blt_new_rcu();
+    for (int i = 0; i < m; i += 2) blt_put(blt, key[i], 0);
+    pthread_t th[t];
+    pthread_barrier_init(&barrier, 0, t + 1);
+    REP(i, t) pthread_create(th + i, 0, worker, (void *) (intptr_t) i);
+    char msg[64];
+    bm_init();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    sprintf(msg, "BLT %s %d/%d, %d threads", mode_name[mode], read_pct,
+        100 - read_pct, t);
+    bm_report(msg);
+    REP(i, t) pthread_join(th[i], 0);
+    pthread_barrier_destroy(&barrier);
+    blt_clear(blt);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 8; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
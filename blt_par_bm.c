@@ -0,0 +1,62 @@
+// Benchmark full scans with blt_forall() against blt_forall_parallel() and
+// blt_allprefixed_ordered() for various numbers of threads. For example:
+//
+//   $ blt_par_bm 1 2 4 8 16 32 < /usr/share/dict/words
+//
+// Each scan sums the key lengths, standing in for an aggregation.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static int nthreads[64], nn;
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  REP(i, m) blt_put(blt, key[i], 0);
+  long want = 0;
+  bm_init();
+  blt_forall(blt, ({void _(BLT_IT *it){ want += strlen(it->key); }_;}));
+  bm_report("BLT scan");
+  REP(j, nn) {
+    int t = nthreads[j];
+    char msg[64];
+    long sum[t * 8];  // Spaced out to avoid false sharing.
+    memset(sum, 0, sizeof(sum));
+    bm_init();
+    blt_forall_parallel(blt, t, ({void _(BLT_IT *it, int id){
+      sum[8 * id] += strlen(it->key);
+    }_;}));
+    sprintf(msg, "BLT parallel scan, %d threads", t);
+    bm_report(msg);
+    long total = 0;
+    REP(i, t) total += sum[8 * i];
+    long ordered = 0;
+    bm_init();
+    blt_allprefixed_ordered(blt, "", t,
+        ({void *_(){ return calloc(1, sizeof(long)); }_;}),
+        ({void _(void *acc, BLT_IT *it){ *(long *) acc += strlen(it->key); }_;}),
+        ({void _(void *acc){ ordered += *(long *) acc; free(acc); }_;}));
+    sprintf(msg, "BLT ordered scan, %d threads", t);
+    bm_report(msg);
+    if (total != want || ordered != want) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+  }
+  blt_clear(blt);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 32; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
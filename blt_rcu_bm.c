@@ -0,0 +1,88 @@
+// Benchmark concurrent BLT lookups under a single writer, comparing an RCU
+// tree against a tree guarded by a rwlock. For example:
+//
+//   $ blt_rcu_bm 1 2 4 8 < /usr/share/dict/words
+//
+// Each reader looks up every key once while the writer repeatedly deletes
+// and reinserts keys.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+static int nthreads[64], nn;
+static char **key;
+static int m;
+static BLT *blt;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile int done;
+static int use_rcu;
+
+static void *reader(void *arg) {
+  intptr_t seed = (intptr_t) arg;
+  int r = use_rcu ? blt_rcu_register(blt) : 0;
+  int found = 0;
+  REP(i, m) {
+    char *k = key[(i + seed * 7919) % m];
+    if (use_rcu) {
+      found += !!blt_get(blt, k);
+      if (!(i & 63)) blt_rcu_quiescent(blt, r);
+    } else {
+      pthread_rwlock_rdlock(&lock);
+      found += !!blt_get(blt, k);
+      pthread_rwlock_unlock(&lock);
+    }
+  }
+  if (use_rcu) blt_rcu_unregister(blt, r);
+  return (void *) (intptr_t) found;
+}
+
+static void *writer(void *unused) {
+  for (int i = 0; !done; i = (i + 1) % m) {
+    if (!use_rcu) pthread_rwlock_wrlock(&lock);
+    blt_delete(blt, key[i]);
+    if (!use_rcu) pthread_rwlock_unlock(&lock);
+    if (!use_rcu) pthread_rwlock_wrlock(&lock);
+    blt_put(blt, key[i], (void *) (intptr_t) i);
+    if (!use_rcu) pthread_rwlock_unlock(&lock);
+  }
+  return 0;
+}
+
+void f(char **k, int n) {
+  key = k;
+  m = n;
+  for (use_rcu = 0; use_rcu < 2; use_rcu++) {
+    blt = use_rcu ? blt_new_rcu() : blt_new();
+    REP(i, m) blt_put(blt, key[i], (void *) (intptr_t) i);
+    REP(j, nn) {
+      int t = nthreads[j];
+      pthread_t w, r[t];
+      done = 0;
+      bm_init();
+      pthread_create(&w, 0, writer, 0);
+      REP(i, t) pthread_create(r + i, 0, reader, (void *) (intptr_t) i);
+      REP(i, t) pthread_join(r[i], 0);
+      done = 1;
+      pthread_join(w, 0);
+      char msg[64];
+      sprintf(msg, "BLT %s get, %d threads", use_rcu ? "rcu" : "rwlock", t);
+      bm_report(msg);
+    }
+    blt_clear(blt);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 8; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
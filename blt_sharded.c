@@ -0,0 +1,184 @@
+// Sharded crit-bit trees. Shard i holds the keys at least split[i - 1] and
+// less than split[i]; we find it with a binary search over the split keys.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blt_sharded.h"
+
+struct blt_shard_s {
+  pthread_mutex_t lock;
+  BLT *blt;
+  BLT_SHARD_STATS stats;
+} __attribute__((aligned(64)));  // Keep shards off each other's cache lines.
+
+struct BLT_SHARDED {
+  int n;
+  char **split;             // The least key of each shard but the first.
+  struct blt_shard_s *shard;
+};
+
+BLT_SHARDED *blt_sharded_new_with_allocator(int nshards, char **split,
+    void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void **ctx) {
+  if (nshards < 1 || (!split && nshards > 256)) return 0;
+  if (!alloc != !dealloc) return 0;
+  for (int i = 1; split && i < nshards - 1; i++) {
+    if (strcmp(split[i - 1], split[i]) > 0) return 0;
+  }
+  BLT_SHARDED *s = malloc(sizeof(*s));
+  s->n = nshards;
+  if (posix_memalign((void **) &s->shard, 64, nshards * sizeof(*s->shard))) {
+    free(s);
+    return 0;
+  }
+  s->split = malloc(nshards * sizeof(*s->split));
+  for (int i = 1; i < nshards; i++) {
+    if (split) {
+      s->split[i - 1] = strdup(split[i - 1]);
+    } else {
+      // The first byte b goes to shard b * n / 256.
+      s->split[i - 1] = calloc(2, 1);
+      s->split[i - 1][0] = (i * 256 + nshards - 1) / nshards;
+    }
+  }
+  for (int i = 0; i < nshards; i++) {
+    struct blt_shard_s *sh = s->shard + i;
+    pthread_mutex_init(&sh->lock, 0);
+    sh->blt = blt_new_with_allocator(alloc, dealloc, ctx ? ctx[i] : 0);
+    memset(&sh->stats, 0, sizeof(sh->stats));
+  }
+  return s;
+}
+
+BLT_SHARDED *blt_sharded_new_split(int nshards, char **split) {
+  return blt_sharded_new_with_allocator(nshards, split, 0, 0, 0);
+}
+
+BLT_SHARDED *blt_sharded_new(int nshards) {
+  return blt_sharded_new_split(nshards, 0);
+}
+
+void blt_sharded_clear(BLT_SHARDED *s) {
+  for (int i = 0; i < s->n; i++) {
+    pthread_mutex_destroy(&s->shard[i].lock);
+    blt_clear(s->shard[i].blt);
+    if (i) free(s->split[i - 1]);
+  }
+  free(s->split);
+  free(s->shard);
+  free(s);
+}
+
+int blt_sharded_shards(BLT_SHARDED *s) { return s->n; }
+
+static inline struct blt_shard_s *lock(BLT_SHARDED *s, int i) {
+  struct blt_shard_s *sh = s->shard + i;
+  pthread_mutex_lock(&sh->lock);
+  return sh;
+}
+
+static inline void unlock(struct blt_shard_s *sh) {
+  pthread_mutex_unlock(&sh->lock);
+}
+
+// Returns the number of split keys at most the given key.
+static inline int shard_of(BLT_SHARDED *s, char *key) {
+  int lo = 0, hi = s->n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(s->split[mid], key) <= 0) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+void blt_sharded_stats(BLT_SHARDED *s, int shard, BLT_SHARD_STATS *stats) {
+  struct blt_shard_s *sh = lock(s, shard);
+  *stats = sh->stats;
+  unlock(sh);
+}
+
+int blt_sharded_get(BLT_SHARDED *s, char *key, void **data) {
+  struct blt_shard_s *sh = lock(s, shard_of(s, key));
+  sh->stats.gets++;
+  BLT_IT *it = blt_get(sh->blt, key);
+  if (it && data) *data = it->data;
+  unlock(sh);
+  return !!it;
+}
+
+int blt_sharded_put(BLT_SHARDED *s, char *key, void *data) {
+  struct blt_shard_s *sh = lock(s, shard_of(s, key));
+  int is_new;
+  blt_setp(sh->blt, key, &is_new)->data = data;
+  sh->stats.puts++;
+  sh->stats.keys += is_new;
+  unlock(sh);
+  return is_new;
+}
+
+int blt_sharded_delete(BLT_SHARDED *s, char *key) {
+  struct blt_shard_s *sh = lock(s, shard_of(s, key));
+  int r = blt_delete(sh->blt, key);
+  sh->stats.deletes++;
+  sh->stats.keys -= r;
+  unlock(sh);
+  return r;
+}
+
+// Copies out a leaf found in a locked shard.
+static char *found(BLT_IT *it, void **data) {
+  if (data) *data = it->data;
+  return strdup(it->key);
+}
+
+// Searches the shard holding the given key with the given function, then if
+// that fails, the shards after it (way = 0) or before it (way = 1) for their
+// first or last key.
+static char *search(BLT_SHARDED *s, char *key, void **data, int way,
+    BLT_IT *(*fun)(BLT *, char *)) {
+  int i = shard_of(s, key);
+  struct blt_shard_s *sh = lock(s, i);
+  BLT_IT *it = fun(sh->blt, key);
+  char *r = it ? found(it, data) : 0;
+  unlock(sh);
+  while (!r) {
+    i += way ? -1 : 1;
+    if (i < 0 || i == s->n) return 0;
+    sh = lock(s, i);
+    it = way ? blt_last(sh->blt) : blt_first(sh->blt);
+    if (it) r = found(it, data);
+    unlock(sh);
+  }
+  return r;
+}
+
+char *blt_sharded_ceil(BLT_SHARDED *s, char *key, void **data) {
+  return search(s, key, data, 0, blt_ceil);
+}
+
+char *blt_sharded_floor(BLT_SHARDED *s, char *key, void **data) {
+  return search(s, key, data, 1, blt_floor);
+}
+
+static BLT_IT *after(BLT *blt, char *key) {
+  BLT_IT *it = blt_ceil(blt, key);
+  return it && !strcmp(it->key, key) ? blt_next(blt, it) : it;
+}
+
+char *blt_sharded_next(BLT_SHARDED *s, char *key, void **data) {
+  return search(s, key, data, 0, after);
+}
+
+int blt_sharded_allprefixed(BLT_SHARDED *s, char *key, int (*fun)(BLT_IT *)) {
+  // Keys with the prefix run on into the next shard only if its least key
+  // also has the prefix.
+  int keylen = strlen(key);
+  for (int i = shard_of(s, key);; i++) {
+    struct blt_shard_s *sh = lock(s, i);
+    int status = blt_allprefixed(sh->blt, key, fun);
+    unlock(sh);
+    if (status != 1) return status;
+    if (i == s->n - 1 || strncmp(s->split[i], key, keylen)) return 1;
+  }
+}
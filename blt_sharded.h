@@ -0,0 +1,98 @@
+// = Sharded crit-bit trees =
+//
+// A front end that splits keys among independent trees, each with its own
+// lock, so threads working on different shards never contend. Each shard
+// holds a contiguous range of keys, so visiting the shards in turn visits
+// the keys in order. By default the ranges split the first byte evenly;
+// real keys rarely spread that way, so callers who know their keys should
+// pass split keys, for example sampled from the first keys they will insert.
+//
+// Usage:
+//
+//   BLT_SHARDED *s = blt_sharded_new(16);
+//   blt_sharded_put(s, "hello", pointer1);
+//   void *data;
+//   if (!blt_sharded_get(s, "hello", &data) || data != pointer1) exit(1);
+//   blt_sharded_clear(s);
+//
+// All functions may be called from any number of threads at once, except
+// blt_sharded_clear(). Keys returned by ceil, floor and next are copies,
+// since another thread may delete the original at any time.
+
+#ifndef __BLT_SHARDED_H__
+#define __BLT_SHARDED_H__
+
+#include "blt.h"
+
+struct BLT_SHARDED;
+typedef struct BLT_SHARDED BLT_SHARDED;
+
+// Per-shard counters, for spotting skew.
+struct BLT_SHARD_STATS {
+  long gets, puts, deletes;
+  long keys;                // Number of keys currently in the shard.
+};
+typedef struct BLT_SHARD_STATS BLT_SHARD_STATS;
+
+// Creates a tree split into the given number of shards, between 1 and 256,
+// by first byte.
+BLT_SHARDED *blt_sharded_new(int nshards);
+
+// Creates a tree split into nshards shards, where shard i holds the keys at
+// least split[i - 1] and less than split[i]. There are nshards - 1 split
+// keys, which are copied. Returns NULL if they are out of order.
+BLT_SHARDED *blt_sharded_new_split(int nshards, char **split);
+
+// As blt_sharded_new_split(), but shard i takes nodes and keys from its own
+// allocator, as blt_new_with_allocator() with context ctx[i]. A shard only
+// allocates while holding its lock, so its allocator needs no locking.
+// A NULL split splits by first byte, as blt_sharded_new().
+BLT_SHARDED *blt_sharded_new_with_allocator(int nshards, char **split,
+    void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void **ctx);
+
+// Destroys a sharded tree.
+void blt_sharded_clear(BLT_SHARDED *s);
+
+// Returns the number of shards.
+int blt_sharded_shards(BLT_SHARDED *s);
+
+// Copies the counters of the given shard to *stats.
+void blt_sharded_stats(BLT_SHARDED *s, int shard, BLT_SHARD_STATS *stats);
+
+// Looks up a key. If present, returns 1 and copies its data to *data when
+// data is not NULL. Otherwise returns 0.
+int blt_sharded_get(BLT_SHARDED *s, char *key, void **data);
+
+// Inserts or updates a key. Returns 1 if the key is new, and 0 otherwise.
+int blt_sharded_put(BLT_SHARDED *s, char *key, void *data);
+
+// Deletes a given key.
+// Returns 1 if a key was deleted, and 0 otherwise.
+int blt_sharded_delete(BLT_SHARDED *s, char *key);
+
+// Returns a copy of the smallest key that is at least the given key, or
+// NULL if there is none. The caller frees the copy. If data is not NULL,
+// copies the data of the key found to *data.
+char *blt_sharded_ceil(BLT_SHARDED *s, char *key, void **data);
+
+// As blt_sharded_ceil(), but for the largest key at most the given key.
+char *blt_sharded_floor(BLT_SHARDED *s, char *key, void **data);
+
+// As blt_sharded_ceil(), but for the smallest key greater than the given key.
+// Starting from blt_sharded_ceil(s, "", ...), iterates through all keys.
+char *blt_sharded_next(BLT_SHARDED *s, char *key, void **data);
+
+// Iterates through all leaf nodes with a given prefix in order and runs the
+// given callback on each one, as blt_allprefixed(). The callback runs while
+// the shard holding the leaf is locked, so it must not call functions on the
+// same sharded tree.
+int blt_sharded_allprefixed(BLT_SHARDED *s, char *key, int (*fun)(BLT_IT *));
+
+// Iterates through all leaf nodes in order and runs the given callback.
+static inline void blt_sharded_forall(BLT_SHARDED *s, void (*fun)(BLT_IT *)) {
+  int f(BLT_IT *it) { return fun(it), 1; }
+  blt_sharded_allprefixed(s, "", f);
+}
+
+#endif  // __BLT_SHARDED_H__
@@ -0,0 +1,211 @@
+// Crit-bit trees in shared memory.
+//
+// The segment starts with a header, padded to a page, followed by two slots
+// for images. The header names the current image by generation and slot.
+// Each reader owns an entry in a table in the header, where it records the
+// image it has pinned. Readers map the header read-write to do so, but the
+// images read-only.
+//
+// A reader pins by storing the current value, then checking it is still
+// current, retrying if not. Before overwriting a slot, the publisher waits
+// until no entry pins that slot. A reader that pinned the slot after the
+// check must have seen the newer value beforehand, so it will retry rather
+// than read the slot.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blt_shm.h"
+
+enum { SHM_READERS = 256 };
+
+struct shm_header_s {
+  char magic[8];
+  uint64_t size;            // Size of the segment.
+  uint64_t data, half;      // Offset and size of the first image slot.
+  uint64_t current;         // Generation << 1 | slot, or 0 if none yet.
+  struct {
+    int32_t pid;            // Owner, or 0 if free.
+    uint64_t pin;           // Value of current pinned, or 0.
+  } reader[SHM_READERS];
+};
+
+static const char magic[8] = "BLTSHM1";
+
+struct BLT_SHM {
+  int fd;                   // Kept open by the publisher.
+  struct shm_header_s *h;
+  size_t hlen;
+  char *base;               // The whole segment.
+  int slot;                 // Our reader entry.
+  BLT_IMAGE *view[2];
+  uint64_t viewcur[2];      // Value of current each view was made for.
+};
+
+static size_t header_len() {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (sizeof(struct shm_header_s) + page - 1) / page * page;
+}
+
+// Claims a reader entry.
+static int claim(BLT_SHM *shm) {
+  for (int i = 0; i < SHM_READERS; i++) {
+    if (__sync_bool_compare_and_swap(&shm->h->reader[i].pid, 0, getpid())) {
+      shm->slot = i;
+      __atomic_store_n(&shm->h->reader[i].pin, 0, __ATOMIC_SEQ_CST);
+      return 0;
+    }
+  }
+  errno = EAGAIN;
+  return -1;
+}
+
+static BLT_SHM *new_handle(int fd, struct shm_header_s *h, size_t hlen,
+    char *base) {
+  BLT_SHM *shm = calloc(1, sizeof(*shm));
+  shm->fd = fd;
+  shm->slot = -1;
+  shm->h = h;
+  shm->hlen = hlen;
+  shm->base = base;
+  return shm;
+}
+
+BLT_SHM *blt_shm_create(const char *name, size_t size) {
+  size_t hlen = header_len();
+  if (size < hlen + 2 * 4096) {
+    errno = EINVAL;
+    return 0;
+  }
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return 0;
+  char *base = MAP_FAILED;
+  if (!ftruncate(fd, size)) {
+    base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (base == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  struct shm_header_s *h = (struct shm_header_s *) base;
+  h->size = size;
+  h->data = hlen;
+  h->half = (size - hlen) / 2 & ~(uint64_t) 7;
+  h->current = 0;
+  memset(h->reader, 0, sizeof(h->reader));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(h->magic, magic, sizeof(magic));
+  BLT_SHM *shm = new_handle(fd, h, hlen, base);
+  claim(shm);
+  return shm;
+}
+
+BLT_SHM *blt_shm_open(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return 0;
+  size_t hlen = header_len();
+  struct stat st;
+  struct shm_header_s *h = MAP_FAILED;
+  char *base = MAP_FAILED;
+  if (!fstat(fd, &st) && (size_t) st.st_size >= hlen) {
+    h = mmap(0, hlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (h == MAP_FAILED || base == MAP_FAILED ||
+      memcmp(h->magic, magic, sizeof(magic)) || h->size != st.st_size) {
+    if (h != MAP_FAILED) munmap(h, hlen);
+    if (base != MAP_FAILED) munmap(base, st.st_size);
+    errno = EINVAL;
+    return 0;
+  }
+  BLT_SHM *shm = new_handle(-1, h, hlen, base);
+  if (claim(shm)) {
+    blt_shm_close(shm);
+    return 0;
+  }
+  return shm;
+}
+
+// Waits until no reader pins an image in the given slot.
+static void wait_unpinned(struct shm_header_s *h, int slot) {
+  for (int i = 0; i < SHM_READERS; i++) {
+    for (;;) {
+      uint64_t pin = __atomic_load_n(&h->reader[i].pin, __ATOMIC_SEQ_CST);
+      if (!pin || (int) (pin & 1) != slot) break;
+      int32_t pid = __atomic_load_n(&h->reader[i].pid, __ATOMIC_SEQ_CST);
+      if (pid && kill(pid, 0) && errno == ESRCH) {
+        // The reader died holding its pin.
+        __atomic_store_n(&h->reader[i].pin, 0, __ATOMIC_SEQ_CST);
+        __sync_bool_compare_and_swap(&h->reader[i].pid, pid, 0);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+int blt_shm_publish(BLT_SHM *shm, BLT *blt) {
+  struct shm_header_s *h = shm->h;
+  if (blt_save_size(blt) > h->half) {
+    errno = EFBIG;
+    return -1;
+  }
+  uint64_t cur = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+  int slot = cur ? !(cur & 1) : 0;
+  wait_unpinned(h, slot);
+  if (lseek(shm->fd, h->data + slot * h->half, SEEK_SET) < 0 ||
+      blt_save(blt, shm->fd)) {
+    return -1;
+  }
+  __atomic_store_n(&h->current, ((cur >> 1) + 1) << 1 | slot,
+      __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+BLT_IMAGE *blt_shm_pin(BLT_SHM *shm) {
+  struct shm_header_s *h = shm->h;
+  uint64_t *pin = &h->reader[shm->slot].pin, c;
+  for (;;) {
+    c = __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+    if (!c) return 0;
+    __atomic_store_n(pin, c, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->current, __ATOMIC_SEQ_CST) == c) break;
+  }
+  int slot = c & 1;
+  if (shm->viewcur[slot] != c) {
+    if (shm->view[slot]) blt_image_close(shm->view[slot]);
+    shm->view[slot] = blt_image_view(shm->base + h->data + slot * h->half,
+        h->half);
+    shm->viewcur[slot] = c;
+  }
+  return shm->view[slot];
+}
+
+void blt_shm_unpin(BLT_SHM *shm) {
+  __atomic_store_n(&shm->h->reader[shm->slot].pin, 0, __ATOMIC_RELEASE);
+}
+
+void blt_shm_close(BLT_SHM *shm) {
+  struct shm_header_s *h = shm->h;
+  size_t size = h->size;
+  if (shm->slot >= 0) {
+    blt_shm_unpin(shm);
+    __atomic_store_n(&h->reader[shm->slot].pid, 0, __ATOMIC_RELEASE);
+  }
+  for (int i = 0; i < 2; i++) if (shm->view[i]) blt_image_close(shm->view[i]);
+  if (shm->fd >= 0) {
+    close(shm->fd);
+  } else {
+    munmap(h, shm->hlen);
+  }
+  munmap(shm->base, size);
+  free(shm);
+}
@@ -0,0 +1,58 @@
+// = Crit-bit trees in shared memory =
+//
+// One process publishes trees into a POSIX shared memory segment as images
+// (see blt_image.h), and any number of processes map the segment read-only
+// and query the latest image in place. The segment holds two images: a
+// publish writes the one not in use, then atomically swaps it in.
+//
+// Usage:
+//
+//   // Loader.
+//   BLT_SHM *shm = blt_shm_create("/words", 1 << 30);
+//   blt_shm_publish(shm, blt);
+//
+//   // Workers.
+//   BLT_SHM *shm = blt_shm_open("/words");
+//   BLT_IMAGE *img = blt_shm_pin(shm);
+//   BLT_IMAGE_IT it;
+//   if (img && blt_image_get(img, "hello", &it)) ...
+//   blt_shm_unpin(shm);
+//
+// A handle may only be used by one thread at a time; each worker thread
+// should open its own.
+
+#ifndef __BLT_SHM_H__
+#define __BLT_SHM_H__
+
+#include <stddef.h>
+#include "blt_image.h"
+
+struct BLT_SHM;
+typedef struct BLT_SHM BLT_SHM;
+
+// Creates a segment of the given total size, replacing any segment of the
+// same name, and returns a handle for publishing. Returns NULL on error.
+BLT_SHM *blt_shm_create(const char *name, size_t size);
+
+// Publishes an image of the tree, which replaces the current one for
+// readers that pin afterwards. Waits for readers still pinning the image
+// before the current one, skipping readers whose process has died.
+// Returns 0 on success, and -1 if the image does not fit in half the
+// segment or on error, with errno set.
+int blt_shm_publish(BLT_SHM *shm, BLT *blt);
+
+// Maps an existing segment for reading. Returns NULL on error.
+BLT_SHM *blt_shm_open(const char *name);
+
+// Pins the current image, which stays intact until blt_shm_unpin(), even if
+// a newer one is published meanwhile. Returns NULL if nothing has been
+// published yet.
+BLT_IMAGE *blt_shm_pin(BLT_SHM *shm);
+
+// Releases the pinned image. Keys obtained from it are no longer valid.
+void blt_shm_unpin(BLT_SHM *shm);
+
+// Closes a handle. The segment itself remains until shm_unlink().
+void blt_shm_close(BLT_SHM *shm);
+
+#endif  // __BLT_SHM_H__
@@ -0,0 +1,47 @@
+// Benchmark BLT writes while snapshots are alive. For example:
+//
+//   $ blt_snap_bm < /usr/share/dict/words
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  int nsnap[] = { 0, 1, 10 };
+  REP(k, sizeof(nsnap) / sizeof(*nsnap)) {
+    int n = nsnap[k];
+    BLT *blt = blt_new();
+    BLT *snap[n];
+    REP(i, m) blt_put(blt, key[i], (void *) (intptr_t) i);
+    bm_init();
+    // Take the snapshots at regular intervals while overwriting every key,
+    // then insert and delete each key.
+    int j = 0;
+    REP(i, m) {
+      if (j < n && i == j * m / n) snap[j++] = blt_snapshot(blt);
+      blt_put(blt, key[i], (void *) (intptr_t) -i);
+    }
+    REP(i, m) blt_delete(blt, key[i]);
+    REP(i, m) blt_put(blt, key[i], 0);
+    char msg[64];
+    sprintf(msg, "BLT put/delete with %d snapshots", n);
+    bm_report(msg);
+    printf("BLT overhead with %d snapshots: %lu bytes\n", n, blt_overhead(blt));
+    REP(i, n) if ((intptr_t) blt_get(snap[i], key[0])->data != 0) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    REP(i, n) blt_clear(snap[i]);
+    bm_report("BLT release snapshots");
+    blt_clear(blt);
+  }
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
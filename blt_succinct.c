@@ -0,0 +1,416 @@
+// Succinct crit-bit trees.
+//
+// A crit-bit tree with n keys has n - 1 internal nodes, each with two kids.
+// Listing the nodes in preorder, writing 1 for an internal node and 0 for a
+// leaf, gives 2n - 1 bits that determine the shape of the tree. The left kid
+// of the node at position i is at i + 1, and its right kid follows the
+// subtree of the left kid. Counting +1 for each 1 and -1 for each 0, the
+// subtree at i ends at the first position where the running total from i
+// reaches -1. Leaves appear in key order, so a leaf's rank is its position
+// minus the number of internal nodes before it. We track that number as we
+// descend, so we need no rank directory.
+//
+// To find the end of a subtree quickly, the bits are split into blocks.
+// We store the running total at the start of each block, and a segment tree
+// holding the least running total reached within each block, then within
+// each pair of blocks, and so on. Within a block, we skip a byte at a time
+// using tables of the least and final totals of each byte.
+//
+// The crit bit of each internal node, numbered from the start of the key,
+// is stored in preorder in an array of fixed-width fields, just wide enough
+// for the largest.
+//
+// Keys are front-coded in buckets of BUCKET keys. Each key is the length of
+// the prefix it shares with the previous key, the length of the rest, then
+// the rest. The first key of a bucket shares nothing. We store the offset of
+// each bucket.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blt_succinct.h"
+
+enum { BLOCK = 512, BUCKET = 16 };
+
+// An array of fixed-width unsigned integers.
+struct packed_s {
+  uint64_t *w;
+  int width;
+};
+
+static void packed_init(struct packed_s *p, uint64_t n, uint64_t max) {
+  p->width = 1;
+  while (p->width < 63 && max >> p->width) p->width++;
+  p->w = calloc((n * p->width + 63) / 64 + 1, 8);
+}
+
+static size_t packed_bytes(struct packed_s *p, uint64_t n) {
+  return ((n * p->width + 63) / 64 + 1) * 8;
+}
+
+static void packed_set(struct packed_s *p, uint64_t i, uint64_t v) {
+  uint64_t bit = i * p->width, k = bit / 64;
+  int off = bit % 64;
+  p->w[k] |= v << off;
+  if (off + p->width > 64) p->w[k + 1] |= v >> (64 - off);
+}
+
+static uint64_t packed_get(const struct packed_s *p, uint64_t i) {
+  uint64_t bit = i * p->width, k = bit / 64;
+  int off = bit % 64;
+  uint64_t v = p->w[k] >> off;
+  if (off + p->width > 64) v |= p->w[k + 1] << (64 - off);
+  return v & ((1ull << p->width) - 1);
+}
+
+struct BLT_SUCCINCT {
+  int n;
+  uint64_t nbits;
+  uint8_t *bits;            // Shape, least significant bit first.
+  int32_t *start;           // Running total at the start of each block.
+  int32_t *min;             // Segment tree of least totals in blocks.
+  uint64_t leaves;          // Number of leaves of the segment tree.
+  struct packed_s crit;
+  uint8_t *keys;
+  size_t keylen;
+  struct packed_s bucket;
+  int maxlen;               // Length of the longest key.
+  char *buf;                // Room for a key, or NULL while a reader has it.
+};
+
+// The least running total over each prefix of a byte, and the final total.
+static int8_t byte_min[256], byte_total[256];
+
+static void init_tables() {
+  for (int v = 0; v < 256; v++) {
+    int t = 0, m = 8;
+    for (int j = 0; j < 8; j++) {
+      t += v >> j & 1 ? 1 : -1;
+      if (t < m) m = t;
+    }
+    byte_total[v] = t;
+    byte_min[v] = m;
+  }
+}
+
+static inline int bit(const BLT_SUCCINCT *s, uint64_t i) {
+  return s->bits[i >> 3] >> (i & 7) & 1;
+}
+
+// Returns the first block at or after block b where the running total
+// drops to t or less.
+static uint64_t first_below(const BLT_SUCCINCT *s, uint64_t b, int64_t t) {
+  uint64_t x = s->leaves + b;
+  if (s->min[x] > t) {
+    for (;;) {
+      while (x & 1) x >>= 1;
+      x++;
+      if (s->min[x] <= t) break;
+    }
+    while (x < s->leaves) x = s->min[2 * x] <= t ? 2 * x : 2 * x + 1;
+  }
+  return x - s->leaves;
+}
+
+// Returns the last position of the subtree at position i.
+static uint64_t subtree_end(const BLT_SUCCINCT *s, uint64_t i) {
+  int64_t d = 0;
+  for (; i & 7; i++) {
+    d += bit(s, i) ? 1 : -1;
+    if (d == -1) return i;
+  }
+  for (;;) {
+    if (!(i % BLOCK)) {
+      // Jump to the block where the subtree ends.
+      uint64_t b = i / BLOCK;
+      int64_t base = s->start[b] - d;
+      b = first_below(s, b, base - 1);
+      i = b * BLOCK;
+      d = s->start[b] - base;
+    }
+    uint8_t v = s->bits[i >> 3];
+    if (d + byte_min[v] <= -1) {
+      for (;; i++) {
+        d += bit(s, i) ? 1 : -1;
+        if (d == -1) return i;
+      }
+    }
+    d += byte_total[v];
+    i += 8;
+  }
+}
+
+// A node: its position, and the number of internal nodes before it.
+struct pos_s {
+  uint64_t i, r;
+};
+
+static inline uint64_t crit_at(const BLT_SUCCINCT *s, struct pos_s p) {
+  return packed_get(&s->crit, p.r);
+}
+
+static inline struct pos_s kid(const BLT_SUCCINCT *s, struct pos_s p,
+    int dir) {
+  if (!dir) return (struct pos_s) { p.i + 1, p.r + 1 };
+  uint64_t e = subtree_end(s, p.i + 1);
+  return (struct pos_s) { e + 1, p.r + 1 + (e - p.i - 1) / 2 };
+}
+
+static inline int key_bit(char *key, int keylen, uint64_t c) {
+  uint64_t byte = c >> 3;
+  return byte < keylen && key[byte] & 0x80 >> (c & 7);
+}
+
+// Returns the rank of the first leaf under a node, and sets *count to the
+// number of leaves under it.
+static int leaf_range(const BLT_SUCCINCT *s, struct pos_s p, int *count) {
+  *count = bit(s, p.i) ? (subtree_end(s, p.i) - p.i + 2) / 2 : 1;
+  return p.i - p.r;
+}
+
+static uint64_t read_varint(const uint8_t **p) {
+  uint64_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t c = *(*p)++;
+    v |= (uint64_t) (c & 127) << shift;
+    if (!(c & 128)) return v;
+  }
+}
+
+static void write_varint(uint8_t **p, uint64_t v) {
+  for (; v >= 128; v >>= 7) *(*p)++ = v | 128;
+  *(*p)++ = v;
+}
+
+// Decodes the next key into buf, which holds the previous key.
+static void read_key(const uint8_t **p, char *buf) {
+  uint64_t lcp = read_varint(p), len = read_varint(p);
+  memcpy(buf + lcp, *p, len);
+  buf[lcp + len] = 0;
+  *p += len;
+}
+
+// Decodes key i into buf, returning the position of the key after it.
+static const uint8_t *decode(const BLT_SUCCINCT *s, int i, char *buf) {
+  const uint8_t *p = s->keys + packed_get(&s->bucket, i / BUCKET);
+  for (int j = i - i % BUCKET; j <= i; j++) read_key(&p, buf);
+  return p;
+}
+
+struct build_s {
+  BLT_SUCCINCT *s;
+  char **key;
+  uint64_t i, r;
+};
+
+static void build(struct build_s *b, int lo, int hi) {
+  if (hi - lo == 1) {
+    b->i++;
+    return;
+  }
+  char *x = b->key[lo], *y = b->key[hi - 1];
+  uint64_t byte = 0;
+  while (x[byte] == y[byte]) byte++;
+  int shift = __builtin_clz((uint8_t) (x[byte] ^ y[byte])) - 24;
+  uint8_t mask = 0x80 >> shift;
+  // Find the first key with the crit bit set.
+  int l = lo + 1, h = hi - 1;
+  while (l < h) {
+    int m = l + (h - l) / 2;
+    if (b->key[m][byte] & mask) h = m; else l = m + 1;
+  }
+  b->s->bits[b->i >> 3] |= 1 << (b->i & 7);
+  packed_set(&b->s->crit, b->r, byte * 8 + shift);
+  b->i++, b->r++;
+  build(b, lo, l);
+  build(b, l, hi);
+}
+
+BLT_SUCCINCT *blt_succinct_new(BLT *blt) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_tables);
+  BLT_SUCCINCT *s = calloc(1, sizeof(*s));
+  int n = s->n = blt_size(blt), k = 0;
+  char **key = malloc(n * sizeof(*key));
+  size_t len = 0;
+  blt_forall(blt, ({ void _(BLT_IT *it) {
+    int m = strlen(it->key);
+    if (m > s->maxlen) s->maxlen = m;
+    len += m + 20;
+    key[k++] = it->key;
+  }_; }));
+  s->buf = malloc(s->maxlen + 1);
+  if (!n) {
+    free(key);
+    return s;
+  }
+
+  // Front-code the keys.
+  uint8_t *p = s->keys = malloc(len);
+  packed_init(&s->bucket, (n + BUCKET - 1) / BUCKET, len);
+  for (int i = 0; i < n; i++) {
+    size_t lcp = 0;
+    if (i % BUCKET) {
+      while (key[i][lcp] && key[i][lcp] == key[i - 1][lcp]) lcp++;
+    } else {
+      packed_set(&s->bucket, i / BUCKET, p - s->keys);
+    }
+    size_t m = strlen(key[i] + lcp);
+    write_varint(&p, lcp);
+    write_varint(&p, m);
+    memcpy(p, key[i] + lcp, m);
+    p += m;
+  }
+  s->keylen = p - s->keys;
+  s->keys = realloc(s->keys, s->keylen);
+
+  // Lay out the shape and crit bits.
+  s->nbits = 2 * (uint64_t) n - 1;
+  s->bits = calloc(s->nbits / 8 + 1, 1);
+  packed_init(&s->crit, n - 1, 8 * (uint64_t) s->maxlen + 7);
+  struct build_s b = { s, key };
+  build(&b, 0, n);
+  free(key);
+
+  uint64_t nblocks = (s->nbits + BLOCK - 1) / BLOCK;
+  for (s->leaves = 1; s->leaves < nblocks; s->leaves *= 2);
+  s->start = malloc(nblocks * sizeof(*s->start));
+  s->min = malloc(2 * s->leaves * sizeof(*s->min));
+  for (uint64_t i = 0; i < 2 * s->leaves; i++) s->min[i] = INT32_MAX;
+  int32_t t = 0;
+  for (uint64_t i = 0; i < s->nbits; i++) {
+    if (!(i % BLOCK)) s->start[i / BLOCK] = t;
+    t += bit(s, i) ? 1 : -1;
+    int32_t *m = s->min + s->leaves + i / BLOCK;
+    if (t < *m) *m = t;
+  }
+  for (uint64_t x = s->leaves - 1; x; x--) {
+    s->min[x] = s->min[2 * x] < s->min[2 * x + 1] ?
+        s->min[2 * x] : s->min[2 * x + 1];
+  }
+  return s;
+}
+
+void blt_succinct_free(BLT_SUCCINCT *s) {
+  free(s->buf);
+  free(s->bits);
+  free(s->start);
+  free(s->min);
+  free(s->crit.w);
+  free(s->keys);
+  free(s->bucket.w);
+  free(s);
+}
+
+size_t blt_succinct_bytes(BLT_SUCCINCT *s) {
+  if (!s->n) return sizeof(*s);
+  uint64_t nblocks = (s->nbits + BLOCK - 1) / BLOCK;
+  return sizeof(*s) + s->nbits / 8 + 1 + nblocks * sizeof(*s->start) +
+      2 * s->leaves * sizeof(*s->min) + packed_bytes(&s->crit, s->n - 1) +
+      s->keylen + packed_bytes(&s->bucket, (s->n + BUCKET - 1) / BUCKET);
+}
+
+int blt_succinct_size(BLT_SUCCINCT *s) { return s->n; }
+
+// Returns room for the longest key. Keys can be too long for the stack, so
+// we keep a buffer with the copy, and only allocate another when readers
+// on several threads need one at once.
+static char *get_buf(BLT_SUCCINCT *s) {
+  char *buf = __atomic_exchange_n(&s->buf, 0, __ATOMIC_ACQUIRE);
+  return buf ? buf : malloc(s->maxlen + 1);
+}
+
+static void put_buf(BLT_SUCCINCT *s, char *buf) {
+  char *none = 0;
+  if (!__atomic_compare_exchange_n(&s->buf, &none, buf, 0, __ATOMIC_RELEASE,
+      __ATOMIC_RELAXED)) {
+    free(buf);
+  }
+}
+
+// Follows the key down to a leaf.
+static struct pos_s descend(BLT_SUCCINCT *s, char *key, int keylen) {
+  struct pos_s p = { 0, 0 };
+  while (bit(s, p.i)) p = kid(s, p, key_bit(key, keylen, crit_at(s, p)));
+  return p;
+}
+
+int blt_succinct_get(BLT_SUCCINCT *s, char *key) {
+  if (!s->n) return -1;
+  int keylen = strlen(key);
+  if (keylen > s->maxlen) return -1;
+  struct pos_s p = descend(s, key, keylen);
+  char *buf = get_buf(s);
+  int i = p.i - p.r;
+  decode(s, i, buf);
+  if (strcmp(buf, key)) i = -1;
+  put_buf(s, buf);
+  return i;
+}
+
+static int ceilfloor(BLT_SUCCINCT *s, char *key, int way) {
+  if (!s->n) return -1;
+  int keylen = strlen(key);
+  struct pos_s p = descend(s, key, keylen);
+  char *buf = get_buf(s);
+  int i = p.i - p.r;
+  decode(s, i, buf);
+  uint64_t byte = 0;
+  while (key[byte] == buf[byte] && key[byte]) byte++;
+  uint8_t x = key[byte] ^ buf[byte];
+  put_buf(s, buf);
+  if (!x) return i;
+  uint64_t d = byte * 8 + __builtin_clz(x) - 24;
+  // Walk down to the first node whose crit bit is after the difference.
+  // Every key under it is on the same side of the given key.
+  p = (struct pos_s) { 0, 0 };
+  while (bit(s, p.i)) {
+    uint64_t c = crit_at(s, p);
+    if (c > d) break;
+    p = kid(s, p, key_bit(key, keylen, c));
+  }
+  int count, first = leaf_range(s, p, &count);
+  int after = key_bit(key, keylen, d);
+  i = way ? (after ? first + count - 1 : first - 1)
+          : (after ? first + count : first);
+  return i < s->n ? i : -1;
+}
+
+int blt_succinct_ceil (BLT_SUCCINCT *s, char *key) {
+  return ceilfloor(s, key, 0);
+}
+
+int blt_succinct_floor(BLT_SUCCINCT *s, char *key) {
+  return ceilfloor(s, key, 1);
+}
+
+char *blt_succinct_key(BLT_SUCCINCT *s, int i) {
+  char *buf = malloc(s->maxlen + 1);
+  decode(s, i, buf);
+  return buf;
+}
+
+int blt_succinct_allprefixed(BLT_SUCCINCT *s, char *key,
+    int (*fun)(char *key, int i)) {
+  if (!s->n) return 1;
+  int keylen = strlen(key);
+  struct pos_s p = { 0, 0 };
+  while (bit(s, p.i)) {
+    uint64_t c = crit_at(s, p);
+    if (c >> 3 >= keylen) break;
+    p = kid(s, p, key_bit(key, keylen, c));
+  }
+  int count, first = leaf_range(s, p, &count);
+  char *buf = get_buf(s);
+  const uint8_t *q = decode(s, first, buf);
+  int status = 1;
+  if (!strncmp(buf, key, keylen)) {
+    for (int i = first; i < first + count && status == 1; i++) {
+      if (i > first) read_key(&q, buf);
+      status = fun(buf, i);
+    }
+  }
+  put_buf(s, buf);
+  return status;
+}
@@ -0,0 +1,52 @@
+// = Succinct crit-bit trees =
+//
+// A read-only copy of a tree in a few bytes per key beyond the keys
+// themselves, which are compressed:
+//
+//   BLT_SUCCINCT *s = blt_succinct_new(blt);
+//   int i = blt_succinct_get(s, "hello");
+//   blt_succinct_free(s);
+//
+// Keys are identified by their rank: their position in sorted order,
+// starting from 0. Callers keep any data in an array indexed by rank.
+//
+// Any number of threads may read the same copy at once.
+
+#ifndef __BLT_SUCCINCT_H__
+#define __BLT_SUCCINCT_H__
+
+#include <stddef.h>
+#include "blt.h"
+
+struct BLT_SUCCINCT;
+typedef struct BLT_SUCCINCT BLT_SUCCINCT;
+
+// Creates a succinct copy of the keys of a tree.
+BLT_SUCCINCT *blt_succinct_new(BLT *blt);
+
+void blt_succinct_free(BLT_SUCCINCT *s);
+
+// Returns the number of bytes used, including the keys.
+size_t blt_succinct_bytes(BLT_SUCCINCT *s);
+
+// Returns number of keys.
+int blt_succinct_size(BLT_SUCCINCT *s);
+
+// Returns the rank of a given key, or -1 if it is absent.
+int blt_succinct_get(BLT_SUCCINCT *s, char *key);
+
+// As blt_ceil() and blt_floor(), but returns a rank, or -1 if there is no
+// such key.
+int blt_succinct_ceil (BLT_SUCCINCT *s, char *key);
+int blt_succinct_floor(BLT_SUCCINCT *s, char *key);
+
+// Returns a copy of the key of a given rank, which the caller frees.
+char *blt_succinct_key(BLT_SUCCINCT *s, int i);
+
+// Iterates through all keys with a given prefix in order and runs the given
+// callback on each one and its rank, as blt_allprefixed(). The key is only
+// valid during the callback.
+int blt_succinct_allprefixed(BLT_SUCCINCT *s, char *key,
+    int (*fun)(char *key, int i));
+
+#endif  // __BLT_SUCCINCT_H__
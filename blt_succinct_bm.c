@@ -0,0 +1,45 @@
+// Benchmark the succinct copy of a BLT against the tree. For example:
+//
+//   $ blt_succinct_bm < /usr/share/dict/words
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bm.h"
+#include "blt.h"
+#include "blt_succinct.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  REP(i, m) blt_put(blt, key[i], 0);
+  size_t keybytes = 0;
+  REP(i, m) keybytes += strlen(key[i]) + 1;
+  printf("BLT bytes_per_key: %.2f\n",
+      (double) (blt_overhead(blt) + keybytes) / m);
+  bm_init();
+  BLT_SUCCINCT *s = blt_succinct_new(blt);
+  bm_report("BLT succinct_new");
+  printf("BLT succinct_bytes_per_key: %.2f\n",
+      (double) blt_succinct_bytes(s) / m);
+  bm_init();
+  REP(i, m) if (!blt_get(blt, key[i])) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  bm_report("BLT get");
+  REP(i, m) if (blt_succinct_get(s, key[i]) < 0) {
+    fprintf(stderr, "BUG!\n");
+    exit(1);
+  }
+  bm_report("BLT succinct_get");
+  blt_succinct_free(s);
+  blt_clear(blt);
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}
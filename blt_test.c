@@ -1,8 +1,24 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "blt.h"
+#include "blt_export.h"
+#include "blt_image.h"
+#include "blt_kv.h"
+#include "blt_lsm.h"
+#include "blt_sharded.h"
+#include "blt_shm.h"
+#include "blt_succinct.h"
+#include "first_diff.h"
 
 #define EXPECT(_x_) if (_x_); else fprintf(stderr, "%s:%d: FAIL\n", __FILE__, __LINE__)
 #define FAIL() fprintf(stderr, "%s:%d: ABORT\n", __FILE__, __LINE__), exit(1)
@@ -103,6 +119,85 @@ void test_traverse(char *line) {
   blt_clear(blt);
 }
 
+// Paths deeper than insertions remember, from keys such as "aaab".
+void test_deep() {
+  enum { n = 300 };
+  char *key[n];
+  F(i, n) {
+    key[i] = malloc(i / 2 + 3);
+    memset(key[i], 'a', i / 2 + 1);
+    strcpy(key[i] + i / 2 + 1, i % 2 ? "b" : "");
+  }
+  BLT *blt = blt_new();
+  F(i, n) {
+    int j = i + rand() % (n - i);
+    char *tmp = key[i];
+    key[i] = key[j];
+    key[j] = tmp;
+    blt_put(blt, key[i], key[i]);
+  }
+  EXPECT(blt_size(blt) == n);
+  char probe[n];
+  F(len, n / 2 + 2) F(last, 3) {
+    memset(probe, 'a', len);
+    strcpy(probe + len, (char *[]){"", "0", "c"}[last]);
+    char *ceil = 0, *floor = 0;
+    F(i, n) {
+      int c = strcmp(key[i], probe);
+      if (c >= 0 && (!ceil || strcmp(key[i], ceil) < 0)) ceil = key[i];
+      if (c <= 0 && (!floor || strcmp(key[i], floor) > 0)) floor = key[i];
+    }
+    BLT_IT *it = blt_ceil(blt, probe);
+    EXPECT(it ? it->data == ceil : !ceil);
+    it = blt_floor(blt, probe);
+    EXPECT(it ? it->data == floor : !floor);
+  }
+  blt_clear(blt);
+  F(i, n) free(key[i]);
+}
+
+// Strings end right before an inaccessible page, so reading past it faults.
+void test_first_diff() {
+  char *page = mmap(0, 2 * 4096, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED || mprotect(page + 4096, 4096, PROT_NONE)) FAIL();
+  // Every kernel this machine can run, then the ones we dispatch to.
+  size_t (*str[6])(const char *, const char *) = { first_diff_bytes };
+  size_t (*mem[6])(const void *, const void *, size_t) = {
+    first_diff_n_bytes
+  };
+  int nk = 1;
+#ifdef FIRST_DIFF_WORD
+  str[nk] = first_diff_word;
+  mem[nk++] = first_diff_n_word;
+#endif
+#ifdef FIRST_DIFF_X86
+  str[nk] = first_diff_sse2;
+  mem[nk++] = first_diff_n_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    str[nk] = first_diff_avx2;
+    mem[nk++] = first_diff_n_avx2;
+  }
+#endif
+  str[nk] = first_diff;
+  mem[nk++] = first_diff_n;
+  F(len, 99) F(k, len + 1) {
+    char *x = page + 4096 - 1 - len, *y = page + 1 + len % 7;
+    memset(x, 'x', len);
+    memset(y, 'x', len);
+    x[len] = y[len] = 0;
+    if (k < len) y[k] ^= k & 1 ? 0x80 : 1;
+    F(i, nk) {
+      EXPECT(str[i](x, y) == k);
+      EXPECT(str[i](y, x) == k);
+      EXPECT(mem[i](x, y, len) == k);
+      EXPECT(mem[i](y, x, len) == k);
+    }
+  }
+  EXPECT(leading_bit(1) == 1 && leading_bit(0x90) == 0x80);
+  munmap(page, 2 * 4096);
+}
+
 void check_prefix(BLT* blt, char *prefix, char *want) {
   arr_t a = make_arr(want);
   int n = 0;
@@ -116,6 +211,1208 @@ void check_prefix(BLT* blt, char *prefix, char *want) {
   nuke_arr(a);
 }
 
+void test_snapshot() {
+  BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  blt_put(blt, "ben", (void *) 1);
+  BLT *snap = blt_snapshot(blt);
+  blt_put(blt, "ben", (void *) 2);
+  blt_put(blt, "blob", 0);
+  blt_put(blt, "a", (void *) 3);
+  EXPECT(blt_delete(blt, "blink"));
+  EXPECT(blt_delete(blt, "aardvark"));
+  BLT *snap2 = blt_snapshot(blt);
+  EXPECT(blt_delete(blt, "blob"));
+  blt_put(blt, "c", 0);
+  check_prefix(snap, "", "a aardvark b ben blink bliss blt blynn");
+  check_prefix(snap2, "", "a b ben bliss blob blt blynn");
+  check_prefix(blt, "", "a b ben bliss blt blynn c");
+  EXPECT(blt_get(snap, "ben")->data == (void *) 1);
+  EXPECT(blt_get(snap2, "ben")->data == (void *) 2);
+  EXPECT(!blt_get(snap, "a")->data);
+  EXPECT(blt_get(snap2, "a")->data == (void *) 3);
+  blt_clear(snap);
+  check_prefix(snap2, "", "a b ben bliss blob blt blynn");
+  blt_clear(snap2);
+  blt_clear(blt);
+
+  // Snapshot of a tree with a single key at the root.
+  blt = make_blt("solo");
+  snap = blt_snapshot(blt);
+  EXPECT(blt_delete(blt, "solo"));
+  EXPECT(blt_empty(blt));
+  check_prefix(snap, "", "solo");
+  blt_clear(snap);
+  blt_clear(blt);
+}
+
+void test_rcu() {
+  BLT *blt = blt_new_rcu();
+  split("a aardvark b ben blink bliss blt blynn", ({ void _(char *s) {
+    blt_put(blt, s, 0);
+  }_; }));
+  int reader = blt_rcu_register(blt);
+  EXPECT(reader >= 0);
+  // A leaf held by a reader survives the writer deleting it.
+  BLT_IT *it = blt_get(blt, "blink");
+  EXPECT(blt_delete(blt, "blink"));
+  EXPECT(blt_delete(blt, "a"));
+  blt_put(blt, "blob", (void *) 1);
+  F(i, 4096) {
+    char s[8];
+    snprintf(s, sizeof(s), "%d", i);
+    blt_put(blt, s, 0);
+    EXPECT(blt_delete(blt, s));
+  }
+  EXPECT(!strcmp(it->key, "blink"));
+  blt_rcu_quiescent(blt, reader);
+  check_prefix(blt, "", "aardvark b ben bliss blob blt blynn");
+  EXPECT(blt_get(blt, "blob")->data == (void *) 1);
+  EXPECT(!strcmp(blt_ceil(blt, "blink")->key, "bliss"));
+  blt_rcu_unregister(blt, reader);
+  blt_clear(blt);
+}
+
+// Stress test for concurrent writers: each thread inserts its own keys and
+// a set of shared keys, then deletes some of each. Runs with either the CAS
+// or the OLC writers.
+enum { CONC_THREADS = 4, CONC_KEYS = 2000 };
+
+struct conc_arg {
+  BLT *blt;
+  int t, olc;
+};
+
+static int conc_put(int olc, BLT *blt, int r, char *key, void *data) {
+  return (olc ? blt_olc_put : blt_rcu_put)(blt, r, key, data);
+}
+
+static int conc_delete(int olc, BLT *blt, int r, char *key) {
+  return (olc ? blt_olc_delete : blt_rcu_delete)(blt, r, key);
+}
+
+static int conc_get(int olc, BLT *blt, char *key, void **data) {
+  if (olc) return blt_olc_get(blt, key, data);
+  BLT_IT *it = blt_get(blt, key);
+  if (it && data) *data = it->data;
+  return !!it;
+}
+
+static void *conc_writer(void *arg) {
+  struct conc_arg *a = arg;
+  BLT *blt = a->blt;
+  int r = blt_rcu_register(blt), olc = a->olc;
+  char s[32];
+  F(i, CONC_KEYS) {
+    sprintf(s, "t%d-%d", a->t, i);
+    EXPECT(conc_put(olc, blt, r, s, (void *) (intptr_t) i));
+    sprintf(s, "s%d", i);
+    conc_put(olc, blt, r, s, (void *) (intptr_t) i);
+    if (!(i & 15)) blt_rcu_quiescent(blt, r);
+  }
+  F(i, CONC_KEYS) {
+    sprintf(s, "t%d-%d", a->t, i);
+    void *data;
+    if (i & 1) EXPECT(conc_delete(olc, blt, r, s));
+    else EXPECT(conc_get(olc, blt, s, &data) && data == (void *) (intptr_t) i);
+    sprintf(s, "s%d", i);
+    if (!(i % 3)) conc_delete(olc, blt, r, s);
+    if (!(i & 15)) blt_rcu_quiescent(blt, r);
+  }
+  blt_rcu_unregister(blt, r);
+  return 0;
+}
+
+void test_concurrent(int olc) {
+  BLT *blt = blt_new_rcu();
+  pthread_t th[CONC_THREADS];
+  struct conc_arg arg[CONC_THREADS];
+  F(t, CONC_THREADS) {
+    arg[t] = (struct conc_arg) { blt, t, olc };
+    pthread_create(th + t, 0, conc_writer, arg + t);
+  }
+  F(t, CONC_THREADS) pthread_join(th[t], 0);
+  char s[32];
+  F(i, CONC_KEYS) {
+    F(t, CONC_THREADS) {
+      sprintf(s, "t%d-%d", t, i);
+      EXPECT((!conc_get(olc, blt, s, 0)) == (i & 1));
+    }
+    sprintf(s, "s%d", i);
+    EXPECT((!conc_get(olc, blt, s, 0)) == !(i % 3));
+  }
+  EXPECT(blt_size(blt) == CONC_THREADS * CONC_KEYS / 2 + CONC_KEYS * 2 / 3);
+  char *last = "";
+  for (BLT_IT *it = blt_first(blt); it; it = blt_next(blt, it)) {
+    EXPECT(strcmp(last, it->key) < 0);
+    last = it->key;
+  }
+  blt_clear(blt);
+}
+
+// Each thread puts keys starting with every possible byte into a sharded
+// tree, then deletes every other one.
+static void *shard_writer(void *arg) {
+  BLT_SHARDED *s = ((void **) arg)[0];
+  int t = (intptr_t) ((void **) arg)[1];
+  char k[8];
+  for (int c = 1; c < 256; c++) {
+    snprintf(k, sizeof(k), "%c%d", c, t);
+    EXPECT(blt_sharded_put(s, k, (void *) (intptr_t) c));
+  }
+  for (int c = 1; c < 256; c += 2) {
+    snprintf(k, sizeof(k), "%c%d", c, t);
+    EXPECT(blt_sharded_delete(s, k));
+  }
+  return 0;
+}
+
+void test_sharded() {
+  BLT_SHARDED *s = blt_sharded_new(7);
+  pthread_t th[CONC_THREADS];
+  void *arg[CONC_THREADS][2];
+  F(t, CONC_THREADS) {
+    arg[t][0] = s;
+    arg[t][1] = (void *) (intptr_t) t;
+    pthread_create(th + t, 0, shard_writer, arg[t]);
+  }
+  F(t, CONC_THREADS) pthread_join(th[t], 0);
+  long keys = 0;
+  F(i, blt_sharded_shards(s)) {
+    BLT_SHARD_STATS st;
+    blt_sharded_stats(s, i, &st);
+    EXPECT(st.keys == st.puts - st.deletes);
+    keys += st.keys;
+  }
+  EXPECT(keys == 127 * CONC_THREADS);
+  // Walk all keys in order with next, and again with forall.
+  int n = 0;
+  char *last = strdup("");
+  void *data;
+  for (char *k; (k = blt_sharded_next(s, last, &data)); n++) {
+    EXPECT(strcmp(last, k) < 0);
+    EXPECT(data == (void *) (intptr_t) (uint8_t) *k && !((uint8_t) *k & 1));
+    free(last);
+    last = k;
+  }
+  free(last);
+  EXPECT(n == keys);
+  n = 0;
+  blt_sharded_forall(s, ({void _(BLT_IT *it){ n++; }_;}));
+  EXPECT(n == keys);
+  // Searches that cross shards.
+  char *k = blt_sharded_ceil(s, "\x03", 0);
+  EXPECT(!strcmp(k, "\x04" "0"));
+  free(k);
+  k = blt_sharded_floor(s, "\x03", &data);
+  EXPECT(!strcmp(k, "\x02" "3") && data == (void *) 2);
+  free(k);
+  EXPECT(!blt_sharded_floor(s, "\x02", 0));
+  EXPECT(!blt_sharded_ceil(s, "\xff", 0));
+  EXPECT(!blt_sharded_get(s, "\x03" "0", 0));
+  EXPECT(blt_sharded_get(s, "\xfe" "1", &data) && data == (void *) 254);
+  n = 0;
+  blt_sharded_allprefixed(s, "\xfe", ({int _(BLT_IT *it){ return ++n, 1; }_;}));
+  EXPECT(n == CONC_THREADS);
+  blt_sharded_clear(s);
+}
+
+void test_build() {
+  enum { N = 5000 };
+  char *key[N + 4];
+  void *val[N + 4];
+  F(i, N) {
+    char s[16];
+    // Plenty of shared prefixes, and every key appears twice.
+    sprintf(s, "%x", (i / 2) * 2654435761u % 100000);
+    key[i] = strdup(s);
+    val[i] = (void *) (intptr_t) i;
+  }
+  char *extra[] = { "", "a", "\xff", "a" };
+  F(i, 4) {
+    key[N + i] = strdup(extra[i]);
+    val[N + i] = (void *) (intptr_t) (N + i);
+  }
+  BLT *want = blt_new();
+  F(i, N + 4) blt_put(want, key[i], val[i]);
+  for (int t = 1; t <= 8; t *= 2) {
+    BLT *blt = blt_build_parallel(key, val, N + 4, t);
+    EXPECT(blt_size(blt) == blt_size(want));
+    BLT_IT *it = blt_first(blt);
+    blt_forall(want, ({void _(BLT_IT *w){
+      EXPECT(it && !strcmp(it->key, w->key) && it->data == w->data);
+      it = blt_next(blt, it);
+    }_;}));
+    EXPECT(blt_get(blt, "a")->data == (void *) (N + 3));
+    blt_clear(blt);
+  }
+  // The builder takes keys in order, and rejects any out of order.
+  BLT_BUILDER *b = blt_builder_new();
+  blt_forall(want, ({void _(BLT_IT *w){
+    EXPECT(!blt_builder_add(b, w->key, w->data));
+  }_;}));
+  EXPECT(blt_builder_add(b, "a", 0) == -1);
+  EXPECT(blt_builder_add(b, "\xff", 0) == -1);
+  BLT *blt = blt_builder_finish(b);
+  EXPECT(blt_size(blt) == blt_size(want));
+  blt_forall(want, ({void _(BLT_IT *w){
+    BLT_IT *it = blt_get(blt, w->key);
+    EXPECT(it && it->data == w->data);
+  }_;}));
+  blt_clear(blt);
+  blt_clear(blt_builder_finish(blt_builder_new()));
+  blt_clear(want);
+  blt_clear(blt_build_parallel(key, 0, 0, 4));
+  F(i, N + 4) free(key[i]);
+
+  // Keys sharing a long prefix, one of them the prefix itself.
+  F(i, N) {
+    char s[64];
+    sprintf(s, "http://example.com/%x", i * 2654435761u % 100000);
+    key[i] = strdup(s);
+  }
+  key[N] = strdup("http://example.com/");
+  BLT *blt1 = blt_build_parallel(key, 0, N + 1, 1);
+  BLT *blt4 = blt_build_parallel(key, 0, N + 1, 4);
+  EXPECT(blt_size(blt4) == blt_size(blt1));
+  BLT_IT *it = blt_first(blt4);
+  blt_forall(blt1, ({void _(BLT_IT *w){
+    EXPECT(it && !strcmp(it->key, w->key));
+    it = blt_next(blt4, it);
+  }_;}));
+  F(i, N + 1) EXPECT(blt_get(blt4, key[i]));
+  blt_clear(blt1);
+  blt_clear(blt4);
+  F(i, N + 1) free(key[i]);
+}
+
+struct par_acc {
+  int n;
+  char *first, *last;
+};
+
+void test_parallel() {
+  BLT *blt = blt_new();
+  enum { N = 20000 };
+  char s[16];
+  F(i, N) {
+    sprintf(s, "%d", i * 7919 % N);
+    blt_put(blt, s, 0);
+  }
+  for (int t = 1; t <= 8; t *= 2) {
+    int count[t];
+    memset(count, 0, sizeof(count));
+    blt_forall_parallel(blt, t, ({void _(BLT_IT *it, int id){ count[id]++; }_;}));
+    int total = 0;
+    F(i, t) total += count[i];
+    EXPECT(total == N);
+    // Chunks must arrive in order, and cover every key with the prefix.
+    char *last = "";
+    total = 0;
+    blt_allprefixed_ordered(blt, t & 1 ? "" : "1", t,
+        ({void *_(){ return calloc(1, sizeof(struct par_acc)); }_;}),
+        ({void _(void *p, BLT_IT *it){
+          struct par_acc *a = p;
+          if (!a->n++) a->first = it->key;
+          else EXPECT(strcmp(a->last, it->key) < 0);
+          a->last = it->key;
+        }_;}),
+        ({void _(void *p){
+          struct par_acc *a = p;
+          EXPECT(a->n && strcmp(last, a->first) < 0);
+          last = a->last;
+          total += a->n;
+          free(a);
+        }_;}));
+    int want = 0;
+    blt_allprefixed(blt, t & 1 ? "" : "1", ({int _(BLT_IT *it){
+      return ++want, 1;
+    }_;}));
+    EXPECT(total == want);
+  }
+  blt_allprefixed_parallel(blt, "x", 4, ({void _(BLT_IT *it, int id){
+    FAIL();
+  }_;}));
+  blt_clear(blt);
+}
+
+void test_compound() {
+  BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  void *old = (void *) 9;
+  EXPECT(!blt_replace(blt, "blob", (void *) 1, &old) && old == (void *) 9);
+  EXPECT(blt_replace(blt, "blob", (void *) 2, &old) && old == (void *) 1);
+  EXPECT(blt_get(blt, "blob")->data == (void *) 2);
+
+  BLT *snap = blt_snapshot(blt);
+  EXPECT(!blt_cas(blt, "blob", (void *) 1, (void *) 3));
+  EXPECT(!blt_cas(blt, "blobby", 0, (void *) 3));
+  EXPECT(blt_cas(blt, "blob", (void *) 2, (void *) 3));
+  EXPECT(blt_get(blt, "blob")->data == (void *) 3);
+  EXPECT(blt_get(snap, "blob")->data == (void *) 2);
+  blt_clear(snap);
+
+  void *inc(void *data, void *ctx) {
+    return (void *) ((intptr_t) data + (intptr_t) ctx);
+  }
+  F(i, 5) blt_upsert(blt, "count", inc, (void *) 2);
+  EXPECT(blt_upsert(blt, "count", inc, (void *) 1)->data == (void *) 11);
+  EXPECT(blt_upsert(blt, "b", inc, (void *) 1)->data == (void *) 1);
+
+  EXPECT(blt_extract(blt, "count", &old) && old == (void *) 11);
+  EXPECT(!blt_extract(blt, "count", &old) && old == (void *) 11);
+  EXPECT(!blt_extract(blt, "bl", &old));
+  EXPECT(blt_extract(blt, "blob", 0));
+  check_prefix(blt, "", "a aardvark b ben blink bliss blt blynn");
+  blt_clear(blt);
+
+  blt = blt_new_rcu();
+  blt_upsert(blt, "x", inc, (void *) 4);
+  EXPECT(blt_get(blt, "x")->data == (void *) 4);
+  EXPECT(blt_extract(blt, "x", &old) && old == (void *) 4 && blt_empty(blt));
+  blt_clear(blt);
+}
+
+// Key i of a chain in which each key branches off at the next bit, so a
+// tree of the first n keys is n levels deep. The chain runs down the right
+// if way is 1, and down the left otherwise, using 7 bits of each byte.
+static char *chain_key(int i, int way) {
+  int q = way ? i / 8 : i / 7;
+  char *s = malloc(q + 2);
+  memset(s, way ? 0xff : 1, q);
+  s[q] = way ? 0xff << (8 - i % 8) : 1 | 0x80 >> i % 7;
+  s[q + 1] = 0;
+  return s;
+}
+
+static void *clear_deep(void *blt) {
+  blt_clear(blt);
+  return 0;
+}
+
+static void *clear_step_deep(void *blt) {
+  BLT_GARBAGE *g = blt_clear_detach(blt);
+  while (blt_clear_step(g, 100));
+  return 0;
+}
+
+// Runs fn(arg) on a thread with a 64 KB stack, which recursing once per
+// level of a deep tree would overflow.
+static void on_small_stack(void *(*fn)(void *), void *arg) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 << 10);
+  pthread_t th;
+  EXPECT(!pthread_create(&th, &attr, fn, arg));
+  pthread_join(th, 0);
+  pthread_attr_destroy(&attr);
+}
+
+void test_clear_deep() {
+  enum { n = 8000 };
+  char *key[n];
+  F(way, 2) {
+    F(i, n) key[i] = chain_key(i, way);
+    BLT *blt = blt_new();
+    F(i, n) blt_put(blt, key[i], 0);
+    EXPECT(blt_size(blt) == n);
+    on_small_stack(clear_deep, blt);
+    blt = blt_new();
+    F(i, n) blt_put(blt, key[n - 1 - i], 0);
+    on_small_stack(clear_step_deep, blt);
+    F(i, n) free(key[i]);
+  }
+}
+
+void test_clear_step() {
+  BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  BLT_GARBAGE *g = blt_clear_detach(blt);
+  int steps = 1;
+  while (blt_clear_step(g, 2)) steps++;
+  // 8 keys take 7 pairs to hold them, beneath the root.
+  EXPECT(steps == 4);
+  EXPECT(!blt_clear_step(blt_clear_detach(blt_new()), 1));
+  blt_clear_async(make_blt("the quick brown fox jumps over the lazy dog"));
+}
+
+void test_bulk_delete() {
+  // Keys such as "3/141", in buckets by the part before the slash.
+  BLT *make(int mode) {
+    BLT *blt = mode == 2 ? blt_new_rcu() : blt_new();
+    char s[16];
+    F(i, 2000) {
+      sprintf(s, "%d/%d", i % 17, i * 7919 % 10007);
+      blt_put(blt, s, (void *) (intptr_t) 1);
+    }
+    blt_put(blt, "", (void *) (intptr_t) 1);
+    return blt;
+  }
+  // Deletes keys in [lo, hi) one at a time.
+  int slow(BLT *blt, char *lo, char *hi) {
+    int n = 0;
+    for (BLT_IT *it; (it = blt_ceil(blt, lo)) && (!hi || strcmp(it->key, hi) < 0);) {
+      char *k = strdup(it->key);
+      blt_delete(blt, k);
+      free(k);
+      n++;
+    }
+    return n;
+  }
+  void same(BLT *a, BLT *b) {
+    EXPECT(blt_size(a) == blt_size(b));
+    BLT_IT *it = blt_first(b);
+    blt_forall(a, ({ void _(BLT_IT *x) {
+      EXPECT(it && !strcmp(x->key, it->key));
+      it = it ? blt_next(b, it) : 0;
+    }_; }));
+  }
+  char *range[][2] = {
+    { "", 0 }, { "", "" }, { "1", "2" }, { "1/5", "10/3" }, { "3/", "3/~" },
+    { "5/5000", 0 }, { "9", "9" }, { "~", 0 }, { "", "1/" }, { "2/17", "2/170" },
+  };
+  F(mode, 3) F(i, sizeof(range) / sizeof(*range)) {
+    BLT *want = make(0), *blt = make(mode), *snap = 0;
+    if (mode == 1) snap = blt_snapshot(blt);
+    // An RCU reader that never moves on holds back every callback.
+    int reader = mode == 2 ? blt_rcu_register(blt) : -1;
+    int n = slow(want, range[i][0], range[i][1]), calls = 0;
+    EXPECT(blt_delete_range(blt, range[i][0], range[i][1],
+        ({ void _(BLT_IT *it) { calls += (intptr_t) it->data; }_; })) == n);
+    EXPECT(calls == (mode == 2 ? 0 : n));
+    same(blt, want);
+    if (snap) {
+      EXPECT(blt_size(snap) == 2001);
+      blt_clear(snap);
+    }
+    if (reader >= 0) blt_rcu_unregister(blt, reader);
+    blt_clear(want);
+    blt_clear(blt);
+    EXPECT(calls == n);
+  }
+  char *prefix[] = { "", "1", "1/", "13/", "7/7", "x", "16/9999" };
+  F(mode, 3) F(i, sizeof(prefix) / sizeof(*prefix)) {
+    BLT *want = make(0), *blt = make(mode), *snap = 0;
+    if (mode == 1) snap = blt_snapshot(blt);
+    char hi[16];
+    strcpy(hi, prefix[i]);
+    int len = strlen(hi);
+    if (len) hi[len - 1]++;
+    int n = slow(want, prefix[i], len ? hi : 0);
+    EXPECT(blt_delete_prefixed(blt, prefix[i], 0) == n);
+    same(blt, want);
+    if (snap) blt_clear(snap);
+    blt_clear(want);
+    blt_clear(blt);
+  }
+  // Detaching leaves the freeing to later.
+  int count(BLT *blt, char *key) {
+    int n = 0;
+    blt_allprefixed(blt, key, ({ int _(BLT_IT *it) { return n++, 1; }_; }));
+    return n;
+  }
+  BLT *blt = make(0);
+  BLT_GARBAGE *g = blt_detach_prefixed(blt, "1", 0);
+  EXPECT(!count(blt, "1") && count(blt, "2"));
+  while (blt_clear_step(g, 10));
+  blt_garbage_async(blt_detach_range(blt, "2", "5", 0));
+  EXPECT(!count(blt, "4") && count(blt, "5"));
+  blt_clear(blt);
+}
+
+// Checks an image answers every query the same way as the tree it came from.
+static void check_image(BLT *blt) {
+  char path[] = "/tmp/blt_test.XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT(!blt_save(blt, fd));
+  close(fd);
+  BLT_IMAGE *img = blt_open_mmap(path);
+  unlink(path);
+  EXPECT(img);
+  if (!img) return;
+  EXPECT(blt_image_size(img) == blt_size(blt));
+  BLT_IMAGE_IT it;
+  int n = 0;
+  blt_forall(blt, ({void _(BLT_IT *want){
+    if (!n++) {
+      EXPECT(blt_image_first(img, &it));
+    } else {
+      EXPECT(blt_image_next(img, &it));
+    }
+    EXPECT(!strcmp(it.key, want->key) && it.data == (intptr_t) want->data);
+    BLT_IMAGE_IT got;
+    EXPECT(blt_image_get(img, want->key, &got) && got.key == it.key);
+    // Probe just past each key, and at the key minus its last byte.
+    int len = strlen(want->key);
+    char s[len + 2];
+    sprintf(s, "%s!", want->key);
+    EXPECT(!blt_image_get(img, s, &got));
+    F(k, 2) {
+      if (k) s[len ? len - 1 : 0] = 0;
+      BLT_IT *c = blt_ceil(blt, s), *f = blt_floor(blt, s);
+      EXPECT(c ? blt_image_ceil(img, s, &got) && !strcmp(got.key, c->key) :
+          !blt_image_ceil(img, s, &got));
+      EXPECT(f ? blt_image_floor(img, s, &got) && !strcmp(got.key, f->key) :
+          !blt_image_floor(img, s, &got));
+    }
+  }_;}));
+  EXPECT(!n || !blt_image_next(img, &it));
+  for (int ok = blt_image_last(img, &it); ok; ok = blt_image_prev(img, &it)) {
+    n--;
+  }
+  EXPECT(!n);
+  blt_forall(blt, ({void _(BLT_IT *it){
+    char prefix[3] = { it->key[0], it->key[0] ? it->key[1] : 0 };
+    int want = 0, got = 0;
+    blt_allprefixed(blt, prefix, ({int _(BLT_IT *it){ return ++want, 1; }_;}));
+    blt_image_allprefixed(img, prefix, ({int _(BLT_IMAGE_IT *it){
+      return ++got, 1;
+    }_;}));
+    EXPECT(want == got);
+  }_;}));
+  blt_image_close(img);
+}
+
+void test_image() {
+  BLT *blt = blt_new();
+  check_image(blt);
+  blt_put(blt, "", (void *) 7);
+  check_image(blt);
+  blt_clear(blt);
+  blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  check_image(blt);
+  char s[16];
+  F(i, 3000) {
+    sprintf(s, "%x", i * 2654435761u);
+    blt_put(blt, s, (void *) (intptr_t) i);
+  }
+  check_image(blt);
+  blt_clear(blt);
+}
+
+// A checked open of an image with bad offsets fails rather than crashing
+// later.
+void test_image_corrupt() {
+  BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  char path[] = "/tmp/blt_test.XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT(!blt_save(blt, fd));
+  off_t len = lseek(fd, 0, SEEK_END);
+  char *buf = malloc(len);
+  EXPECT(pread(fd, buf, len, 0) == len);
+  // The header is 5 words: nnodes is the fourth and the key region size the
+  // fifth. Nodes follow, each two words.
+  uint64_t *w = (uint64_t *) buf, *node = w + 5, bad[][2] = {
+    { 3, 1000 }, { 3, ~0ull / 8 }, { 4, ~0ull - 10 },
+    { 5 + 1, 0 }, { 5 + 1, ~0ull }, { 5 + 2 * 14, ~0ull << 1 },
+  };
+  // The root is internal, and the last of its 15 nodes a leaf.
+  EXPECT((node[0] & 1) && !(node[2 * 14] & 1));
+  F(i, sizeof(bad) / sizeof(*bad)) {
+    uint64_t old = w[bad[i][0]];
+    w[bad[i][0]] = bad[i][1];
+    EXPECT(pwrite(fd, buf, len, 0) == len);
+    BLT_IMAGE *img = blt_open_mmap_checked(path);
+    EXPECT(!img);
+    if (img) blt_image_close(img);
+    w[bad[i][0]] = old;
+  }
+  // The key region must end with a NUL.
+  buf[len - 1] = 'x';
+  EXPECT(pwrite(fd, buf, len, 0) == len);
+  EXPECT(!blt_open_mmap_checked(path));
+  // A plain open only reads the header.
+  BLT_IMAGE *img = blt_open_mmap(path);
+  EXPECT(img);
+  if (img) blt_image_close(img);
+  buf[len - 1] = 0;
+  EXPECT(pwrite(fd, buf, len, 0) == len);
+  img = blt_open_mmap_checked(path);
+  EXPECT(img);
+  if (img) blt_image_close(img);
+  close(fd);
+  unlink(path);
+  free(buf);
+  blt_clear(blt);
+}
+
+// Recovery rejects a checkpoint whose values lie outside it.
+void test_kv_corrupt() {
+  char dir[] = "/tmp/blt_test.XXXXXX";
+  if (!mkdtemp(dir)) FAIL();
+  BLT_KV *kv = blt_kv_open(dir, 0, 0);
+  EXPECT(kv);
+  if (!kv) return;
+  EXPECT(!blt_kv_put(kv, "a", "xyz"));
+  EXPECT(!blt_kv_checkpoint(kv));
+  blt_kv_close(kv);
+  char name[64];
+  sprintf(name, "%s/checkpoint", dir);
+  int fd = open(name, O_RDWR);
+  // A 5-word header, one leaf node, the key "a", then the value.
+  enum { LEN = 40 + 16 + 2 + 4 };
+  char buf[LEN];
+  EXPECT(pread(fd, buf, LEN, 0) == LEN);
+  EXPECT(lseek(fd, 0, SEEK_END) == LEN);
+  uint64_t *data = (uint64_t *) buf + 6, bad[] = { 0, 40, LEN, ~0ull };
+  EXPECT(*data == LEN - 4);
+  F(i, sizeof(bad) / sizeof(*bad)) {
+    uint64_t old = *data;
+    *data = bad[i];
+    EXPECT(pwrite(fd, buf, LEN, 0) == LEN);
+    kv = blt_kv_open(dir, 0, 0);
+    EXPECT(!kv);
+    if (kv) blt_kv_close(kv);
+    *data = old;
+  }
+  // The value must end with a NUL.
+  buf[LEN - 1] = 'x';
+  EXPECT(pwrite(fd, buf, LEN, 0) == LEN);
+  EXPECT(!blt_kv_open(dir, 0, 0));
+  buf[LEN - 1] = 0;
+  EXPECT(pwrite(fd, buf, LEN, 0) == LEN);
+  close(fd);
+  kv = blt_kv_open(dir, 0, 0);
+  EXPECT(kv);
+  if (!kv) return;
+  char *s = blt_kv_get(kv, "a");
+  EXPECT(s && !strcmp(s, "xyz"));
+  free(s);
+  blt_kv_close(kv);
+  unlink(name);
+  sprintf(name, "%s/wal", dir);
+  unlink(name);
+  rmdir(dir);
+}
+
+void test_shm() {
+  char name[32];
+  sprintf(name, "/blt_test.%d", (int) getpid());
+  BLT_SHM *shm = blt_shm_create(name, 1 << 20);
+  EXPECT(shm);
+  if (!shm) return;
+  EXPECT(!blt_shm_pin(shm));
+  BLT *blt = make_blt("a aardvark b ben");
+  EXPECT(!blt_shm_publish(shm, blt));
+  BLT_SHM *r = blt_shm_open(name);
+  BLT_IMAGE *img = blt_shm_pin(r);
+  BLT_IMAGE_IT it;
+  EXPECT(img && blt_image_get(img, "ben", &it));
+  // A publish leaves the pinned image alone.
+  blt_put(blt, "blt", 0);
+  EXPECT(!blt_shm_publish(shm, blt));
+  EXPECT(!blt_image_get(img, "blt", &it) && blt_image_get(img, "ben", &it));
+  blt_shm_unpin(r);
+  img = blt_shm_pin(r);
+  EXPECT(blt_image_get(img, "blt", &it));
+  blt_shm_unpin(r);
+  // Another process sees the latest image, and dies while pinning it.
+  pid_t pid = fork();
+  if (!pid) {
+    BLT_SHM *c = blt_shm_open(name);
+    img = c ? blt_shm_pin(c) : 0;
+    _exit(!(img && blt_image_get(img, "blt", &it) &&
+        blt_image_size(img) == 5));
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  EXPECT(WIFEXITED(status) && !WEXITSTATUS(status));
+  // So publishing twice must not wait for it.
+  EXPECT(!blt_shm_publish(shm, blt));
+  EXPECT(!blt_shm_publish(shm, blt));
+  char s[16];
+  F(i, 100000) {
+    sprintf(s, "%d", i);
+    blt_put(blt, s, 0);
+  }
+  EXPECT(blt_shm_publish(shm, blt));
+  blt_shm_close(r);
+  blt_shm_close(shm);
+  shm_unlink(name);
+  blt_clear(blt);
+}
+
+void check_succinct(BLT *blt) {
+  BLT_SUCCINCT *s = blt_succinct_new(blt);
+  EXPECT(blt_succinct_size(s) == blt_size(blt));
+  // Store the rank of each key as its data.
+  int i = 0;
+  blt_forall(blt, ({ void _(BLT_IT *it) { it->data = (void *) (intptr_t) i++; }_; }));
+  int rank(BLT_IT *it) { return it ? (intptr_t) it->data : -1; }
+  i = 0;
+  blt_forall(blt, ({ void _(BLT_IT *it) {
+    EXPECT(blt_succinct_get(s, it->key) == i);
+    char *k = blt_succinct_key(s, i);
+    EXPECT(!strcmp(k, it->key));
+    free(k);
+    // Probe just past and just before each key.
+    int n = strlen(it->key);
+    char probe[n + 2];
+    strcpy(probe, it->key);
+    strcat(probe, "0");
+    EXPECT(blt_succinct_get(s, probe) == rank(blt_get(blt, probe)));
+    EXPECT(blt_succinct_ceil(s, probe) == rank(blt_ceil(blt, probe)));
+    EXPECT(blt_succinct_floor(s, probe) == rank(blt_floor(blt, probe)));
+    if (n) {
+      probe[n] = 0;
+      probe[n - 1]--;
+      if (probe[n - 1]) {
+        EXPECT(blt_succinct_ceil(s, probe) == rank(blt_ceil(blt, probe)));
+        EXPECT(blt_succinct_floor(s, probe) == rank(blt_floor(blt, probe)));
+      }
+      // Every prefix lists the same keys.
+      probe[n - 1] = 0;
+      BLT_IT *p = blt_ceil(blt, probe);
+      int j = rank(p);
+      EXPECT(blt_succinct_allprefixed(s, probe, ({ int _(char *key, int r) {
+        EXPECT(p && !strcmp(p->key, key) && r == j);
+        p = blt_next(blt, p), j++;
+        return 1;
+      }_; })) == 1);
+      EXPECT(!p || strncmp(p->key, probe, n - 1));
+    }
+    i++;
+  }_; }));
+  EXPECT(blt_succinct_ceil(s, "\xff\xff\xff") == -1);
+  EXPECT(blt_succinct_floor(s, "") == (blt_get(blt, "") ? 0 : -1));
+  blt_succinct_free(s);
+}
+
+void test_succinct() {
+  BLT *blt = blt_new();
+  check_succinct(blt);
+  blt_put(blt, "", 0);
+  check_succinct(blt);
+  split("a aardvark b ben blink bliss blt blynn", ({ void _(char *s) {
+    blt_put(blt, s, 0);
+  }_; }));
+  check_succinct(blt);
+  blt_clear(blt);
+  // Enough keys to span many blocks, with long runs of either kid.
+  blt = blt_new();
+  char s[32];
+  F(i, 3000) {
+    sprintf(s, "%d", i * 7919 % 100000);
+    blt_put(blt, s, 0);
+    if (!(i % 100)) {
+      memset(s, 'z', i / 100 + 1);
+      s[i / 100 + 1] = 0;
+      blt_put(blt, s, 0);
+    }
+  }
+  check_succinct(blt);
+  blt_clear(blt);
+}
+
+void test_export() {
+  BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
+  blt_put(blt, "", 0);
+  char s[32];
+  F(i, 1000) {
+    sprintf(s, "http://example.com/%d", i * 7919 % 10007);
+    blt_put(blt, s, 0);
+  }
+  FILE *fp = tmpfile();
+  EXPECT(!blt_export_frontcoded(blt, fp));
+  long len = ftell(fp);
+  rewind(fp);
+  BLT *copy = blt_import_frontcoded(fp);
+  EXPECT(copy && blt_size(copy) == blt_size(blt));
+  BLT_IT *it = blt_first(copy);
+  blt_forall(blt, ({ void _(BLT_IT *want) {
+    EXPECT(it && !strcmp(it->key, want->key));
+    it = blt_next(copy, it);
+  }_; }));
+  blt_clear(copy);
+  // A truncated stream is rejected.
+  char *buf = malloc(len);
+  rewind(fp);
+  EXPECT(fread(buf, 1, len, fp) == len);
+  fclose(fp);
+  fp = fmemopen(buf, len - 1, "r");
+  EXPECT(!blt_import_frontcoded(fp));
+  fclose(fp);
+  // So is one with keys out of order: swap the first two records.
+  char bad[] = "BLTFC1\n\0\2b\0\2a\0\0";
+  fp = fmemopen(bad, sizeof(bad) - 1, "r");
+  EXPECT(!blt_import_frontcoded(fp));
+  fclose(fp);
+  // And one whose first key claims to be 2^62 bytes long.
+  char huge[] = "BLTFC1\n\0\0\x80\x80\x80\x80\x80\x80\x80\x80\x40";
+  fp = fmemopen(huge, sizeof(huge) - 1, "r");
+  EXPECT(!blt_import_frontcoded(fp));
+  fclose(fp);
+  free(buf);
+  // An empty tree.
+  fp = tmpfile();
+  BLT *empty = blt_new();
+  EXPECT(!blt_export_frontcoded(empty, fp));
+  rewind(fp);
+  copy = blt_import_frontcoded(fp);
+  EXPECT(copy && blt_empty(copy));
+  blt_clear(copy);
+  blt_clear(empty);
+  fclose(fp);
+  blt_clear(blt);
+}
+
+void test_kv() {
+  char dir[] = "/tmp/blt_test.XXXXXX";
+  if (!mkdtemp(dir)) FAIL();
+  BLT_KV *kv = blt_kv_open(dir, 0, 0);
+  EXPECT(kv);
+  if (!kv) return;
+  char k[16], v[16];
+  F(i, 1000) {
+    sprintf(k, "%d", i);
+    sprintf(v, "v%d", i);
+    EXPECT(!blt_kv_put(kv, k, v));
+  }
+  EXPECT(blt_kv_delete(kv, "7") == 1);
+  EXPECT(blt_kv_delete(kv, "7") == 0);
+  EXPECT(!blt_kv_put(kv, "8", "eight"));
+  void check(BLT_KV *kv) {
+    EXPECT(blt_kv_size(kv) == 999);
+    EXPECT(!blt_kv_get(kv, "7"));
+    char *s = blt_kv_get(kv, "8");
+    EXPECT(s && !strcmp(s, "eight"));
+    free(s);
+    s = blt_kv_get(kv, "999");
+    EXPECT(s && !strcmp(s, "v999"));
+    free(s);
+  }
+  check(kv);
+  // Recovers from the log alone.
+  blt_kv_close(kv);
+  kv = blt_kv_open(dir, 0, 0);
+  check(kv);
+  // And from a checkpoint and the log.
+  EXPECT(!blt_kv_checkpoint(kv));
+  EXPECT(!blt_kv_put(kv, "", "empty"));
+  EXPECT(blt_kv_delete(kv, "") == 1);
+  EXPECT(!blt_kv_put(kv, "0", ""));
+  blt_kv_close(kv);
+  // A torn write at the end of the log is dropped.
+  char name[64];
+  sprintf(name, "%s/wal", dir);
+  FILE *fp = fopen(name, "a");
+  fwrite("\x03\0\0\0\x01", 1, 5, fp);
+  fclose(fp);
+  kv = blt_kv_open(dir, 0, 0);
+  check(kv);
+  char *s = blt_kv_get(kv, "0");
+  EXPECT(s && !*s);
+  free(s);
+  EXPECT(!blt_kv_get(kv, ""));
+  EXPECT(!blt_kv_put(kv, "after", "torn"));
+  blt_kv_close(kv);
+
+  // Concurrent writers share syncs, and checkpoints happen automatically.
+  kv = blt_kv_open(dir, 100, 4096);
+  enum { T = 4, N = 200 };
+  void *writer(void *arg) {
+    char k[16];
+    F(i, N) {
+      sprintf(k, "t%d.%d", (int) (intptr_t) arg, i);
+      EXPECT(!blt_kv_put(kv, k, k));
+    }
+    return 0;
+  }
+  pthread_t th[T];
+  F(t, T) pthread_create(th + t, 0, writer, (void *) (intptr_t) t);
+  F(t, T) pthread_join(th[t], 0);
+  blt_kv_close(kv);
+  kv = blt_kv_open(dir, 0, 0);
+  EXPECT(blt_kv_size(kv) == 999 + 1 + T * N);
+  s = blt_kv_get(kv, "t3.199");
+  EXPECT(s && !strcmp(s, "t3.199"));
+  free(s);
+  s = blt_kv_get(kv, "after");
+  EXPECT(s && !strcmp(s, "torn"));
+  free(s);
+  // A key longer than the stack is replayed from the log.
+  enum { BIG = 9 << 20 };
+  char *big = malloc(BIG + 1);
+  memset(big, 'k', BIG);
+  big[BIG] = 0;
+  EXPECT(!blt_kv_put(kv, big, "big"));
+  blt_kv_close(kv);
+  kv = blt_kv_open(dir, 0, 0);
+  s = blt_kv_get(kv, big);
+  EXPECT(s && !strcmp(s, "big"));
+  free(s);
+  free(big);
+  blt_kv_close(kv);
+  char *files[] = { "wal", "checkpoint" };
+  F(i, 2) {
+    sprintf(name, "%s/%s", dir, files[i]);
+    unlink(name);
+  }
+  rmdir(dir);
+}
+
+void test_lsm() {
+  char dir[] = "/tmp/blt_test.XXXXXX";
+  if (!mkdtemp(dir)) FAIL();
+  // A small memtable and cache, so there are many runs and merges.
+  BLT_LSM *lsm = blt_lsm_open(dir, 2048, 8192);
+  EXPECT(lsm);
+  if (!lsm) return;
+  BLT *want = blt_new();
+  char k[16], v[16];
+  srand(1);
+  F(i, 20000) {
+    sprintf(k, "%x", rand() % 3000);
+    if (rand() % 4) {
+      sprintf(v, "%d", i);
+      EXPECT(!blt_lsm_put(lsm, k, v));
+      int is_new;
+      BLT_IT *it = blt_setp(want, k, &is_new);
+      if (!is_new) free(it->data);
+      it->data = strdup(v);
+    } else {
+      EXPECT(!blt_lsm_delete(lsm, k));
+      BLT_IT *it = blt_get(want, k);
+      if (it) free(it->data);
+      blt_delete(want, k);
+    }
+  }
+  void check(BLT_LSM *lsm) {
+    BLT_IT *it = blt_first(want);
+    EXPECT(blt_lsm_range(lsm, "", 0, ({ int _(char *key, char *value) {
+      EXPECT(it && !strcmp(it->key, key) && !strcmp(it->data, value));
+      it = it ? blt_next(want, it) : 0;
+      return 1;
+    }_; })) == 1);
+    EXPECT(!it);
+    F(i, 3000) {
+      sprintf(k, "%x", i);
+      char *s = blt_lsm_get(lsm, k);
+      it = blt_get(want, k);
+      EXPECT(it ? s && !strcmp(s, it->data) : !s);
+      free(s);
+      // Probe between keys too.
+      strcat(k, i & 1 ? "0" : "");
+      char *key, *val;
+      F(way, 2) {
+        it = way ? blt_floor(want, k) : blt_ceil(want, k);
+        int r = (way ? blt_lsm_floor : blt_lsm_ceil)(lsm, k, &key, &val);
+        EXPECT(r == !!it);
+        if (r) {
+          EXPECT(it && !strcmp(key, it->key) && !strcmp(val, it->data));
+          free(key);
+          free(val);
+        }
+      }
+    }
+    // A range with an upper bound that stops early.
+    int n = 0;
+    EXPECT(blt_lsm_range(lsm, "2", "3", ({ int _(char *key, char *value) {
+      EXPECT(key[0] == '2');
+      return ++n < 10 ? 1 : 7;
+    }_; })) == 7);
+  }
+  check(lsm);
+  EXPECT(blt_lsm_runs(lsm) > 1 && blt_lsm_runs(lsm) < 20);
+  // Callbacks run without the lock, so they may use the tree.
+  int n = 0;
+  EXPECT(blt_lsm_range(lsm, "", 0, ({ int _(char *key, char *value) {
+    char *s = blt_lsm_get(lsm, key);
+    EXPECT(s && !strcmp(s, value));
+    free(s);
+    return ++n < 1000 ? 1 : 2;
+  }_; })) == 2);
+  blt_lsm_close(lsm);
+  lsm = blt_lsm_open(dir, 1 << 20, 1 << 20);
+  check(lsm);
+  blt_lsm_close(lsm);
+  blt_forall(want, ({ void _(BLT_IT *it) { free(it->data); }_; }));
+  blt_clear(want);
+
+  // Merging away the last key leaves no run, rather than an empty one.
+  char sub[64];
+  sprintf(sub, "%s/empty", dir);
+  lsm = blt_lsm_open(sub, 1 << 20, 1 << 20);
+  EXPECT(!blt_lsm_put(lsm, "a", "1") && !blt_lsm_flush(lsm));
+  EXPECT(!blt_lsm_delete(lsm, "a") && !blt_lsm_flush(lsm));
+  blt_lsm_close(lsm);
+  lsm = blt_lsm_open(sub, 1 << 20, 1 << 20);
+  EXPECT(!blt_lsm_get(lsm, "a") && !blt_lsm_runs(lsm));
+  char *key, *val;
+  EXPECT(!blt_lsm_ceil(lsm, "", &key, &val));
+  blt_lsm_close(lsm);
+
+  // A run with a corrupt index is rejected.
+  sprintf(sub, "%s/corrupt", dir);
+  lsm = blt_lsm_open(sub, 1 << 20, 1 << 20);
+  EXPECT(!blt_lsm_put(lsm, "a", "1") && !blt_lsm_flush(lsm));
+  blt_lsm_close(lsm);
+  char name[sizeof(sub) + 256] = "";
+  DIR *d = opendir(sub);
+  for (struct dirent *e; (e = readdir(d));) {
+    if (!strncmp(e->d_name, "run-", 4)) {
+      sprintf(name, "%s/%s", sub, e->d_name);
+    }
+  }
+  closedir(d);
+  int fd = open(name, O_RDWR);
+  EXPECT(fd >= 0);
+  off_t len = lseek(fd, 0, SEEK_END);
+  // The footer is the magic, then the index offset, nblocks and nkeys. The
+  // index holds one entry: the block offset, key length, and key "a".
+  uint64_t f[4], old[4];
+  EXPECT(pread(fd, f, 32, len - 32) == 32);
+  memcpy(old, f, 32);
+  EXPECT(f[1] + 13 + 32 == len && f[2] == 1);
+  uint64_t off = f[1];
+  uint32_t klen = 1;
+  uint64_t bad[][2] = { { 2, 0 }, { 2, 2 }, { 1, off - 1 }, { 1, 0 } };
+  void expect_bad() {
+    lsm = blt_lsm_open(sub, 1 << 20, 1 << 20);
+    EXPECT(!lsm && errno == EINVAL);
+    if (lsm) blt_lsm_close(lsm);
+  }
+  F(i, sizeof(bad) / sizeof(*bad)) {
+    f[bad[i][0]] = bad[i][1];
+    EXPECT(pwrite(fd, f, 32, len - 32) == 32);
+    expect_bad();
+    memcpy(f, old, 32);
+  }
+  EXPECT(pwrite(fd, f, 32, len - 32) == 32);
+  // A key running past the index, and a block past it.
+  klen = 2;
+  EXPECT(pwrite(fd, &klen, 4, off + 8) == 4);
+  expect_bad();
+  klen = 1;
+  EXPECT(pwrite(fd, &klen, 4, off + 8) == 4);
+  uint64_t past = off + 1;
+  EXPECT(pwrite(fd, &past, 8, off) == 8);
+  expect_bad();
+  past = 0;
+  EXPECT(pwrite(fd, &past, 8, off) == 8);
+  close(fd);
+  lsm = blt_lsm_open(sub, 1 << 20, 1 << 20);
+  EXPECT(lsm);
+  if (lsm) {
+    char *s = blt_lsm_get(lsm, "a");
+    EXPECT(s && !strcmp(s, "1"));
+    free(s);
+    blt_lsm_close(lsm);
+  }
+
+  char cmd[64];
+  sprintf(cmd, "rm -r %s", dir);
+  EXPECT(!system(cmd));
+}
+
+// An allocator that records the size of each block in front of it, so it
+// can check the tree frees blocks with the sizes it allocated them with.
+struct mem_s {
+  int live;
+  size_t bytes;
+};
+
+static void *mem_alloc(void *ctx, size_t n) {
+  struct mem_s *m = ctx;
+  size_t *p = malloc(n + 16);
+  *p = n;
+  m->live++;
+  m->bytes += n;
+  return (char *) p + 16;
+}
+
+static void mem_free(void *ctx, void *p, size_t n) {
+  struct mem_s *m = ctx;
+  size_t *q = (size_t *) ((char *) p - 16);
+  EXPECT(*q == n);
+  m->live--;
+  m->bytes -= n;
+  free(q);
+}
+
+void test_allocator() {
+  struct mem_s m = { 0 };
+  EXPECT(!blt_new_with_allocator(mem_alloc, 0, &m));
+  EXPECT(!blt_new_with_allocator(0, mem_free, &m));
+  BLT *blt = blt_new_with_allocator(mem_alloc, mem_free, &m);
+  char key[16];
+  F(i, 1000) sprintf(key, "%d", i), blt_put(blt, key, 0);
+  EXPECT(m.live == 1000 + 999 + 1);
+  F(i, 500) {
+    sprintf(key, "%d", 2 * i);
+    EXPECT(blt_delete(blt, key));
+  }
+  EXPECT(m.live == 500 + 499 + 1);
+  BLT *snap = blt_snapshot(blt);
+  // Copying the path waits until the tree is sure to change.
+  int live = m.live;
+  EXPECT(!blt_cas(blt, "1", (void *) 1, 0));
+  EXPECT(!blt_cas(blt, "0", 0, 0));
+  EXPECT(!blt_delete(blt, "0"));
+  EXPECT(m.live == live);
+  EXPECT(blt_cas(blt, "1", 0, (void *) 1));
+  EXPECT(m.live > live && !blt_get(snap, "1")->data);
+  F(i, 500) {
+    sprintf(key, "%d", 2 * i + 1);
+    EXPECT(blt_delete(blt, key));
+  }
+  EXPECT(blt_empty(blt) && blt_size(snap) == 500);
+  blt_put(blt, "new", 0);
+  blt_clear(snap);
+  EXPECT(m.live == 2);
+  F(i, 1000) sprintf(key, "%d", i), blt_put(blt, key, 0);
+  EXPECT(blt_delete_prefixed(blt, "1", 0) == 111);
+  EXPECT(blt_delete_range(blt, "5", "7", 0) == 222);
+  blt_clear(blt);
+  EXPECT(!m.live && !m.bytes);
+
+  // Garbage detached from a tree outlives it.
+  blt = blt_new_with_allocator(mem_alloc, mem_free, &m);
+  F(i, 1000) sprintf(key, "%d", i), blt_put(blt, key, 0);
+  BLT_GARBAGE *g = blt_clear_detach(blt);
+  while (blt_clear_step(g, 10));
+  EXPECT(!m.live && !m.bytes);
+}
+
+// Shards split by key, each with its own allocator.
+void test_sharded_split() {
+  char *bad[] = { "b", "a" };
+  EXPECT(!blt_sharded_new_split(3, bad));
+  char *split[] = { "b", "ba", "ba", "m" };
+  struct mem_s m[5] = { { 0 } };
+  void *ctx[5];
+  F(i, 5) ctx[i] = m + i;
+  BLT_SHARDED *s = blt_sharded_new_with_allocator(5, split, mem_alloc,
+      mem_free, ctx);
+  char *key[] = { "", "a", "azz", "b", "b0", "ba", "bab", "l", "m", "z" };
+  int shard[] = { 0, 0, 0, 1, 1, 3, 3, 3, 4, 4 };
+  F(i, 10) EXPECT(blt_sharded_put(s, key[i], (void *) (intptr_t) i));
+  // A leaf and a key for each key, and a pair for each key after the first.
+  int want[5] = { 0 };
+  F(i, 10) want[shard[i]]++;
+  F(i, 5) {
+    BLT_SHARD_STATS st;
+    blt_sharded_stats(s, i, &st);
+    EXPECT(st.keys == want[i]);
+    EXPECT(m[i].live == (want[i] ? 2 * want[i] : 0));
+  }
+  int n = 0;
+  blt_sharded_forall(s, ({void _(BLT_IT *it){
+    EXPECT(!strcmp(it->key, key[n++]));
+  }_;}));
+  EXPECT(n == 10);
+  // The prefix "b" spans three shards.
+  n = 0;
+  blt_sharded_allprefixed(s, "b", ({int _(BLT_IT *it){ return ++n, 1; }_;}));
+  EXPECT(n == 4);
+  char *k = blt_sharded_ceil(s, "c", 0);
+  EXPECT(!strcmp(k, "l"));
+  free(k);
+  k = blt_sharded_floor(s, "b", 0);
+  EXPECT(!strcmp(k, "b"));
+  free(k);
+  F(i, 10) EXPECT(blt_sharded_delete(s, key[i]));
+  blt_sharded_clear(s);
+  F(i, 5) EXPECT(!m[i].live && !m[i].bytes);
+}
+
 int main() {
   test_traverse("");
   test_traverse("one-string");
@@ -147,6 +1444,8 @@ int main() {
   }
   *c = 0;
   test_traverse(s);
+  test_deep();
+  test_first_diff();
 
   BLT *blt = make_blt("a aardvark b ben blink bliss blt blynn");
   check_prefix(blt, "b", "b ben blink bliss blt blynn");
@@ -161,5 +1460,26 @@ int main() {
   EXPECT(!strcmp(blt_floor(blt, "blink182")->key, "blink"));
   blt_clear(blt);
 
+  test_snapshot();
+  test_rcu();
+  test_concurrent(0);
+  test_concurrent(1);
+  test_sharded();
+  test_build();
+  test_parallel();
+  test_compound();
+  test_clear_step();
+  test_clear_deep();
+  test_bulk_delete();
+  test_allocator();
+  test_sharded_split();
+  test_image();
+  test_image_corrupt();
+  test_kv_corrupt();
+  test_shm();
+  test_kv();
+  test_lsm();
+  test_succinct();
+  test_export();
   return 0;
 }
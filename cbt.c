@@ -2,190 +2,481 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cbt.h"
+#include "first_diff.h"
 
 #define NDEBUG
 #include <assert.h>
 
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+
+#ifdef CBT_COMPACT
+// Nodes and leaves take 16 bytes each, and the kids of an internal node are
+// allocated together as an adjacent pair, as in BLT. There is no linked
+// list. The top bit of the first word tells them apart, since in a leaf it
+// is the top bit of the key pointer, which is clear.
+struct cbt_node_s {
+  int crit:32;
+  unsigned int mask:8;  // The crit bit within its byte.
+  unsigned int :23;
+  unsigned int is_internal:1;
+  struct cbt_node_s *kid;
+};
+
+struct cbt_leaf_s {
+  char *key;
+  void *data;
+};
+
+#define IS_EXT(p) (!(p)->is_internal)
+#define LEFT(p) ((p)->kid)
+#define RIGHT(p) ((p)->kid + 1)
+#else
 struct cbt_node_s {
-  short crit;
+  int crit;  // Fits in the padding before the pointers, like mask.
+  uint8_t mask;  // The crit bit within its byte.
   struct cbt_node_s *left, *right;
 };
-typedef struct cbt_node_s cbt_node_t[1];
-typedef struct cbt_node_s *cbt_node_ptr;
 
 struct cbt_leaf_s {
-  short crit;
+  int crit;
   void *data;
   char *key;
   struct cbt_leaf_s *prev, *next;
 };
+
+#define IS_EXT(p) (EXT == (p)->crit)
+#define LEFT(p) ((p)->left)
+#define RIGHT(p) ((p)->right)
+#define NEXT(p) LOAD((p)->next)
+#define PREV(p) LOAD((p)->prev)
+#endif
+typedef struct cbt_node_s cbt_node_t[1];
+typedef struct cbt_node_s *cbt_node_ptr;
 typedef struct cbt_leaf_s cbt_leaf_t[1];
 typedef struct cbt_leaf_s *cbt_leaf_ptr;
 
+#ifndef CBT_COMPACT
+enum { CBT_RCU_READERS = 128 };
+
+// RCU bookkeeping, much as in blt.c. Each reader records the epoch at its
+// last quiescent state, or 0 if it is offline. With a single writer, one
+// limbo list of memory waiting for readers to move on suffices.
+struct cbt_rcu_s {
+  uint64_t epoch;
+  int n, max;
+  struct {
+    void *p;
+    size_t n;               // Size of p, for the allocator.
+    uint64_t epoch;         // Writer's epoch when p was unlinked.
+  } *limbo;
+  struct {
+    uint64_t epoch;
+    int used;
+  } __attribute__((aligned(64))) reader[CBT_RCU_READERS];
+};
+#endif
+
+// Set by cbt_set_allocator(); both NULL for malloc().
+struct cbt_alloc_s {
+  void *(*alloc)(void *ctx, size_t n);
+  void (*dealloc)(void *ctx, void *p, size_t n);
+  void *ctx;
+};
+
 struct cbt_s {
   int count;
   cbt_node_ptr root;
+#ifndef CBT_COMPACT
   struct cbt_leaf_s *first, *last;
-  void *(*dup)(cbt_t, const void *);
-  int (*getlen)(cbt_t, const void *);
-  int (*cmp)(cbt_t, const void *, const void *);
-  int (*getcrit)(cbt_t, const void *, const void *);
+  struct cbt_rcu_s *rcu;    // Non-NULL for trees with concurrent readers.
+#endif
+  // Operations specialised for the kind of key; see cbt_mode.h.
+  cbt_it (*at)(cbt_t, const void *);
+  int (*insert_with)(cbt_it *, cbt_t, void *(*)(void *), const void *);
+  void *(*remove)(cbt_t, const void *);
+  int (*keylen)(cbt_t, const void *);
+#ifndef CBT_COMPACT
+  cbt_it (*seek)(cbt_t, const void *, int);
+  int (*range)(cbt_t, const void *, const void *, int (*)(cbt_it));
+#endif
   int len;
+  struct cbt_alloc_s mem;
 };
 
+static inline void *mem_alloc(cbt_t cbt, size_t n) {
+  return cbt->mem.alloc ? cbt->mem.alloc(cbt->mem.ctx, n) : malloc(n);
+}
+
+static inline void mem_free(cbt_t cbt, void *p, size_t n) {
+  if (cbt->mem.dealloc) cbt->mem.dealloc(cbt->mem.ctx, p, n); else free(p);
+}
+
+// Zero unless dealloc() wants it.
+static inline size_t key_size(cbt_t cbt, const void *key) {
+  return cbt->mem.dealloc ? cbt->keylen(cbt, key) : 0;
+}
+
+static inline void free_key(cbt_t cbt, void *key) {
+  mem_free(cbt, key, key_size(cbt, key));
+}
+
 enum { EXT = -1 };
 
-void cbt_node_free(cbt_node_ptr t) {
+// Number of nodes on a path from the root that insertions remember.
+enum { CBT_PATH = 64 };
+
+#ifdef CBT_COMPACT
+// Frees the subtrees of a node, calling fn on each leaf in order if fn is
+// not NULL. As below, we rotate left kids up rather than recursing; here
+// the pair of the left kid takes the old node as its right half.
+static void clear_kids(cbt_t cbt, struct cbt_node_s n,
+    void (*fn)(void *, const void *)) {
+  while (n.is_internal) {
+    cbt_node_ptr q = n.kid;
+    if (q[0].is_internal) {
+      struct cbt_node_s l = q[0];
+      q[0] = l.kid[1];
+      l.kid[1] = n;
+      n = l;
+      continue;
+    }
+    cbt_leaf_ptr leaf = (cbt_leaf_ptr) q;
+    if (fn) fn(leaf->data, leaf->key);
+    free_key(cbt, leaf->key);
+    n = q[1];
+    mem_free(cbt, q, 2 * sizeof(*q));
+  }
+  cbt_leaf_ptr leaf = (cbt_leaf_ptr) &n;
+  if (fn) fn(leaf->data, leaf->key);
+  free_key(cbt, leaf->key);
+}
+
+static void clear_with(cbt_t cbt, cbt_node_ptr t,
+    void (*fn)(void *, const void *)) {
   if (!t) return;
-  if (EXT == t->crit) {
-    free(((cbt_leaf_ptr) t)->key);
-  } else {
-    cbt_node_free(t->left), cbt_node_free(t->right);
+  clear_kids(cbt, *t, fn);
+  mem_free(cbt, t, sizeof(*t));
+}
+#else
+// Frees a subtree, calling fn on each leaf in order if fn is not NULL.
+// Rather than recursing, we rotate left kids up until the left kid is a
+// leaf, so deep trees cannot overflow the stack.
+static void clear_with(cbt_t cbt, cbt_node_ptr t,
+    void (*fn)(void *, const void *)) {
+  while (t) {
+    cbt_node_ptr p = t;
+    if (EXT != t->crit) {
+      p = t->left;
+      if (EXT != p->crit) {
+        t->left = p->right;
+        p->right = t;
+        t = p;
+        continue;
+      }
+    }
+    cbt_leaf_ptr leaf = (cbt_leaf_ptr) p;
+    if (fn) fn(leaf->data, leaf->key);
+    free_key(cbt, leaf->key);
+    mem_free(cbt, leaf, sizeof(cbt_leaf_t));
+    if (p == t) return;
+    p = t->right;
+    mem_free(cbt, t, sizeof(cbt_node_t));
+    t = p;
   }
-  free(t);
 }
 
+#endif
+
 static void cbt_init(cbt_t cbt) {
   cbt->count = 0;
   cbt->root = 0;
+#ifndef CBT_COMPACT
   cbt->first = cbt->last = 0;
+  cbt->rcu = 0;
+#endif
+  cbt->mem = (struct cbt_alloc_s) { 0 };
 }
 
-static int getcrit(cbt_t unused, const void *key0, const void *key1) {
-  const char *c0 = key0, *c1 = key1;
-  int bit;
-
-  while(*c0 == *c1) {
-    if (!*c0) return 0;
-    c0++, c1++;
+// Readers load the root and list ends once per operation, as the writer of
+// an RCU tree may replace them at any time. The writer links in new nodes
+// only after filling them in, so as in blt.c, readers follow links within
+// the tree with plain loads: atomic ones slow lookups by 15%. The list is
+// loaded atomically, as scans step along it a leaf at a time anyway.
+static inline cbt_node_ptr get_root(cbt_t cbt) { return LOAD(cbt->root); }
+
+#define PUBLISH(slot, p) __atomic_store_n(&(slot), (p), __ATOMIC_RELEASE)
+
+#ifndef CBT_COMPACT
+// Frees everything in the limbo list unlinked before the oldest quiescent
+// state of any reader.
+static void rcu_reclaim(cbt_t cbt) {
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  uint64_t min = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < CBT_RCU_READERS; i++) {
+    uint64_t e = __atomic_load_n(&rcu->reader[i].epoch, __ATOMIC_ACQUIRE);
+    if (e && e < min) min = e;
   }
+  int k = 0;
+  for (int i = 0; i < rcu->n; i++) {
+    if (rcu->limbo[i].epoch < min) {
+      mem_free(cbt, rcu->limbo[i].p, rcu->limbo[i].n);
+    } else {
+      rcu->limbo[k++] = rcu->limbo[i];
+    }
+  }
+  rcu->n = k;
+}
 
-  char c = *c0 ^ *c1;
-  for (bit = 7; !(c >> bit); bit--);
-  // Subtract bit from 7 because we number them the other way.
-  // Add 1 because we want to use the sign as an extra bit of information.
-  // We'll subtract 1 from it later.
-  int crit = ((c0 - (const char *) key0) << 3) + 7 - bit + 1;
-  if ((*c0 >> bit) & 1) return crit;
-  return -crit;
+// Frees n bytes at p the writer has unlinked, once readers can no longer
+// hold them.
+static void retire(cbt_t cbt, void *p, size_t n) {
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  if (!rcu) {
+    mem_free(cbt, p, n);
+    return;
+  }
+  if (rcu->n == rcu->max) {
+    rcu_reclaim(cbt);
+    // Only grow the list if slow readers are holding on to most of it.
+    if (rcu->n >= rcu->max / 2) {
+      rcu->max = rcu->max ? 2 * rcu->max : 1024;
+      rcu->limbo = realloc(rcu->limbo, rcu->max * sizeof(*rcu->limbo));
+    }
+  }
+  rcu->limbo[rcu->n].p = p;
+  rcu->limbo[rcu->n].n = n;
+  rcu->limbo[rcu->n].epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+  rcu->n++;
 }
 
-static int cmp(cbt_t unused, const void *key0, const void *key1) {
-  return strcmp(key0, key1);
+int cbt_rcu_enable(cbt_t cbt) {
+  struct cbt_rcu_s *rcu;
+  if (posix_memalign((void **) &rcu, 64, sizeof(*rcu))) return 0;
+  memset(rcu, 0, sizeof(*rcu));
+  rcu->epoch = 1;
+  cbt->rcu = rcu;
+  return 1;
 }
 
-static int getlen(cbt_t unused, const void *key) {
-  // The terminating NUL counts as part of the key, though when in doubt we
-  // take the left branch so it works without the "+ 1".
-  return strlen(key) + 1;
+int cbt_rcu_register(cbt_t cbt) {
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  for (int i = 0; i < CBT_RCU_READERS; i++) {
+    if (__atomic_exchange_n(&rcu->reader[i].used, 1, __ATOMIC_SEQ_CST)) {
+      continue;
+    }
+    cbt_rcu_quiescent(cbt, i);
+    // Pairs with the fence in rcu_reclaim(): either the writer sees we are
+    // online, or we see everything it unlinked before freeing it.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return i;
+  }
+  return -1;
 }
 
-static void *dup(cbt_t unused, const void *key) { return strdup(key); }
+void cbt_rcu_quiescent(cbt_t cbt, int reader) {
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  __atomic_store_n(&rcu->reader[reader].epoch,
+      __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
 
-cbt_t cbt_new(void) {
-  cbt_t res = malloc(sizeof(*res));
-  cbt_init(res);
-  res->len = 0;
-  res->cmp = cmp;
-  res->dup = dup;
-  res->getlen = getlen;
-  res->getcrit = getcrit;
-  return res;
+void cbt_rcu_unregister(cbt_t cbt, int reader) {
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  __atomic_store_n(&rcu->reader[reader].epoch, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&rcu->reader[reader].used, 0, __ATOMIC_RELEASE);
 }
+#endif
 
-static int getcrit_u(cbt_t cbt, const void *key0, const void *key1) {
-  const char *cp0 = key0, *limit = key0 + cbt->len, *cp1 = key1;
+static inline int testbit(const void *key, cbt_node_ptr p) {
+  return ((const uint8_t *) key)[p->crit >> 3] & p->mask;
+}
 
-  for(;;) {
-    if (cp0 == limit) return 0;
-    if (*cp0 != *cp1) break;
-    cp0++, cp1++;
-  }
+// Returns the crit bit of the first n bytes of two keys.
+static inline int getcrit_n(const void *key0, const void *key1, int n) {
+  int i = first_diff_n(key0, key1, n);
+  if (i == n) return 0;
+  const char *cp0 = key0 + i, *cp1 = key1 + i;
 
-  int bit;
-  char c = *cp0 ^ *cp1;
-  for (bit = 7; !(c >> bit); bit--);
+  int bit = 31 - __builtin_clz((uint8_t) (*cp0 ^ *cp1));
   // Subtract bit from 7 because we number them the other way.
   // Add 1 because we want to use the sign as an extra bit of information.
   // We'll subtract 1 from it later.
-  int crit = ((cp0 - (const char *) key0) << 3) + 7 - bit + 1;
-  if ((*cp0 >> bit) & 1) return crit;
-  return -crit;
+  int crit = (i << 3) + 7 - bit + 1;
+  return (*cp0 >> bit) & 1 ? crit : -crit;
 }
 
-static int cmp_u(cbt_t cbt, const void *key0, const void *key1) {
-  return memcmp(key0, key1, cbt->len);
+static inline void *dup_n(cbt_t cbt, const void *key, int n) {
+  void *res = mem_alloc(cbt, n);
+  memcpy(res, key, n);
+  return res;
 }
 
-static void *dup_u(cbt_t cbt, const void *key) {
-  void *res = malloc(cbt->len);
-  memcpy(res, key, cbt->len);
-  return res;
+static inline char *dup_str(cbt_t cbt, const char *key) {
+  if (!cbt->mem.alloc) return strdup(key);
+  return dup_n(cbt, key, strlen(key) + 1);
 }
 
-static int getlen_u(cbt_t cbt, const void *unused) { return cbt->len; }
+static inline int getcrit(cbt_t unused, const void *key0, const void *key1) {
+  const char *c0 = key0, *c1 = key1;
+  c0 += first_diff(c0, c1);
+  c1 += c0 - (const char *) key0;
+  if (*c0 == *c1) return 0;
 
-cbt_t cbt_new_u(int len) {
-  cbt_t res = malloc(sizeof(*res));
-  cbt_init(res);
-  res->len = len;
-  res->cmp = cmp_u;
-  res->getlen = getlen_u;
-  res->dup = dup_u;
-  res->getcrit = getcrit_u;
-  return res;
+  int bit = 31 - __builtin_clz((uint8_t) (*c0 ^ *c1));
+  // Subtract bit from 7 because we number them the other way.
+  // Add 1 because we want to use the sign as an extra bit of information.
+  // We'll subtract 1 from it later.
+  int crit = ((c0 - (const char *) key0) << 3) + 7 - bit + 1;
+  if ((*c0 >> bit) & 1) return crit;
+  return -crit;
+}
+
+static inline int getlen(cbt_t unused, const void *key) {
+  // The terminating NUL counts as part of the key, though when in doubt we
+  // take the left branch so it works without the "+ 1".
+  return strlen(key) + 1;
 }
 
-static int getlen_enc(cbt_t unused, const void *key) {
+#define MODE str
+#define KEYLEN getlen
+#define CMP(cbt, k0, k1) strcmp(k0, k1)
+#define DUP(cbt, k) dup_str(cbt, k)
+#define GETCRIT getcrit
+#include "cbt_mode.h"
+
+// "u" mode, for any length, and for common lengths known at compile time.
+#define MODE u
+#define KEYLEN(cbt, k) (cbt)->len
+#define CMP(cbt, k0, k1) memcmp(k0, k1, (cbt)->len)
+#define DUP(cbt, k) dup_n(cbt, k, (cbt)->len)
+#define GETCRIT(cbt, k0, k1) getcrit_n(k0, k1, (cbt)->len)
+#include "cbt_mode.h"
+
+#define MODE u8
+#define KEYLEN(cbt, k) 8
+#define CMP(cbt, k0, k1) memcmp(k0, k1, 8)
+#define DUP(cbt, k) dup_n(cbt, k, 8)
+#define GETCRIT(cbt, k0, k1) getcrit_n(k0, k1, 8)
+#include "cbt_mode.h"
+
+#define MODE u16
+#define KEYLEN(cbt, k) 16
+#define CMP(cbt, k0, k1) memcmp(k0, k1, 16)
+#define DUP(cbt, k) dup_n(cbt, k, 16)
+#define GETCRIT(cbt, k0, k1) getcrit_n(k0, k1, 16)
+#include "cbt_mode.h"
+
+#define MODE u20
+#define KEYLEN(cbt, k) 20
+#define CMP(cbt, k0, k1) memcmp(k0, k1, 20)
+#define DUP(cbt, k) dup_n(cbt, k, 20)
+#define GETCRIT(cbt, k0, k1) getcrit_n(k0, k1, 20)
+#include "cbt_mode.h"
+
+#define MODE u32
+#define KEYLEN(cbt, k) 32
+#define CMP(cbt, k0, k1) memcmp(k0, k1, 32)
+#define DUP(cbt, k) dup_n(cbt, k, 32)
+#define GETCRIT(cbt, k0, k1) getcrit_n(k0, k1, 32)
+#include "cbt_mode.h"
+
+// Returns the size of an enc key, including its length.
+static inline int size_enc(const void *key) {
   const uint8_t *u = (const uint8_t *) key;
-  return *u + (u[1] << 8);
+  int n = *u + (u[1] << 8);
+  if (n < 0xffff) return n + 2;
+  return (u[2] | u[3] << 8 | u[4] << 16 | (uint32_t) u[5] << 24) + 6;
 }
 
-static int cmp_enc(cbt_t cbt, const void *key0, const void *key1) {
-  int len = getlen_enc(0, key0);
-  return getlen_enc(0, key1) != len ? 1 : memcmp(key0, key1, len + 2);
+static inline int cmp_enc(const void *key0, const void *key1) {
+  int n = size_enc(key0);
+  return size_enc(key1) != n ? 1 : memcmp(key0, key1, n);
 }
 
-static void *dup_enc(cbt_t cbt, const void *key) {
-  int len = getlen_enc(0, key) + 2;
-  void *res = malloc(len);
-  memcpy(res, key, len);
-  return res;
+// Keys of different lengths differ within the length headers, which both
+// keys contain, so we need only compare up to the end of the shorter key.
+static inline int getcrit_enc(const void *key0, const void *key1) {
+  int n = size_enc(key0), n1 = size_enc(key1);
+  return getcrit_n(key0, key1, n < n1 ? n : n1);
 }
 
-static int getcrit_enc(cbt_t cbt, const void *key0, const void *key1) {
-  int n = getlen_enc(0, key0), n1 = getlen_enc(0, key1);
-  if (n > n1) n = n1;
-  const char *cp0 = key0, *limit = key0 + n + 2, *cp1 = key1;
+// Keys are compared in full, including their lengths.
+#define MODE enc
+#define KEYLEN(cbt, k) size_enc(k)
+#define CMP(cbt, k0, k1) cmp_enc(k0, k1)
+#define DUP(cbt, k) dup_n(cbt, k, size_enc(k))
+#define GETCRIT(cbt, k0, k1) getcrit_enc(k0, k1)
+#include "cbt_mode.h"
+
+#ifdef CBT_COMPACT
+#define USE_MODE(cbt, mode) \
+  ((cbt)->at = at_##mode, (cbt)->insert_with = insert_with_##mode, \
+   (cbt)->remove = remove_##mode, (cbt)->keylen = keylen_##mode)
+#else
+#define USE_MODE(cbt, mode) \
+  ((cbt)->at = at_##mode, (cbt)->insert_with = insert_with_##mode, \
+   (cbt)->remove = remove_##mode, (cbt)->keylen = keylen_##mode, \
+   (cbt)->seek = seek_##mode, (cbt)->range = range_##mode)
+#endif
 
-  for(;;) {
-    if (cp0 == limit) return 0;
-    if (*cp0 != *cp1) break;
-    cp0++, cp1++;
-  }
+cbt_t cbt_new(void) {
+  cbt_t res = malloc(sizeof(*res));
+  cbt_init(res);
+  res->len = 0;
+  USE_MODE(res, str);
+  return res;
+}
 
-  int bit;
-  char c = *cp0 ^ *cp1;
-  for (bit = 7; !(c >> bit); bit--);
-  // Subtract bit from 7 because we number them the other way.
-  // Add 1 because we want to use the sign as an extra bit of information.
-  // We'll subtract 1 from it later.
-  int crit = ((cp0 - (const char *) key0) << 3) + 7 - bit + 1;
-  return (*cp0 >> bit) & 1 ? crit : -crit;
+cbt_t cbt_new_u(int len) {
+  cbt_t res = malloc(sizeof(*res));
+  cbt_init(res);
+  res->len = len;
+  switch (len) {
+    case 8: USE_MODE(res, u8); break;
+    case 16: USE_MODE(res, u16); break;
+    case 20: USE_MODE(res, u20); break;
+    case 32: USE_MODE(res, u32); break;
+    default: USE_MODE(res, u);
+  }
+  return res;
 }
 
 cbt_t cbt_new_enc() {
   cbt_t res = malloc(sizeof(*res));
   cbt_init(res);
   res->len = 0;
-  res->cmp = cmp_enc;
-  res->getlen = getlen_enc;
-  res->dup = dup_enc;
-  res->getcrit = getcrit_enc;
+  USE_MODE(res, enc);
   return res;
 }
 
-static void cbt_clear(cbt_t cbt) { cbt_node_free(cbt->root); }
+int cbt_set_allocator(cbt_t cbt, void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx) {
+  if (cbt->root || !alloc != !dealloc) return 0;
+  cbt->mem = (struct cbt_alloc_s) { alloc, dealloc, ctx };
+  return 1;
+}
+
+cbt_t cbt_new_with_allocator(void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx) {
+  if (!alloc != !dealloc) return 0;
+  cbt_t res = cbt_new();
+  cbt_set_allocator(res, alloc, dealloc, ctx);
+  return res;
+}
+
+static void cbt_clear(cbt_t cbt) {
+  clear_with(cbt, cbt->root, 0);
+#ifndef CBT_COMPACT
+  struct cbt_rcu_s *rcu = cbt->rcu;
+  if (rcu) {
+    for (int i = 0; i < rcu->n; i++) {
+      mem_free(cbt, rcu->limbo[i].p, rcu->limbo[i].n);
+    }
+    free(rcu->limbo);
+    free(rcu);
+  }
+#endif
+}
 
 void cbt_delete(cbt_t cbt) {
   cbt_clear(cbt);
@@ -193,115 +484,47 @@ void cbt_delete(cbt_t cbt) {
 }
 
 int cbt_size(cbt_t cbt) { return cbt->count; }
-cbt_it cbt_first(cbt_t cbt) { return cbt->first; }
-cbt_it cbt_last(cbt_t cbt) { return cbt->last; }
-cbt_it cbt_next(cbt_it it) { return it->next; }
-void cbt_put(cbt_it it, void *data) { it->data = data; }
-void *cbt_get(cbt_it it) { return it->data; }
-char *cbt_key(cbt_it it) { return it->key; }
-
-static int testbit(const void *key, int bit) {
-  // The most significant bit is 0, and the least 7.
-  return (1 << (7 - (bit & 7))) & ((const char *) key)[bit >> 3];
+#ifdef CBT_COMPACT
+cbt_it cbt_first(cbt_t cbt) {
+  cbt_node_ptr p = cbt->root;
+  if (p) while (!IS_EXT(p)) p = LEFT(p);
+  return (cbt_leaf_ptr) p;
 }
 
-cbt_it cbt_at(cbt_t cbt, const void *key) {
-  if (!cbt->root) return 0;
-  int len = (cbt->getlen(cbt, key) << 3) - 1;
+cbt_it cbt_last(cbt_t cbt) {
   cbt_node_ptr p = cbt->root;
-  for (;;) {
-    if (EXT == p->crit) break;
-    if (len < p->crit) {
-      do p = p->left; while (EXT != p->crit);
-      break;
-    }
-    p = testbit(key, p->crit) ? p->right : p->left;
-  }
-  if (!cbt->cmp(cbt, ((cbt_leaf_ptr) p)->key, key)) return (cbt_leaf_ptr) p;
-  return 0;
+  if (p) while (!IS_EXT(p)) p = RIGHT(p);
+  return (cbt_leaf_ptr) p;
+}
+#else
+cbt_it cbt_first(cbt_t cbt) { return LOAD(cbt->first); }
+cbt_it cbt_last(cbt_t cbt) { return LOAD(cbt->last); }
+cbt_it cbt_next(cbt_it it) { return NEXT(it); }
+cbt_it cbt_prev(cbt_it it) { return PREV(it); }
+
+cbt_it cbt_ceil(cbt_t cbt, const void *key) { return cbt->seek(cbt, key, 0); }
+cbt_it cbt_floor(cbt_t cbt, const void *key) { return cbt->seek(cbt, key, 1); }
+
+int cbt_range(cbt_t cbt, const void *lo, const void *hi, int (*fn)(cbt_it)) {
+  return cbt->range(cbt, lo, hi, fn);
 }
+#endif
+void cbt_put(cbt_it it, void *data) { it->data = data; }
+void *cbt_get(cbt_it it) { return LOAD(it->data); }
+char *cbt_key(cbt_it it) { return it->key; }
+
+cbt_it cbt_at(cbt_t cbt, const void *key) { return cbt->at(cbt, key); }
 
 int cbt_has(cbt_t cbt, const void *key) { return cbt_at(cbt, key) != 0; }
 
 void *cbt_get_at(cbt_t cbt, const void *key) {
   cbt_leaf_ptr p = cbt_at(cbt, key);
   if (!p) return 0;
-  return p->data;
+  return LOAD(p->data);
 }
 
 int cbt_insert_with(cbt_it *it, cbt_t cbt, void *(*fn)(void *), const void *key) {
-  if (!cbt->root) {
-    cbt_leaf_ptr leaf = malloc(sizeof(cbt_leaf_t));
-    leaf->crit = EXT, leaf->data = fn(0), leaf->key = cbt->dup(cbt, key);
-    cbt->root = (cbt_node_ptr) leaf;
-    cbt->first = cbt->last = leaf;
-    leaf->next = leaf->prev = 0;
-    cbt->count++;
-    return *it = leaf, 1;
-  }
-
-  cbt_node_ptr t = cbt->root;
-  int keylen = (cbt->getlen(cbt, key) << 3) - 1;
-
-  while (EXT != t->crit) {
-    // If the key is shorter than the remaining keys on this subtree, we can
-    // compare it against any of them (and are guaranteed the new node must be
-    // inserted above this node). We simply let it follow the rightmost path.
-    t = keylen < t->crit || testbit(key, t->crit) ? t->right : t->left;
-  }
-
-  cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
-  int res = cbt->getcrit(cbt, key, leaf->key);
-  if (!res) {
-    leaf->data = fn(leaf->data);
-    return *it = leaf, 0;
-  }
-
-  cbt->count++;
-  cbt_leaf_ptr pleaf = malloc(sizeof(cbt_leaf_t));
-  cbt_node_ptr pnode = malloc(sizeof(cbt_node_t));
-  pleaf->crit = EXT, pleaf->data = fn(0), pleaf->key = cbt->dup(cbt, key);
-  pnode->crit = abs(res) - 1;
-
-  cbt_node_ptr t0 = 0, t1 = cbt->root;
-  while(EXT != t1->crit && pnode->crit > t1->crit) {
-    t0 = t1, t1 = testbit(key, t1->crit) ? t1->right : t1->left;
-  }
-
-  if (res > 0) {
-    // Key is bigger, therefore it goes on the right.
-    pnode->left = t1;
-    pnode->right = (cbt_node_ptr) pleaf;
-    // The rightmost child of the left subtree must be the predecessor.
-    for (t = pnode->left; t->crit != EXT; t = t->right);
-    cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
-    pleaf->next = leaf->next;
-    pleaf->prev = leaf;
-    if (leaf->next) leaf->next->prev = pleaf;
-    else cbt->last = pleaf;
-    leaf->next = pleaf;
-  } else {
-    // Key is smaller, therefore it goes on the left.
-    pnode->left = (cbt_node_ptr) pleaf;
-    pnode->right = t1;
-    // The leftmost child of the right subtree must be the successor.
-    for (t = pnode->right; t->crit != EXT; t = t->left);
-    cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
-    pleaf->prev = leaf->prev;
-    pleaf->next = leaf;
-    if (leaf->prev) leaf->prev->next = pleaf;
-    else cbt->first = pleaf;
-    leaf->prev = pleaf;
-  }
-
-  if (!t0) {
-    cbt->root = pnode;
-  } else if (t0->left == t1) {
-    t0->left = pnode;
-  } else {
-    t0->right = pnode;
-  }
-  return *it = pleaf, 1;
+  return cbt->insert_with(it, cbt, fn, key);
 }
 
 cbt_it cbt_put_with(cbt_t cbt, void *(*fn)(void *), const void *key) {
@@ -316,59 +539,17 @@ cbt_it cbt_put_at(cbt_t cbt, void *data, const void *key) {
 }
 
 void *cbt_remove(cbt_t cbt, const void *key) {
-  assert(cbt->root);
-  assert(cbt_has(cbt, key));
-  cbt_node_ptr t0 = 0, t00 = 0, t = cbt->root;
-  while (EXT != t->crit) {
-    assert((cbt->getlen(cbt, key) << 3) - 1 >= t->crit);
-    t00 = t0, t0 = t, t = testbit(key, t->crit) ? t->right : t->left;
-  }
-  cbt->count--;
-  cbt_leaf_ptr p = (cbt_leaf_ptr) t;
-  if (!t0) {
-    cbt->root = 0;
-  } else {
-    cbt_node_ptr sibling = t0->left == t ? t0->right : t0->left;
-    if (!t00) {  // One-level down: reassign root.
-      cbt->root = sibling;
-    } else {  // Reassign grandparent.
-      if (t00->left == t0) {
-        t00->left = sibling;
-      } else {
-        t00->right = sibling;
-      }
-    }
-    free(t0);
-  }
-  if (p->next) p->next->prev = p->prev;
-  else cbt->last = p->prev;
-  if (p->prev) p->prev->next = p->next;
-  else cbt->first = p->next;
-  free(p->key);
-  void *data = p->data;
-  free(p);
-  return data;
-}
-
-static void clear_recurse(cbt_node_ptr t, void (*fn)(void *, const void *)) {
-  if (EXT == t->crit) {
-    cbt_leaf_ptr p = (cbt_leaf_ptr) t;
-    if (fn) fn(p->data, p->key);
-    free(p->key);
-    free(p);
-    return;
-  }
-  clear_recurse(t->left, fn);
-  clear_recurse(t->right, fn);
-  free(t);
+  return cbt->remove(cbt, key);
 }
 
 void cbt_remove_all_with(cbt_t cbt, void (*fn)(void *data, const void *key)) {
   if (cbt->root) {
-    clear_recurse(cbt->root, fn);
+    clear_with(cbt, cbt->root, fn);
     cbt->root = 0;
     cbt->count = 0;
+#ifndef CBT_COMPACT
     cbt->first = cbt->last = 0;
+#endif
   }
 }
 
@@ -376,19 +557,52 @@ void cbt_remove_all(cbt_t cbt) {
   if (cbt->root) cbt_remove_all_with(cbt, 0);
 }
 
+#ifdef CBT_COMPACT
+// Without the list, we keep the right kids still to visit on a stack, which
+// moves to the heap if the tree is deeper than a path usually is.
+void cbt_forall(cbt_t cbt, void (*fn)(cbt_it)) {
+  cbt_node_ptr path[CBT_PATH], *todo = path, p = cbt->root;
+  int n = 0, max = CBT_PATH;
+  while (p) {
+    for (; !IS_EXT(p); p = LEFT(p)) {
+      if (n == max) {
+        cbt_node_ptr *t = malloc(2 * max * sizeof(*t));
+        memcpy(t, todo, n * sizeof(*t));
+        if (todo != path) free(todo);
+        todo = t;
+        max *= 2;
+      }
+      todo[n++] = RIGHT(p);
+    }
+    fn((cbt_leaf_ptr) p);
+    p = n ? todo[--n] : 0;
+  }
+  if (todo != path) free(todo);
+}
+
+void cbt_forall_at(cbt_t cbt, void (*fn)(void *data, const void *key)) {
+  void f(cbt_it it) { fn(it->data, it->key); }
+  cbt_forall(cbt, f);
+}
+#else
 void cbt_forall(cbt_t cbt, void (*fn)(cbt_it)) {
   cbt_leaf_ptr p;
-  for (p = cbt->first; p; p = p->next) fn(p);
+  for (p = cbt_first(cbt); p; p = NEXT(p)) fn(p);
 }
 
 void cbt_forall_at(cbt_t cbt, void (*fn)(void *data, const void *key)) {
   cbt_leaf_ptr p;
-  for (p = cbt->first; p; p = p->next) fn(p->data, p->key);
+  for (p = cbt_first(cbt); p; p = NEXT(p)) fn(LOAD(p->data), p->key);
 }
+#endif
 
 size_t cbt_overhead(cbt_t cbt) {
   size_t n = sizeof(struct cbt_s);
   if (!cbt->root) return n;
+#ifdef CBT_COMPACT
+  // The root takes one node and every other node is half of a pair.
+  n += (2 * cbt->count - 1) * sizeof(struct cbt_node_s);
+#else
   void add(cbt_node_ptr p) {
     if (p->crit == EXT) {
       n += sizeof(struct cbt_leaf_s);
@@ -399,5 +613,6 @@ size_t cbt_overhead(cbt_t cbt) {
     }
   }
   add(cbt->root);
+#endif
   return n;
 }
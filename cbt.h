@@ -4,10 +4,16 @@
 // Uses pointer casting and different structs instead of unions.
 // In a trie, internal nodes never become external nodes, and vice versa.
 //
-// Removing linked list code and data saves a little.
+// Removing linked list code and data saves a little. Build with CBT_COMPACT
+// defined to do so: nodes then take 16 bytes, and kids are allocated in
+// adjacent pairs as in BLT. Such trees lack cbt_next(), cbt_prev() and the
+// ordered seeks that step along the list, and inserts and removals may move
+// leaves, invalidating cbt_it values obtained earlier.
 
 #define __CBT_H__
 
+#include <stddef.h>
+
 struct cbt_s;
 typedef struct cbt_s *cbt_t;
 
@@ -16,6 +22,7 @@ struct cbt_leaf_s;
 typedef struct cbt_leaf_s *cbt_it;
 
 // Never mix keys from different types of trees.
+// Keys may be up to 256 MB long.
 
 // Default: ASCIIZ keys.
 cbt_t cbt_new(void);
@@ -25,11 +32,53 @@ cbt_t cbt_new(void);
 cbt_t cbt_new_u(int len);
 
 // "enc" mode: First 2 bytes encode length of remaining data. First byte
-// is the least significant.
+// is the least significant. Lengths of 0xffff and more are escaped: the
+// first 2 bytes are 0xff, and the next 4 encode the length in the same way.
 cbt_t cbt_new_enc();
 
+// As cbt_new(), but nodes, leaves and keys come from alloc(ctx, n), and go
+// back through dealloc(ctx, p, n) with the same n. Blocks need pointer
+// alignment. Both functions or neither: NULL if only one is given.
+// The tree itself and its RCU bookkeeping still use malloc().
+cbt_t cbt_new_with_allocator(void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx);
+
+// Gives an empty tree of any kind the allocator above.
+// Returns 0 and leaves the tree alone if it holds keys, or if only one
+// function is given.
+int cbt_set_allocator(cbt_t cbt, void *(*alloc)(void *ctx, size_t n),
+    void (*dealloc)(void *ctx, void *p, size_t n), void *ctx);
+
 void cbt_delete(cbt_t cbt);
 
+#ifndef CBT_COMPACT
+// Lets many threads read the tree while one thread modifies it, without
+// locks. Call before any reader registers. Returns 0 if out of memory.
+//
+// Readers may call cbt_at(), cbt_has(), cbt_get_at(), cbt_first(),
+// cbt_last(), cbt_next(), cbt_prev(), cbt_ceil(), cbt_floor(), cbt_range(),
+// cbt_forall() and cbt_forall_at(), along with the accessors of cbt_it.
+// A reader first calls cbt_rcu_register(), and then must call
+// cbt_rcu_quiescent() regularly, at points where it holds no cbt_it values.
+// Entries obtained by a reader remain valid, though possibly outdated or
+// removed, until its next quiescent state: stepping from a removed entry
+// still leads back into the tree, though it may miss keys inserted since.
+// Memory the writer removes is freed once all readers have passed through a
+// quiescent state, except that cbt_remove_all() and cbt_delete() free
+// everything at once and must not race with readers.
+int cbt_rcu_enable(cbt_t cbt);
+
+// Registers the calling thread as a reader. Returns a handle for the
+// functions below, or -1 if there are too many readers.
+int cbt_rcu_register(cbt_t cbt);
+
+// Announces that the given reader holds no entries of the tree.
+void cbt_rcu_quiescent(cbt_t cbt, int reader);
+
+// Unregisters a reader. It must not access the tree until it registers again.
+void cbt_rcu_unregister(cbt_t cbt, int reader);
+#endif
+
 void *cbt_get_at(cbt_t cbt, const void *key);
 cbt_it cbt_put_at(cbt_t cbt, void *data, const void *key);
 
@@ -39,7 +88,22 @@ static inline int cbt_is_off(cbt_it it) { return !it; }
 
 cbt_it cbt_first(cbt_t cbt);
 cbt_it cbt_last(cbt_t cbt);
+#ifndef CBT_COMPACT
 cbt_it cbt_next(cbt_it it);
+cbt_it cbt_prev(cbt_it it);
+
+// Returns the entry with the least key at least the given key, or NULL.
+cbt_it cbt_ceil(cbt_t cbt, const void *key);
+// Returns the entry with the greatest key at most the given key, or NULL.
+cbt_it cbt_floor(cbt_t cbt, const void *key);
+
+// Calls fn on each entry with a key at least lo and less than hi, in order.
+// A NULL lo or hi leaves that end unbounded. As blt_allprefixed(), halts and
+// returns the status if fn returns anything but 1, and otherwise returns 1.
+// Both ends are found with a single descent each; the rest is a walk along
+// the linked list.
+int cbt_range(cbt_t cbt, const void *lo, const void *hi, int (*fn)(cbt_it));
+#endif
 void cbt_put(cbt_it it, void *data);
 void *cbt_get(cbt_it it);
 char *cbt_key(cbt_it it);
@@ -1,17 +1,61 @@
 // Benchmark CBT. For example:
 //
 //   $ cbt_bm < /usr/share/dict/words
+//
+// With the argument "u", keys are padded with zeros to a fixed length: the
+// first of 8, 16, 20 or 32 bytes that fits them all, or else the length of
+// the longest key. With "enc", keys are prefixed with their lengths.
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "bm.h"
 #include "cbt.h"
 
 #define REP(i,n) for(int i=0;i<n;i++)
 
+static char *mode = "";
+static size_t keybytes;
+
+// Converts keys to the form the mode expects, and totals their sizes.
+static cbt_t convert(char **key, int m) {
+  if (!strcmp(mode, "u")) {
+    int len = 0;
+    REP(i, m) if (len < strlen(key[i])) len = strlen(key[i]);
+    int fixed[] = { 8, 16, 20, 32 };
+    REP(i, 4) if (len <= fixed[i]) {
+      len = fixed[i];
+      break;
+    }
+    REP(i, m) {
+      char *k = calloc(len, 1);
+      memcpy(k, key[i], strlen(key[i]));
+      free(key[i]);
+      key[i] = k;
+    }
+    keybytes = (size_t) len * m;
+    return cbt_new_u(len);
+  }
+  if (!strcmp(mode, "enc")) {
+    REP(i, m) {
+      int len = strlen(key[i]);
+      char *k = malloc(len + 2);
+      k[0] = len & 255;
+      k[1] = len >> 8;
+      memcpy(k + 2, key[i], len);
+      free(key[i]);
+      key[i] = k;
+      keybytes += len + 2;
+    }
+    return cbt_new_enc();
+  }
+  REP(i, m) keybytes += strlen(key[i]) + 1;
+  return cbt_new();
+}
+
 void f(char **key, int m) {
-  cbt_t cbt = cbt_new();
+  cbt_t cbt = convert(key, m);
 
   int count = 0;
   bm_init();
@@ -22,19 +66,26 @@ void f(char **key, int m) {
     exit(1);
   }
   bm_report("CBT get");
+#ifdef CBT_COMPACT
+  cbt_forall(cbt, ({ void _(cbt_it it) { count++; }_; }));
+#else
   for (cbt_it it = cbt_first(cbt); it; it = cbt_next(it)) count++;
+#endif
   if (count != m) {
     fprintf(stderr, "BUG!\n");
     exit(1);
   }
   bm_report("CBT iterate");
   printf("CBT overhead: %lu bytes\n", cbt_overhead(cbt));
+  printf("CBT bytes_per_key: %.2f\n",
+      (double) (cbt_overhead(cbt) + keybytes) / m);
   bm_init();
   REP(i, m) cbt_remove(cbt, key[i]);
   bm_report("CBT delete");
 }
 
-int main() {
+int main(int argc, char **argv) {
+  if (argc > 1) mode = argv[1];
   bm_read_keys(f);
   return 0;
 }
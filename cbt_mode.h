@@ -0,0 +1,261 @@
+// Operations on crit-bit trees, specialised for one kind of key so the
+// compiler can inline key handling into the loops. cbt.c includes this file
+// once for each kind of key, after defining:
+//
+//   MODE                Suffix for the names of the functions defined here.
+//   KEYLEN(cbt, k)      Number of bytes in the key k.
+//   CMP(cbt, k0, k1)    Zero if and only if the keys are equal.
+//   DUP(cbt, k)         Copy of the key k from the tree's allocator.
+//   GETCRIT(cbt, k0, k1)  As getcrit() in cbt.c.
+
+#define FN_(name, mode) name##_##mode
+#define FN(name, mode) FN_(name, mode)
+
+static int FN(keylen, MODE)(cbt_t cbt, const void *key) {
+  return KEYLEN(cbt, key);
+}
+
+static cbt_it FN(at, MODE)(cbt_t cbt, const void *key) {
+  cbt_node_ptr p = get_root(cbt);
+  if (!p) return 0;
+  int len = (KEYLEN(cbt, key) << 3) - 1;
+  for (;;) {
+    if (IS_EXT(p)) break;
+    if (len < p->crit) {
+      do p = LEFT(p); while (!IS_EXT(p));
+      break;
+    }
+    p = testbit(key, p) ? RIGHT(p) : LEFT(p);
+  }
+  if (!CMP(cbt, ((cbt_leaf_ptr) p)->key, key)) return (cbt_leaf_ptr) p;
+  return 0;
+}
+
+static int FN(insert_with, MODE)(cbt_it *it, cbt_t cbt, void *(*fn)(void *),
+    const void *key) {
+  if (!cbt->root) {
+#ifdef CBT_COMPACT
+    cbt_leaf_ptr leaf = mem_alloc(cbt, sizeof(struct cbt_node_s));
+    leaf->data = fn(0), leaf->key = DUP(cbt, key);
+#else
+    cbt_leaf_ptr leaf = mem_alloc(cbt, sizeof(cbt_leaf_t));
+    leaf->crit = EXT, leaf->data = fn(0), leaf->key = DUP(cbt, key);
+    leaf->next = leaf->prev = 0;
+    PUBLISH(cbt->first, leaf);
+    PUBLISH(cbt->last, leaf);
+#endif
+    PUBLISH(cbt->root, (cbt_node_ptr) leaf);
+    cbt->count++;
+    return *it = leaf, 1;
+  }
+
+  cbt_node_ptr t = cbt->root;
+  int keylen = (KEYLEN(cbt, key) << 3) - 1;
+
+  // Record the first nodes of the path, so we need not walk down from the
+  // root again to find where a new node goes.
+  cbt_node_ptr path[CBT_PATH + 1];
+  int depth = 0;
+  path[0] = t;
+  while (!IS_EXT(t)) {
+    // If the key is shorter than the remaining keys on this subtree, we can
+    // compare it against any of them (and are guaranteed the new node must be
+    // inserted above this node). We simply let it follow the rightmost path.
+    t = keylen < t->crit || testbit(key, t) ? RIGHT(t) : LEFT(t);
+    if (++depth <= CBT_PATH) path[depth] = t;
+  }
+
+  cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
+  int res = GETCRIT(cbt, key, leaf->key);
+  if (!res) {
+    PUBLISH(leaf->data, fn(leaf->data));
+    return *it = leaf, 0;
+  }
+
+  cbt->count++;
+#ifdef CBT_COMPACT
+  // Move the node where the new one goes into a new pair alongside the new
+  // leaf, and make it the parent of the pair.
+  int crit = abs(res) - 1;
+  int i = depth < CBT_PATH ? depth : CBT_PATH;
+  while (i > 0 && crit < path[i - 1]->crit) i--;
+  t = path[i];
+  while (!IS_EXT(t) && crit > t->crit) t = testbit(key, t) ? RIGHT(t) : LEFT(t);
+  cbt_node_ptr pair = mem_alloc(cbt, 2 * sizeof(*pair));
+  cbt_leaf_ptr pleaf = (cbt_leaf_ptr) (pair + (res > 0));
+  pair[res <= 0] = *t;
+  pleaf->data = fn(0), pleaf->key = DUP(cbt, key);
+  struct cbt_node_s n = {
+    .crit = crit, .mask = 0x80 >> (crit & 7), .is_internal = 1, .kid = pair
+  };
+  *t = n;
+  return *it = pleaf, 1;
+#else
+  cbt_leaf_ptr pleaf = mem_alloc(cbt, sizeof(cbt_leaf_t));
+  cbt_node_ptr pnode = mem_alloc(cbt, sizeof(cbt_node_t));
+  pleaf->crit = EXT, pleaf->data = fn(0), pleaf->key = DUP(cbt, key);
+  pnode->crit = abs(res) - 1;
+  pnode->mask = 0x80 >> (pnode->crit & 7);
+
+  // Crit bits increase down the path, so scan up from the bottom. If the
+  // path is longer than we recorded, walk the rest.
+  int i = depth < CBT_PATH ? depth : CBT_PATH;
+  while (i > 0 && pnode->crit < path[i - 1]->crit) i--;
+  cbt_node_ptr t0 = i ? path[i - 1] : 0, t1 = path[i];
+  while(EXT != t1->crit && pnode->crit > t1->crit) {
+    t0 = t1, t1 = testbit(key, t1) ? t1->right : t1->left;
+  }
+
+  if (res > 0) {
+    // Key is bigger, therefore it goes on the right.
+    pnode->left = t1;
+    pnode->right = (cbt_node_ptr) pleaf;
+    // The rightmost child of the left subtree must be the predecessor.
+    for (t = pnode->left; t->crit != EXT; t = t->right);
+    cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
+    pleaf->next = leaf->next;
+    pleaf->prev = leaf;
+    PUBLISH(leaf->next, pleaf);
+    if (pleaf->next) PUBLISH(pleaf->next->prev, pleaf);
+    else PUBLISH(cbt->last, pleaf);
+  } else {
+    // Key is smaller, therefore it goes on the left.
+    pnode->left = (cbt_node_ptr) pleaf;
+    pnode->right = t1;
+    // The leftmost child of the right subtree must be the successor.
+    for (t = pnode->right; t->crit != EXT; t = t->left);
+    cbt_leaf_ptr leaf = (cbt_leaf_ptr) t;
+    pleaf->prev = leaf->prev;
+    pleaf->next = leaf;
+    PUBLISH(leaf->prev, pleaf);
+    if (pleaf->prev) PUBLISH(pleaf->prev->next, pleaf);
+    else PUBLISH(cbt->first, pleaf);
+  }
+
+  // Readers can reach the new leaf along the list already, and now through
+  // the tree.
+  if (!t0) {
+    PUBLISH(cbt->root, pnode);
+  } else if (t0->left == t1) {
+    PUBLISH(t0->left, pnode);
+  } else {
+    PUBLISH(t0->right, pnode);
+  }
+  return *it = pleaf, 1;
+#endif
+}
+
+#ifndef CBT_COMPACT
+// Returns the leaf with the given key if there is one. Otherwise returns the
+// leaf that would follow the key if way is 0, or precede it if way is 1, or
+// NULL if there is no such leaf. We descend once to find the subtree the key
+// would join, then step along the leaf list.
+static cbt_it FN(seek, MODE)(cbt_t cbt, const void *key, int way) {
+  cbt_node_ptr t = get_root(cbt);
+  if (!t) return 0;
+  int keylen = (KEYLEN(cbt, key) << 3) - 1;
+  cbt_node_ptr path[CBT_PATH + 1];
+  int depth = 0;
+  path[0] = t;
+  while (!IS_EXT(t)) {
+    t = keylen < t->crit || testbit(key, t) ? RIGHT(t) : LEFT(t);
+    if (++depth <= CBT_PATH) path[depth] = t;
+  }
+  int res = GETCRIT(cbt, key, ((cbt_leaf_ptr) t)->key);
+  if (!res) return (cbt_leaf_ptr) t;
+
+  // Every key in the subtree where the key would go lies on the same side
+  // of it, so the answer is next to one end of that subtree.
+  int crit = abs(res) - 1;
+  int i = depth < CBT_PATH ? depth : CBT_PATH;
+  while (i > 0 && crit < path[i - 1]->crit) i--;
+  t = path[i];
+  while (!IS_EXT(t) && crit > t->crit) t = testbit(key, t) ? RIGHT(t) : LEFT(t);
+  if (res > 0) {
+    while (!IS_EXT(t)) t = RIGHT(t);
+    return way ? (cbt_leaf_ptr) t : NEXT((cbt_leaf_ptr) t);
+  }
+  while (!IS_EXT(t)) t = LEFT(t);
+  return way ? PREV((cbt_leaf_ptr) t) : (cbt_leaf_ptr) t;
+}
+
+static int FN(range, MODE)(cbt_t cbt, const void *lo, const void *hi,
+    int (*fn)(cbt_it)) {
+  if (lo && hi && GETCRIT(cbt, lo, hi) >= 0) return 1;
+  cbt_it end = hi ? FN(seek, MODE)(cbt, hi, 0) : 0;
+  // In an RCU tree the writer may remove end while we scan, so we also
+  // watch for keys past hi.
+  int check = hi && cbt->rcu;
+  for (cbt_it it = lo ? FN(seek, MODE)(cbt, lo, 0) : cbt_first(cbt);
+      it && it != end; it = NEXT(it)) {
+    if (check && GETCRIT(cbt, it->key, hi) >= 0) break;
+    int status = fn(it);
+    if (status != 1) return status;
+  }
+  return 1;
+}
+#endif
+
+static void *FN(remove, MODE)(cbt_t cbt, const void *key) {
+  assert(cbt->root);
+  assert(cbt_has(cbt, key));
+#ifdef CBT_COMPACT
+  cbt_node_ptr t0 = 0, t = cbt->root;
+  while (!IS_EXT(t)) t0 = t, t = testbit(key, t) ? RIGHT(t) : LEFT(t);
+  cbt->count--;
+  cbt_leaf_ptr p = (cbt_leaf_ptr) t;
+  void *data = p->data;
+  free_key(cbt, p->key);
+  if (!t0) {
+    mem_free(cbt, cbt->root, sizeof(*cbt->root));
+    cbt->root = 0;
+  } else {
+    // The sibling takes the place of the parent.
+    cbt_node_ptr q = t0->kid;
+    *t0 = q[t == q];
+    mem_free(cbt, q, 2 * sizeof(*q));
+  }
+  return data;
+#else
+  cbt_node_ptr t0 = 0, t00 = 0, t = cbt->root;
+  while (EXT != t->crit) {
+    assert((KEYLEN(cbt, key) << 3) - 1 >= t->crit);
+    t00 = t0, t0 = t, t = testbit(key, t) ? t->right : t->left;
+  }
+  cbt->count--;
+  cbt_leaf_ptr p = (cbt_leaf_ptr) t;
+  if (!t0) {
+    PUBLISH(cbt->root, 0);
+  } else {
+    cbt_node_ptr sibling = t0->left == t ? t0->right : t0->left;
+    if (!t00) {  // One-level down: reassign root.
+      PUBLISH(cbt->root, sibling);
+    } else {  // Reassign grandparent.
+      if (t00->left == t0) {
+        PUBLISH(t00->left, sibling);
+      } else {
+        PUBLISH(t00->right, sibling);
+      }
+    }
+    retire(cbt, t0, sizeof(cbt_node_t));
+  }
+  // Leave the links of the removed leaf alone, so a reader standing on it
+  // can still step off it.
+  if (p->next) PUBLISH(p->next->prev, p->prev);
+  else PUBLISH(cbt->last, p->prev);
+  if (p->prev) PUBLISH(p->prev->next, p->next);
+  else PUBLISH(cbt->first, p->next);
+  void *data = p->data;
+  retire(cbt, p->key, key_size(cbt, p->key));
+  retire(cbt, p, sizeof(cbt_leaf_t));
+  return data;
+#endif
+}
+
+#undef FN
+#undef FN_
+#undef MODE
+#undef KEYLEN
+#undef CMP
+#undef DUP
+#undef GETCRIT
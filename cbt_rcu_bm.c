@@ -0,0 +1,99 @@
+// Benchmark concurrent CBT range scans under a single writer, comparing an
+// RCU tree against a tree guarded by a rwlock. For example:
+//
+//   $ cbt_rcu_bm 1 2 4 8 < /usr/share/dict/words
+//
+// Each reader scans runs of 1000 keys from random starting points, visiting
+// as many keys as there are in all, while the writer repeatedly removes and
+// reinserts keys.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "cbt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+enum { SCAN = 1000 };
+
+static int nthreads[64], nn;
+static char **key;
+static int m;
+static cbt_t cbt;
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile int done;
+static int use_rcu;
+
+static void *reader(void *arg) {
+  intptr_t seed = (intptr_t) arg;
+  int r = use_rcu ? cbt_rcu_register(cbt) : 0;
+  intptr_t visited = 0;
+  for (int i = 0; visited < m; i++) {
+    char *k = key[(i + seed * 7919) * 104729L % m];
+    int count = 0;
+    int visit(cbt_it it) { return ++count < SCAN; }
+    if (use_rcu) {
+      cbt_range(cbt, k, 0, visit);
+      cbt_rcu_quiescent(cbt, r);
+    } else {
+      pthread_rwlock_rdlock(&lock);
+      cbt_range(cbt, k, 0, visit);
+      pthread_rwlock_unlock(&lock);
+    }
+    visited += count;
+  }
+  if (use_rcu) cbt_rcu_unregister(cbt, r);
+  return (void *) visited;
+}
+
+static void *writer(void *unused) {
+  intptr_t writes = 0;
+  for (int i = 0; !done; i = (i + 1) % m, writes++) {
+    if (!use_rcu) pthread_rwlock_wrlock(&lock);
+    cbt_remove(cbt, key[i]);
+    if (!use_rcu) pthread_rwlock_unlock(&lock);
+    if (!use_rcu) pthread_rwlock_wrlock(&lock);
+    cbt_put_at(cbt, (void *) (intptr_t) i, key[i]);
+    if (!use_rcu) pthread_rwlock_unlock(&lock);
+  }
+  return (void *) writes;
+}
+
+void f(char **k, int n) {
+  key = k;
+  m = n;
+  for (use_rcu = 0; use_rcu < 2; use_rcu++) {
+    cbt = cbt_new();
+    if (use_rcu) cbt_rcu_enable(cbt);
+    REP(i, m) cbt_put_at(cbt, (void *) (intptr_t) i, key[i]);
+    REP(j, nn) {
+      int t = nthreads[j];
+      pthread_t w, r[t];
+      done = 0;
+      bm_init();
+      pthread_create(&w, 0, writer, 0);
+      REP(i, t) pthread_create(r + i, 0, reader, (void *) (intptr_t) i);
+      REP(i, t) pthread_join(r[i], 0);
+      done = 1;
+      void *writes;
+      pthread_join(w, &writes);
+      char msg[64];
+      sprintf(msg, "CBT %s scan, %d threads", use_rcu ? "rcu" : "rwlock", t);
+      bm_report(msg);
+      printf("CBT %s writes, %d threads: %ld\n", use_rcu ? "rcu" : "rwlock", t,
+          (long) (intptr_t) writes);
+    }
+    cbt_delete(cbt);
+  }
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc && nn < 64; i++) nthreads[nn++] = atoi(argv[i]);
+  if (!nn) {
+    for (int t = 1; t <= 8; t *= 2) nthreads[nn++] = t;
+  }
+  bm_read_keys(f);
+  return 0;
+}
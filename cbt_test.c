@@ -0,0 +1,416 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbt.h"
+
+#define EXPECT(_x_) if (_x_); else fprintf(stderr, "%s:%d: FAIL\n", __FILE__, __LINE__)
+#define F(i, n) for(int i = 0; i < n; i++)
+
+// Checks cbt_forall() visits n keys in increasing order.
+static void check_order(cbt_t cbt, int n,
+    int (*cmp)(const void *, const void *)) {
+  const void *prev = 0;
+  int count = 0;
+  cbt_forall(cbt, ({ void _(cbt_it it) {
+    EXPECT(!prev || cmp(prev, cbt_key(it)) < 0);
+    prev = cbt_key(it);
+    count++;
+  }_; }));
+  EXPECT(count == n && cbt_size(cbt) == n);
+}
+
+static void *enc(const char *s, int len) {
+  uint8_t *k = malloc(len + 6), *p = k + 2;
+  if (len < 0xffff) {
+    k[0] = len, k[1] = len >> 8;
+  } else {
+    k[0] = k[1] = 0xff;
+    F(i, 4) *p++ = len >> 8 * i;
+  }
+  memcpy(p, s, len);
+  return k;
+}
+
+// Keys that differ beyond the first 4 KB.
+void test_long_keys() {
+  enum { n = 20, len = 9000 };
+  char *s[n];
+  F(i, n) {
+    s[i] = malloc(len + 1);
+    memset(s[i], 'x', len);
+    s[i][len] = 0;
+    // Differ at the last byte, at 5000, or by being a prefix.
+    if (i % 3 == 0) s[i][len - 1] = 'a' + i;
+    if (i % 3 == 1) s[i][5000] = 'a' + i;
+    if (i % 3 == 2) s[i][len - i] = 0;
+  }
+
+  cbt_t cbt = cbt_new();
+  F(i, n) cbt_put_at(cbt, (void *) (intptr_t) i, s[i]);
+  F(i, n) EXPECT(cbt_get_at(cbt, s[i]) == (void *) (intptr_t) i);
+  check_order(cbt, n, ({ int _(const void *a, const void *b) {
+    return strcmp(a, b);
+  }_; }));
+  F(i, n) if (i % 2) {
+    EXPECT(cbt_remove(cbt, s[i]) == (void *) (intptr_t) i);
+  }
+  F(i, n) EXPECT(cbt_has(cbt, s[i]) == !(i % 2));
+  cbt_delete(cbt);
+
+  cbt = cbt_new_u(len);
+  F(i, n) cbt_put_at(cbt, (void *) (intptr_t) i, s[i]);
+  F(i, n) EXPECT(cbt_get_at(cbt, s[i]) == (void *) (intptr_t) i);
+  check_order(cbt, n, ({ int _(const void *a, const void *b) {
+    return memcmp(a, b, len);
+  }_; }));
+  cbt_delete(cbt);
+
+  // Keys of 0xffff bytes and more have escaped lengths.
+  cbt = cbt_new_enc();
+  char *big = malloc(70000);
+  memset(big, 'y', 70000);
+  int lens[] = { 0, 3, 0xfffe, 0xffff, 70000 };
+  void *k[10];
+  F(i, 5) {
+    k[2 * i] = enc(big, lens[i]);
+    big[lens[i] ? lens[i] - 1 : 0] = 'z';
+    k[2 * i + 1] = enc(big, lens[i]);
+    big[lens[i] ? lens[i] - 1 : 0] = 'y';
+  }
+  F(i, 10) cbt_put_at(cbt, (void *) (intptr_t) i, k[i]);
+  // Keys of length 0 are the same.
+  EXPECT(cbt_size(cbt) == 9);
+  F(i, 10) {
+    EXPECT(cbt_get_at(cbt, k[i]) == (void *) (intptr_t) (i ? i : 1));
+  }
+  F(i, 9) EXPECT(cbt_remove(cbt, k[i + 1]) == (void *) (intptr_t) (i + 1));
+  EXPECT(!cbt_size(cbt));
+  F(i, 10) free(k[i]);
+  free(big);
+  cbt_delete(cbt);
+  F(i, n) free(s[i]);
+}
+
+// Keys that differ only in their last bytes. Lookups once ignored the bits
+// of the last two bytes, as many as the length takes.
+void test_enc() {
+  cbt_t cbt = cbt_new_enc();
+  char *a = enc("abc", 3), *b = enc("abd", 3);
+  cbt_put_at(cbt, (void *) 1, a);
+  EXPECT(!cbt_has(cbt, b));
+  cbt_put_at(cbt, (void *) 2, b);
+  EXPECT(cbt_get_at(cbt, a) == (void *) 1 && cbt_get_at(cbt, b) == (void *) 2);
+  cbt_delete(cbt);
+  free(a);
+  free(b);
+
+  // Flip each bit of the last two bytes, for short and escaped lengths.
+  int lens[] = { 1, 2, 5, 0xffff, 70000 };
+  char *s = malloc(70000);
+  F(l, 5) {
+    int len = lens[l];
+    memset(s, 'q', len);
+    cbt = cbt_new_enc();
+    void *k[17];
+    F(i, 17) {
+      if (i) s[len - 1 - (i - 1) / 8 % len] ^= 1 << (i - 1) % 8;
+      k[i] = enc(s, len);
+      if (i) s[len - 1 - (i - 1) / 8 % len] ^= 1 << (i - 1) % 8;
+    }
+    // With one byte, the last 8 flips repeat the first 8.
+    int n = len == 1 ? 9 : 17;
+    F(i, n) cbt_put_at(cbt, (void *) (intptr_t) (i + 1), k[i]);
+    EXPECT(cbt_size(cbt) == n);
+    F(i, n) EXPECT(cbt_get_at(cbt, k[i]) == (void *) (intptr_t) (i + 1));
+    F(i, 17) free(k[i]);
+    cbt_delete(cbt);
+  }
+  free(s);
+}
+
+// Key i of a chain in which each key branches off at the next bit, so a
+// tree of the first n keys is n levels deep. The chain runs down the right
+// if way is 1, and down the left otherwise, using 7 bits of each byte.
+static char *chain_key(int i, int way) {
+  int q = way ? i / 8 : i / 7;
+  char *s = malloc(q + 2);
+  memset(s, way ? 0xff : 1, q);
+  s[q] = way ? 0xff << (8 - i % 8) : 1 | 0x80 >> i % 7;
+  s[q + 1] = 0;
+  return s;
+}
+
+static void *delete_deep(void *cbt) {
+  cbt_delete(cbt);
+  return 0;
+}
+
+// Deep trees are walked and freed without recursing, even on a 64 KB stack.
+void test_deep() {
+  enum { n = 8000 };
+  char *key[n];
+  int order[n];
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 << 10);
+  // Walks the tree in order, then empties it, expecting the same order.
+  void *walk_deep(void *cbt) {
+    char *prev = 0;
+    int m = 0;
+    cbt_forall(cbt, ({ void _(cbt_it it) {
+      EXPECT(!prev || strcmp(prev, cbt_key(it)) < 0);
+      prev = cbt_key(it);
+      order[m++] = (intptr_t) cbt_get(it);
+    }_; }));
+    EXPECT(m == n);
+    m = 0;
+    cbt_clear_with(cbt, ({ void _(void *data, const void *key) {
+      EXPECT(m < n && (intptr_t) data == order[m++]);
+    }_; }));
+    EXPECT(m == n && !cbt_size(cbt));
+    return 0;
+  }
+  F(way, 2) F(clear, 2) {
+    F(i, n) key[i] = chain_key(i, way);
+    cbt_t cbt = cbt_new();
+    F(i, n) cbt_put_at(cbt, (void *) (intptr_t) i, key[i]);
+    EXPECT(cbt_size(cbt) == n);
+    pthread_t th;
+    EXPECT(!pthread_create(&th, &attr, clear ? walk_deep : delete_deep, cbt));
+    pthread_join(th, 0);
+    if (clear) cbt_delete(cbt);
+    F(i, n) free(key[i]);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+#ifndef CBT_COMPACT
+// Seeks and range scans against sorted arrays of keys.
+void test_range() {
+  enum { n = 500 };
+  char *s[n], buf[16];
+  cbt_t cbt = cbt_new();
+  // Even numbers only, so odd ones fall between keys.
+  F(i, n) {
+    sprintf(buf, "%d", 2 * i);
+    s[i] = strdup(buf);
+    cbt_put_at(cbt, (void *) (intptr_t) i, s[i]);
+  }
+  EXPECT(!cbt_prev(cbt_first(cbt)) && cbt_prev(cbt_last(cbt)));
+
+  int cmp(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+  }
+  qsort(s, n, sizeof(*s), cmp);
+  // Returns the index of the least key at least k.
+  int lower(const char *k) {
+    int i = 0;
+    while (i < n && strcmp(s[i], k) < 0) i++;
+    return i;
+  }
+  F(j, 2 * n + 2) {
+    sprintf(buf, "%d", j);
+    int i = lower(buf);
+    cbt_it ceil = cbt_ceil(cbt, buf), floor = cbt_floor(cbt, buf);
+    EXPECT(i == n ? !ceil : ceil && !strcmp(cbt_key(ceil), s[i]));
+    int f = i < n && !strcmp(s[i], buf) ? i : i - 1;
+    EXPECT(f < 0 ? !floor : floor && !strcmp(cbt_key(floor), s[f]));
+  }
+  EXPECT(cbt_ceil(cbt, "") == cbt_first(cbt));
+  EXPECT(!cbt_floor(cbt, ""));
+  EXPECT(cbt_floor(cbt, "A") == cbt_last(cbt));
+
+  // Returns the number of keys visited from lo to hi, checking their order.
+  int range(const char *lo, const char *hi) {
+    int i = lo ? lower(lo) : 0, count = 0;
+    EXPECT(1 == cbt_range(cbt, lo, hi, ({ int _(cbt_it it) {
+      EXPECT(i < n && !strcmp(cbt_key(it), s[i]));
+      i++;
+      return ++count, 1;
+    }_; })));
+    return count;
+  }
+  EXPECT(range(0, 0) == n);
+  EXPECT(range("10", "100") == 1);
+  EXPECT(range("11", "12") == lower("12") - lower("11"));
+  EXPECT(range("11", "100") == 0);
+  EXPECT(range("12", "10") == 0);
+  EXPECT(range("500", 0) == lower("~") - lower("500"));
+  EXPECT(range(0, "3") == lower("3"));
+  EXPECT(range("2", "4") == lower("4") - lower("2"));
+  // Halting early returns the status.
+  int count = 0;
+  EXPECT(7 == cbt_range(cbt, "1", 0, ({ int _(cbt_it it) {
+    return ++count < 3 ? 1 : 7;
+  }_; })) && count == 3);
+
+  cbt_delete(cbt);
+  F(i, n) free(s[i]);
+
+  // Fixed-length keys.
+  cbt = cbt_new_u(4);
+  uint8_t k[4];
+  F(i, 256) {
+    k[0] = k[1] = 0, k[2] = i, k[3] = 2 * (i % 16);
+    cbt_put_at(cbt, (void *) (intptr_t) i, k);
+  }
+  k[0] = k[1] = k[2] = 0, k[3] = 1;
+  EXPECT((intptr_t) cbt_get(cbt_ceil(cbt, k)) == 1);
+  EXPECT((intptr_t) cbt_get(cbt_floor(cbt, k)) == 0);
+  k[2] = 255, k[3] = 31;
+  EXPECT(!cbt_ceil(cbt, k) && cbt_floor(cbt, k) == cbt_last(cbt));
+  cbt_delete(cbt);
+}
+
+void test_rcu() {
+  cbt_t cbt = cbt_new();
+  EXPECT(cbt_rcu_enable(cbt));
+  char *s[] = { "a", "b", "c", "d" };
+  F(i, 4) cbt_put_at(cbt, (void *) (intptr_t) i, s[i]);
+  int reader = cbt_rcu_register(cbt);
+  EXPECT(reader >= 0);
+  // An entry held by a reader survives the writer removing it, and still
+  // leads on to the rest of the list.
+  cbt_it it = cbt_at(cbt, "b");
+  EXPECT(cbt_remove(cbt, "b") == (void *) 1);
+  EXPECT(cbt_remove(cbt, "c") == (void *) 2);
+  F(i, 4096) {
+    char k[8];
+    snprintf(k, sizeof(k), "%d", i);
+    cbt_put_at(cbt, 0, k);
+    cbt_remove(cbt, k);
+  }
+  EXPECT(!strcmp(cbt_key(it), "b"));
+  it = cbt_next(cbt_next(it));
+  EXPECT(it && !strcmp(cbt_key(it), "d"));
+  cbt_rcu_quiescent(cbt, reader);
+  EXPECT(cbt_size(cbt) == 2 && !strcmp(cbt_key(cbt_ceil(cbt, "b")), "d"));
+  cbt_rcu_unregister(cbt, reader);
+  cbt_delete(cbt);
+}
+
+// Readers scan while a writer removes and reinserts the odd keys. Each scan
+// must be in order, and see every even key.
+enum { SCAN_KEYS = 2000, SCAN_READERS = 2, SCAN_KEYLEN = 8 };
+static cbt_t scan_cbt;
+static int scan_finished;
+
+static void scan_key(char *k, int i) { snprintf(k, SCAN_KEYLEN, "%05d", i); }
+
+static void *scan_reader(void *unused) {
+  int r = cbt_rcu_register(scan_cbt);
+  char lo[SCAN_KEYLEN], hi[SCAN_KEYLEN];
+  F(round, 50) {
+    int last = -1, even = 0;
+    scan_key(lo, 100), scan_key(hi, SCAN_KEYS - 100);
+    cbt_range(scan_cbt, lo, hi, ({ int _(cbt_it it) {
+      int i = atoi(cbt_key(it));
+      EXPECT(i > last && i >= 100 && i < SCAN_KEYS - 100);
+      EXPECT((intptr_t) cbt_get(it) == i);
+      last = i;
+      even += !(i & 1);
+      return 1;
+    }_; }));
+    EXPECT(even == (SCAN_KEYS - 200) / 2);
+    cbt_rcu_quiescent(scan_cbt, r);
+  }
+  cbt_rcu_unregister(scan_cbt, r);
+  __atomic_add_fetch(&scan_finished, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void test_rcu_scan() {
+  scan_cbt = cbt_new();
+  EXPECT(cbt_rcu_enable(scan_cbt));
+  char k[SCAN_KEYLEN];
+  F(i, SCAN_KEYS) scan_key(k, i), cbt_put_at(scan_cbt, (void *) (intptr_t) i, k);
+  pthread_t th[SCAN_READERS];
+  F(t, SCAN_READERS) pthread_create(th + t, 0, scan_reader, 0);
+  for (int i = 1;
+      __atomic_load_n(&scan_finished, __ATOMIC_ACQUIRE) < SCAN_READERS;
+      i = (i + 2) % SCAN_KEYS) {
+    scan_key(k, i);
+    EXPECT(cbt_remove(scan_cbt, k) == (void *) (intptr_t) i);
+    cbt_put_at(scan_cbt, (void *) (intptr_t) i, k);
+  }
+  F(t, SCAN_READERS) pthread_join(th[t], 0);
+  EXPECT(cbt_size(scan_cbt) == SCAN_KEYS);
+  cbt_delete(scan_cbt);
+}
+#endif
+
+// Blocks lent to a tree, kept in another tree keyed by address, with their
+// sizes as data.
+static void *lend(void *live, size_t n) {
+  void *p = malloc(n);
+  cbt_put_at(live, (void *) n, &p);
+  return p;
+}
+
+static void take_back(void *live, void *p, size_t n) {
+  EXPECT(cbt_remove(live, &p) == (void *) n);
+  free(p);
+}
+
+void test_allocator() {
+  cbt_t live = cbt_new_u(sizeof(void *));
+  EXPECT(!cbt_new_with_allocator(lend, 0, live));
+  cbt_t cbt = cbt_new_with_allocator(lend, take_back, live);
+  EXPECT(!cbt_set_allocator(cbt, 0, take_back, live));
+  char key[16];
+  F(i, 1000) snprintf(key, sizeof(key), "%d", i), cbt_put_at(cbt, 0, key);
+  // Each key and leaf, and each node or pair of kids.
+#ifdef CBT_COMPACT
+  EXPECT(cbt_size(live) == 1000 + 1 + 999);
+#else
+  EXPECT(cbt_size(live) == 2 * 1000 + 999);
+#endif
+  // Blocks already allocated cannot change hands.
+  EXPECT(!cbt_set_allocator(cbt, 0, 0, 0));
+  F(i, 500) snprintf(key, sizeof(key), "%d", 2 * i), cbt_remove(cbt, key);
+  EXPECT(cbt_size(cbt) == 500);
+  cbt_remove_all(cbt);
+  EXPECT(!cbt_size(live));
+  F(i, 10) snprintf(key, sizeof(key), "%d", i), cbt_put_at(cbt, 0, key);
+  cbt_delete(cbt);
+  EXPECT(!cbt_size(live));
+
+  // Other kinds of keys have other sizes.
+  cbt = cbt_new_enc();
+  EXPECT(cbt_set_allocator(cbt, lend, take_back, live));
+  void *k[3] = { enc("a", 1), enc("bcd", 3), enc("", 0) };
+  F(i, 3) cbt_put_at(cbt, 0, k[i]);
+  EXPECT(cbt_remove(cbt, k[1]) == 0 && cbt_size(cbt) == 2);
+  cbt_delete(cbt);
+  EXPECT(!cbt_size(live));
+  F(i, 3) free(k[i]);
+
+#ifndef CBT_COMPACT
+  // Removals in RCU trees wait in limbo.
+  cbt = cbt_new_with_allocator(lend, take_back, live);
+  EXPECT(cbt_rcu_enable(cbt));
+  F(i, 5000) {
+    snprintf(key, sizeof(key), "%d", i);
+    cbt_put_at(cbt, 0, key);
+    if (i % 3) cbt_remove(cbt, key);
+  }
+  cbt_delete(cbt);
+  EXPECT(!cbt_size(live));
+#endif
+  cbt_delete(live);
+}
+
+int main() {
+#ifndef CBT_COMPACT
+  test_range();
+  test_rcu();
+  test_rcu_scan();
+#endif
+  test_deep();
+  test_enc();
+  test_long_keys();
+  test_allocator();
+  return 0;
+}
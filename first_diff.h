@@ -0,0 +1,208 @@
+// Finding the first byte where two keys differ, many bytes at a time.
+//
+// Usage:
+//
+//   size_t i = first_diff(a, b);         // a, b are NUL-terminated.
+//   size_t j = first_diff_n(a, b, len);  // Returns len if no difference.
+//
+// On x86-64 we pick SSE2 or AVX2 kernels when the program starts, depending
+// on what the CPU supports. Elsewhere we compare a word at a time on
+// little-endian machines, and a byte at a time otherwise.
+//
+// The string kernels may read a few bytes past the terminating NUL, but never
+// into the next page, so they cannot fault.
+
+#ifndef __FIRST_DIFF_H__
+#define __FIRST_DIFF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FIRST_DIFF_X86
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FIRST_DIFF_WORD
+#endif
+
+#define FIRST_DIFF_NOASAN __attribute__((no_sanitize_address))
+
+static inline size_t first_diff_bytes(const char *a, const char *b) {
+  size_t i = 0;
+  while (a[i] == b[i] && a[i]) i++;
+  return i;
+}
+
+static inline size_t first_diff_n_bytes(const void *a, const void *b,
+    size_t n) {
+  const char *x = a, *y = b;
+  size_t i = 0;
+  while (i < n && x[i] == y[i]) i++;
+  return i;
+}
+
+// Returns 1 if reading w bytes from p could cross into the next page.
+static inline int near_page_end(const char *p, int w) {
+  return ((uintptr_t) p & 4095) > 4096 - w;
+}
+
+#ifdef FIRST_DIFF_WORD
+FIRST_DIFF_NOASAN static inline uint64_t load64(const void *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+// Each byte of the result has its top bit set if the corresponding bytes of
+// a and b differ, or the byte of a is zero. Lower bytes are exact.
+static inline uint64_t word_stop(uint64_t a, uint64_t b) {
+  const uint64_t lo = 0x0101010101010101, hi = 0x8080808080808080;
+  uint64_t d = a ^ b;
+  return ((((d & ~hi) + ~hi) | d) & hi) | ((a - lo) & ~a & hi);
+}
+
+FIRST_DIFF_NOASAN static inline size_t first_diff_word(const char *a,
+    const char *b) {
+  size_t i = 0;
+  for (;;) {
+    if (near_page_end(a + i, 8) || near_page_end(b + i, 8)) {
+      // Step byte by byte past the end of the page.
+      if (a[i] != b[i] || !a[i]) return i;
+      i++;
+      continue;
+    }
+    uint64_t m = word_stop(load64(a + i), load64(b + i));
+    if (m) return i + (__builtin_ctzll(m) >> 3);
+    i += 8;
+  }
+}
+
+static inline size_t first_diff_n_word(const void *a, const void *b,
+    size_t n) {
+  const char *x = a, *y = b;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t m = load64(x + i) ^ load64(y + i);
+    if (m) return i + (__builtin_ctzll(m) >> 3);
+  }
+  return i + first_diff_n_bytes(x + i, y + i, n - i);
+}
+#endif
+
+#ifdef FIRST_DIFF_X86
+FIRST_DIFF_NOASAN static inline size_t first_diff_sse2(const char *a,
+    const char *b) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (;;) {
+    if (near_page_end(a + i, 16) || near_page_end(b + i, 16)) {
+      if (a[i] != b[i] || !a[i]) return i;
+      i++;
+      continue;
+    }
+    __m128i x = _mm_loadu_si128((const __m128i *) (a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *) (b + i));
+    unsigned m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) |
+        _mm_movemask_epi8(_mm_cmpeq_epi8(x, zero));
+    m &= 0xffff;
+    if (m) return i + __builtin_ctz(m);
+    i += 16;
+  }
+}
+
+static inline size_t first_diff_n_sse2(const void *a, const void *b,
+    size_t n) {
+  const char *x = a, *y = b;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *) (x + i)),
+        _mm_loadu_si128((const __m128i *) (y + i)))) ^ 0xffff;
+    if (m) return i + __builtin_ctz(m);
+  }
+  return i + first_diff_n_word(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2"))) FIRST_DIFF_NOASAN
+static inline size_t first_diff_avx2(const char *a, const char *b) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (;;) {
+    if (near_page_end(a + i, 32) || near_page_end(b + i, 32)) {
+      if (a[i] != b[i] || !a[i]) return i;
+      i++;
+      continue;
+    }
+    __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+    unsigned m = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) |
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+    if (m) return i + __builtin_ctz(m);
+    i += 32;
+  }
+}
+
+__attribute__((target("avx2")))
+static inline size_t first_diff_n_avx2(const void *a, const void *b,
+    size_t n) {
+  const char *x = a, *y = b;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    unsigned m = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *) (x + i)),
+        _mm256_loadu_si256((const __m256i *) (y + i))));
+    if (m) return i + __builtin_ctz(m);
+  }
+  return i + first_diff_n_sse2(x + i, y + i, n - i);
+}
+#endif
+
+#if defined(FIRST_DIFF_X86)
+__attribute__((unused))
+static size_t (*first_diff_str)(const char *, const char *) = first_diff_sse2;
+__attribute__((unused))
+static size_t (*first_diff_mem)(const void *, const void *, size_t) =
+    first_diff_n_sse2;
+
+__attribute__((constructor)) static void first_diff_init(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    first_diff_str = first_diff_avx2;
+    first_diff_mem = first_diff_n_avx2;
+  }
+}
+#elif defined(FIRST_DIFF_WORD)
+#define first_diff_str first_diff_word
+#define first_diff_mem first_diff_n_word
+#else
+#define first_diff_str first_diff_bytes
+#define first_diff_mem first_diff_n_bytes
+#endif
+
+// Returns the index of the first byte where the NUL-terminated strings a and
+// b differ, or of the terminating NUL if they are equal.
+static inline size_t first_diff(const char *a, const char *b) {
+  // Most keys differ early. Catch those before an indirect call.
+  if (a[0] != b[0] || !a[0]) return 0;
+  return first_diff_str(a, b);
+}
+
+// Returns the index of the first byte where a and b differ, or n if their
+// first n bytes are equal.
+static inline size_t first_diff_n(const void *a, const void *b, size_t n) {
+#ifdef FIRST_DIFF_WORD
+  // A few words of known length are quicker inline.
+  if (__builtin_constant_p(n) && n <= 32) return first_diff_n_word(a, b, n);
+#endif
+  return first_diff_mem(a, b, n);
+}
+
+// Returns the mask of the leading bit of the nonzero byte x.
+static inline uint8_t leading_bit(uint8_t x) {
+  return 0x80 >> (__builtin_clz(x) - 24);
+}
+
+#endif  // __FIRST_DIFF_H__
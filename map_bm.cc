@@ -3,7 +3,10 @@
 // To benchmark unordered_map:
 //
 //  $ sed 's/\<map\>/unordered_map/g' map_bm.cc > umap_bm.cc
-//  $ g++ -O3 -std=gnu++11 umap_bm.cc -ltcmalloc
+//  $ g++ -O3 -std=gnu++17 umap_bm.cc -ltcmalloc
+//
+// Built with BLT_MAP defined, benchmarks blt::map<int> instead, running
+// exactly the same code through the wrapper in blt_map.h.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +17,15 @@
 #include <string>
 #include <vector>
 
+#ifdef BLT_MAP
+#include "blt_map.h"
+typedef blt::map<int> map_type;
+#define NAME "blt::map"
+#else
+typedef std::map<std::string, int> map_type;
+#define NAME "map"
+#endif
+
 #define REP(i,n) for(int i=0;i<n;i++)
 
 using namespace std;
@@ -54,23 +66,23 @@ int main() {
     key[j] = tmp;
   }
 
-  map<string, int> smap;
+  map_type smap;
 
   bm_init();
   REP(i, m) smap[key[i]] = i;
-  bm_report("map insert");
+  bm_report(NAME " insert");
   REP(i, m) if (i != smap[key[i]]) {
     fprintf(stderr, "BUG!\n");
     exit(1);
   }
-  bm_report("map get");
+  bm_report(NAME " get");
   int count = 0;
-  for (map<string, int>::iterator it = smap.begin(); it != smap.end(); it++) count++;
+  for (map_type::iterator it = smap.begin(); it != smap.end(); it++) count++;
   if (count != m) {
     fprintf(stderr, "BUG!\n");
     exit(1);
   }
-  bm_report("map iterate");
+  bm_report(NAME " iterate");
   smap.clear();
-  bm_report("map delete");
+  bm_report(NAME " delete");
 }
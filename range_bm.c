@@ -0,0 +1,66 @@
+// Benchmark range scans of CBT against BLT. For example:
+//
+//   $ range_bm < /usr/share/dict/words
+//
+// Each scan starts at a random key and visits the next n keys, for a few
+// values of n. CBT scans with cbt_range(), BLT with blt_ceil() and blt_next().
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bm.h"
+#include "blt.h"
+#include "cbt.h"
+
+#define REP(i,n) for(int i=0;i<n;i++)
+
+void f(char **key, int m) {
+  BLT *blt = blt_new();
+  cbt_t cbt = cbt_new();
+  REP(i, m) blt_put(blt, key[i], (void *) (intptr_t) i);
+  REP(i, m) cbt_put_at(cbt, (void *) (intptr_t) i, key[i]);
+
+  int len[] = { 10, 1000, 100000 };
+  REP(k, sizeof(len) / sizeof(*len)) {
+    int n = len[k];
+    // Visit about 10 million keys in all.
+    int scans = 10000000 / n;
+    int *start = malloc(scans * sizeof(*start));
+    srand(1);
+    REP(i, scans) start[i] = rand() % m;
+    char msg[64];
+    intptr_t sum0 = 0, sum1 = 0;
+
+    bm_init();
+    REP(i, scans) {
+      int count = 0;
+      cbt_range(cbt, key[start[i]], 0, ({ int _(cbt_it it) {
+        sum0 += (intptr_t) cbt_get(it);
+        return ++count < n;
+      }_; }));
+    }
+    sprintf(msg, "CBT range %d", n);
+    bm_report(msg);
+
+    REP(i, scans) {
+      BLT_IT *it = blt_ceil(blt, key[start[i]]);
+      for (int count = 0; it && count < n; count++, it = blt_next(blt, it)) {
+        sum1 += (intptr_t) it->data;
+      }
+    }
+    sprintf(msg, "BLT range %d", n);
+    bm_report(msg);
+    if (sum0 != sum1) {
+      fprintf(stderr, "BUG!\n");
+      exit(1);
+    }
+    free(start);
+  }
+  cbt_delete(cbt);
+  blt_clear(blt);
+}
+
+int main() {
+  bm_read_keys(f);
+  return 0;
+}